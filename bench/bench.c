@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "startup.h"
+
+
+static FILE *g_bench_json;
+static bool g_bench_first = true;
+
+
+/**
+ * Returns a monotonic timestamp.
+ *
+ * @return nanoseconds since an arbitrary point
+ */
+uint64_t bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * BENCH_NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Records one result, both human readable on stderr and as a JSON object in
+ * the results file.
+ *
+ * @param name benchmark name
+ * @param param the varied parameter, size or thread count
+ * @param metric what value measures, e.g. "ns_per_op"
+ * @param value measured value
+ */
+void bench_report(const char *name, long param, const char *metric, double value)
+{
+    fprintf(stderr, "%-28s %8ld %-16s %14.2f\n", name, param, metric, value);
+
+    if (!g_bench_json)
+        return;
+
+    fprintf(g_bench_json,
+            "%s\n    { \"name\": \"%s\", \"param\": %ld, "
+            "\"metric\": \"%s\", \"value\": %.3f }",
+            g_bench_first ? "" : ",", name, param, metric, value);
+    g_bench_first = false;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    const char *output = NULL;
+    const char *only = NULL;
+
+    startup_begin();
+
+    while ((opt = getopt(argc, argv, "o:s:")) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        case 's':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-o results.json] [-s queue|audio|library|event|history]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (output && (g_bench_json = fopen(output, "w")) == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    if (g_bench_json)
+        fprintf(g_bench_json, "{\n  \"results\": [");
+
+    if (!only || strcmp(only, "queue") == 0)
+        bench_queue();
+    if (!only || strcmp(only, "audio") == 0)
+        bench_audio();
+    if (!only || strcmp(only, "library") == 0)
+        bench_library();
+    if (!only || strcmp(only, "event") == 0)
+        bench_event();
+    if (!only || strcmp(only, "history") == 0)
+        bench_history();
+
+    if (g_bench_json) {
+        fprintf(g_bench_json, "\n  ]\n}\n");
+        fclose(g_bench_json);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#ifndef SPOTICLI_BENCH_H
+#define SPOTICLI_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BENCH_NS_PER_SEC 1000000000ULL
+
+uint64_t bench_now();
+void bench_report(const char *name, long param, const char *metric, double value);
+
+// suites, each lives in its own file
+void bench_queue();
+void bench_audio();
+void bench_library();
+void bench_event();
+void bench_history();
+
+#endif // SPOTICLI_BENCH_H
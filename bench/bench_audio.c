@@ -0,0 +1,413 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "audio.h"
+#include "audio/convert.h"
+#include "audio/loudness.h"
+#include "audio/eq.h"
+#include "audio/crossfade.h"
+
+
+#define BENCH_CHUNK_FRAMES  1024    // frames per delivery, like libspotify
+#define BENCH_CHANNELS      2
+#define BENCH_RATE          44100
+#define BENCH_MAX_THREADS   4
+
+static const int chunk_sizes[] = { 256, 1024, 4096, 8192 };
+
+#define AUDIO_NSIZES (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+static int16_t g_frames[8192 * BENCH_CHANNELS];
+
+// sinks bump this once per chunk written, read by the producer
+static volatile unsigned long g_bench_written;
+static bool g_bench_realtime;
+
+
+static int null_open(audio_sink_t *sink, int rate, int channels)
+{
+    sink->handle = sink;
+    return 0;
+}
+
+/**
+ * Pretends to play a chunk, taking as long as the audio lasts when
+ * g_bench_realtime is set.
+ */
+static int null_write(audio_sink_t *sink, const float *samples, int nframes)
+{
+    if (g_bench_realtime)
+        usleep((useconds_t) ((uint64_t) nframes * 1000000 / sink->rate));
+
+    __sync_add_and_fetch(&g_bench_written, 1);
+    return nframes;
+}
+
+static void null_close(audio_sink_t *sink)
+{
+    sink->handle = NULL;
+}
+
+static const audio_sink_ops_t null_sink_ops = {
+    .open   = &null_open,
+    .write  = &null_write,
+    .close  = &null_close
+};
+
+/**
+ * Creates a fifo fed to nsinks null sinks, limits are opened up so the
+ * producer is never refused on the watermark.
+ */
+static void bench_fifo_init(audio_fifo_t *af, int nsinks)
+{
+    int i;
+
+    audio_fifo_init(af);
+    audio_fifo_set_limits(af, AUDIO_BUFFER_MAX, AUDIO_BUFFER_MAX);
+
+    for (i = 0; i < nsinks; i++)
+        audio_fifo_add_sink(af, audio_sink_create(&null_sink_ops, "null"));
+}
+
+/**
+ * Writes a chunk, yielding while the fifo refuses it.
+ */
+static void bench_fifo_put(audio_fifo_t *af)
+{
+    while (audio_fifo_write(af, BENCH_CHANNELS, BENCH_RATE,
+                            g_frames, BENCH_CHUNK_FRAMES) == 0)
+        sched_yield();
+}
+
+/**
+ * Allocation cost of a chunk at varying sizes.
+ */
+static void bench_audio_data_create()
+{
+    size_t i;
+    int n;
+    int rounds = 100000;
+    uint64_t start;
+    audio_data_t *ad;
+
+    for (i = 0; i < AUDIO_NSIZES; i++) {
+        start = bench_now();
+        for (n = 0; n < rounds; n++) {
+            ad = audio_data_create(BENCH_CHANNELS, chunk_sizes[i], BENCH_RATE);
+            audio_data_release(ad);
+        }
+
+        bench_report("audio_data_create", chunk_sizes[i], "ns_per_op",
+                     (double) (bench_now() - start) / rounds);
+    }
+}
+
+/**
+ * Per call cost of the delivery path music_delivery() wraps, with no sink
+ * (producer work only) and with a single consuming sink.
+ */
+static void bench_audio_fifo_write()
+{
+    audio_fifo_t af;
+    int nsinks, n;
+    int rounds = 50000;
+    uint64_t start;
+
+    for (nsinks = 0; nsinks <= 1; nsinks++) {
+        bench_fifo_init(&af, nsinks);
+
+        start = bench_now();
+        for (n = 0; n < rounds; n++)
+            bench_fifo_put(&af);
+
+        bench_report("music_delivery", nsinks, "ns_per_call",
+                     (double) (bench_now() - start) / rounds);
+
+        audio_fifo_release(&af);
+    }
+}
+
+/**
+ * Producer to consumer throughput and single chunk hand off latency with
+ * one to BENCH_MAX_THREADS sinks contending for the fifo.
+ */
+static void bench_audio_fifo_threads()
+{
+    audio_fifo_t af;
+    int nsinks, n;
+    int rounds = 20000;
+    int handoffs = 2000;
+    unsigned long target;
+    uint64_t start, elapsed, worst;
+
+    for (nsinks = 1; nsinks <= BENCH_MAX_THREADS; nsinks++) {
+        bench_fifo_init(&af, nsinks);
+        g_bench_written = 0;
+
+        start = bench_now();
+        for (n = 0; n < rounds; n++)
+            bench_fifo_put(&af);
+
+        target = (unsigned long) rounds * nsinks;
+        while (g_bench_written < target)
+            sched_yield();
+        elapsed = bench_now() - start;
+
+        bench_report("fifo_throughput", nsinks, "chunks_per_sec",
+                     (double) rounds * BENCH_NS_PER_SEC / elapsed);
+
+        // one chunk at a time, until every sink has written it
+        elapsed = 0;
+        worst = 0;
+        for (n = 0; n < handoffs; n++) {
+            target = g_bench_written + nsinks;
+
+            start = bench_now();
+            bench_fifo_put(&af);
+            while (g_bench_written < target)
+                sched_yield();
+
+            start = bench_now() - start;
+            elapsed += start;
+            worst = start > worst ? start : worst;
+        }
+
+        bench_report("fifo_handoff", nsinks, "ns_mean", (double) elapsed / handoffs);
+        bench_report("fifo_handoff", nsinks, "ns_worst", (double) worst);
+
+        audio_fifo_release(&af);
+    }
+}
+
+/**
+ * Float to device format conversion, the last step before every output.
+ */
+static void bench_convert()
+{
+    static float in[8192 * BENCH_CHANNELS];
+    static int32_t out[8192 * BENCH_CHANNELS];
+    sample_format_t format;
+    dither_t dither;
+    int n;
+    int rounds = 2000;
+    int nsamples = 8192 * BENCH_CHANNELS;
+    uint64_t start;
+
+    convert_from_s16(g_frames, in, nsamples, 1.0f);
+    dither_init(&dither, 1);
+
+    for (format = SAMPLE_S16; format <= SAMPLE_S32; format++) {
+        start = bench_now();
+        for (n = 0; n < rounds; n++)
+            convert_to_format(in, out, nsamples, format, &dither);
+
+        bench_report(format == SAMPLE_S16 ? "convert_s16" :
+                     format == SAMPLE_S24 ? "convert_s24" : "convert_s32",
+                     nsamples, "ns_per_sample",
+                     (double) (bench_now() - start) / ((uint64_t) rounds * nsamples));
+    }
+}
+
+/**
+ * Loudness measurement every delivered chunk goes through, also given as
+ * the share of one core it takes to keep up with playback.
+ */
+static void bench_loudness()
+{
+    static float in[8192 * BENCH_CHANNELS];
+    static loudness_t ln;
+    size_t i;
+    int n;
+    int frames = 1 << 22;
+    uint64_t start;
+    double ns;
+    uint32_t noise = 1;
+
+    // the filters cost the same on any signal, noise keeps the gates busy
+    for (n = 0; n < 8192 * BENCH_CHANNELS; n++) {
+        noise = noise * 1664525 + 1013904223;
+        in[n] = (int32_t) noise * (0.25f / 2147483648.0f);
+    }
+
+    for (i = 0; i < AUDIO_NSIZES; i++) {
+        loudness_reset(&ln);
+
+        start = bench_now();
+        for (n = 0; n < frames; n += chunk_sizes[i])
+            loudness_analyze(&ln, in, chunk_sizes[i], BENCH_RATE, BENCH_CHANNELS);
+
+        ns = (double) (bench_now() - start) / frames;
+        bench_report("loudness", chunk_sizes[i], "ns_per_frame", ns);
+        bench_report("loudness", chunk_sizes[i], "cpu_percent",
+                     ns * BENCH_RATE / 1E7);
+    }
+}
+
+/**
+ * A ten band stereo equalizer as every sink runs it, with every band
+ * boosting or cutting so none is skipped, and the cost of a sink picking up
+ * new settings.
+ */
+static void bench_eq()
+{
+    static float in[BENCH_CHUNK_FRAMES * BENCH_CHANNELS];
+    static eq_t eq;
+    static eq_state_t state;
+    eq_params_t params;
+    int n, band;
+    int chunks = 4096;
+    uint64_t start;
+    double ns;
+    uint32_t noise = 1;
+
+    for (n = 0; n < BENCH_CHUNK_FRAMES * BENCH_CHANNELS; n++) {
+        noise = noise * 1664525 + 1013904223;
+        in[n] = (int32_t) noise * (0.25f / 2147483648.0f);
+    }
+
+    eq_init(&eq);
+    eq_state_init(&state);
+    eq_parse("flat", &params);
+
+    start = bench_now();
+    for (n = 0; n < chunks; n++)
+        eq_process(&eq, &state, in, BENCH_CHUNK_FRAMES, BENCH_RATE, BENCH_CHANNELS);
+
+    bench_report("eq_bypass", 0, "ns_per_frame",
+                 (double) (bench_now() - start) / ((uint64_t) chunks * BENCH_CHUNK_FRAMES));
+
+    for (band = 0; band < params.nbands; band++)
+        params.bands[band].gain = band % 2 ? -3 : 3;
+    eq_set(&eq, &params);
+
+    start = bench_now();
+    for (n = 0; n < chunks; n++)
+        eq_process(&eq, &state, in, BENCH_CHUNK_FRAMES, BENCH_RATE, BENCH_CHANNELS);
+
+    ns = (double) (bench_now() - start) / ((uint64_t) chunks * BENCH_CHUNK_FRAMES);
+    bench_report("eq", params.nbands, "ns_per_frame", ns);
+    bench_report("eq", params.nbands, "cpu_percent", ns * BENCH_RATE / 1E7);
+
+    // publish and rebuild, a chunk of a single frame keeps filtering out
+    start = bench_now();
+    for (n = 0; n < chunks; n++) {
+        params.preamp = -(n % 2);
+        eq_set(&eq, &params);
+        eq_process(&eq, &state, in, 1, BENCH_RATE, BENCH_CHANNELS);
+    }
+
+    bench_report("eq_update", params.nbands, "ns_per_op",
+                 (double) (bench_now() - start) / chunks);
+
+    eq_state_release(&state);
+}
+
+/**
+ * Fading a held back tail into the next track, with the tail at the same
+ * rate and at 48 kHz so it is resampled on the way.
+ */
+static void bench_crossfade()
+{
+    static float in[BENCH_CHUNK_FRAMES * BENCH_CHANNELS];
+    static float out[BENCH_CHUNK_FRAMES * BENCH_CHANNELS];
+    static crossfade_t cf;
+    static const int tail_rates[] = { BENCH_RATE, 48000 };
+    int window_ms = 6000;
+    int rounds = 8;
+    int i, n, round, tail_frames, mixed;
+    uint64_t start, elapsed;
+    uint32_t noise = 1;
+
+    for (n = 0; n < BENCH_CHUNK_FRAMES * BENCH_CHANNELS; n++) {
+        noise = noise * 1664525 + 1013904223;
+        in[n] = (int32_t) noise * (0.25f / 2147483648.0f);
+    }
+
+    crossfade_init(&cf, window_ms, CROSSFADE_EQUAL_POWER);
+
+    for (i = 0; i < 2; i++) {
+        elapsed = 0;
+        mixed = 0;
+        tail_frames = crossfade_window(&cf, tail_rates[i]);
+
+        for (round = 0; round < rounds; round++) {
+            crossfade_reset(&cf);
+            for (n = 0; n < tail_frames; n += BENCH_CHUNK_FRAMES)
+                crossfade_capture(&cf, in, MIN(BENCH_CHUNK_FRAMES, tail_frames - n),
+                                  tail_rates[i], BENCH_CHANNELS);
+
+            // mixing in place over and over would decay into denormals
+            start = bench_now();
+            while (cf.tail_frames > 0) {
+                memcpy(out, in, sizeof(out));
+                mixed += crossfade_mix(&cf, out, BENCH_CHUNK_FRAMES,
+                                       BENCH_RATE, BENCH_CHANNELS);
+            }
+            elapsed += bench_now() - start;
+        }
+
+        bench_report(i == 0 ? "crossfade" : "crossfade_resample", tail_rates[i],
+                     "ns_per_frame", (double) elapsed / mixed);
+    }
+
+    crossfade_release(&cf);
+}
+
+/**
+ * Time from audio_fifo_seek() until the first sample of the new position
+ * is written, with a sink playing in real time and the producer refilling
+ * as libspotify would.
+ */
+static void bench_seek_latency()
+{
+    audio_fifo_t af;
+    audio_fifo_stats_t stats;
+    int seek, n;
+    int seeks = 10;
+    double total = 0, worst = 0;
+
+    g_bench_realtime = true;
+    bench_fifo_init(&af, 1);
+    audio_fifo_set_limits(&af, AUDIO_BUFFER_MIN, AUDIO_BUFFER_MAX);
+
+    for (seek = 0; seek < seeks; seek++) {
+        // play a little of the old position
+        for (n = 0; n < 20; n++)
+            bench_fifo_put(&af);
+
+        audio_fifo_seek(&af, 0);
+        do {
+            if (audio_fifo_write(&af, BENCH_CHANNELS, BENCH_RATE,
+                                 g_frames, BENCH_CHUNK_FRAMES) == 0)
+                usleep(1000);
+            audio_fifo_stats(&af, &stats);
+        } while (stats.seek_pending);
+
+        total += stats.seek_latency_ms;
+        worst = stats.seek_latency_ms > worst ? stats.seek_latency_ms : worst;
+    }
+
+    audio_fifo_release(&af);
+    g_bench_realtime = false;
+
+    bench_report("seek_latency", seeks, "ms_mean", total / seeks);
+    bench_report("seek_latency", seeks, "ms_worst", worst);
+}
+
+/**
+ * audio_data_t, audio_fifo_t and conversion benchmarks.
+ */
+void bench_audio()
+{
+    bench_audio_data_create();
+    bench_audio_fifo_write();
+    bench_audio_fifo_threads();
+    bench_convert();
+    bench_loudness();
+    bench_eq();
+    bench_crossfade();
+    bench_seek_latency();
+}
@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "event.h"
+
+
+#define BENCH_EVENTS        200000  // per producer
+#define BENCH_MAX_PRODUCERS 4
+
+static const int producer_counts[] = { 1, 2, 4 };
+
+#define BENCH_NCOUNTS (sizeof(producer_counts) / sizeof(producer_counts[0]))
+
+// the same events through a ring under a mutex, for comparison
+typedef struct bench_locked_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // signalled on post
+    pthread_cond_t space;       // signalled on take
+    event_t events[EVENT_QUEUE_SIZE];
+    unsigned long head;
+    unsigned long tail;
+} bench_locked_t;
+
+static event_queue_t g_queue;
+static uint64_t g_post_worst;   // ns, slowest post that found room
+static bench_locked_t g_locked = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER
+};
+
+
+/**
+ * Keeps the slowest post, racy but the value only ever grows.
+ */
+static void bench_post_time(uint64_t start)
+{
+    uint64_t elapsed = bench_now() - start;
+
+    if (elapsed > __atomic_load_n(&g_post_worst, __ATOMIC_RELAXED))
+        __atomic_store_n(&g_post_worst, elapsed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Posts BENCH_EVENTS events numbered from 0, the producer in the top bits.
+ * A full queue is waited out, nothing may be lost.
+ */
+static void *bench_event_producer(void *arg)
+{
+    int producer = (int) (intptr_t) arg;
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < BENCH_EVENTS; i++) {
+        start = bench_now();
+        while (!event_try_post(&g_queue, EVENT_END_OF_TRACK, producer << 24 | i)) {
+            usleep(50);
+            start = bench_now();
+        }
+        bench_post_time(start);
+    }
+
+    return NULL;
+}
+
+static void *bench_locked_producer(void *arg)
+{
+    int producer = (int) (intptr_t) arg;
+    event_t *event;
+    uint64_t start;
+    bool waited;
+    int i;
+
+    for (i = 0; i < BENCH_EVENTS; i++) {
+        start = bench_now();
+        waited = false;
+
+        pthread_mutex_lock(&g_locked.mutex);
+        while (g_locked.tail - g_locked.head == EVENT_QUEUE_SIZE) {
+            pthread_cond_wait(&g_locked.space, &g_locked.mutex);
+            waited = true;
+        }
+
+        event = &g_locked.events[g_locked.tail++ % EVENT_QUEUE_SIZE];
+        event->type = EVENT_END_OF_TRACK;
+        event->value = producer << 24 | i;
+        event->time = bench_now();
+
+        pthread_cond_signal(&g_locked.cond);
+        pthread_mutex_unlock(&g_locked.mutex);
+
+        if (!waited)
+            bench_post_time(start);
+    }
+
+    return NULL;
+}
+
+/**
+ * Drains the queue on this thread while producers post to it, checking
+ * that every producer's events arrive complete and in order.
+ *
+ * @param nproducers number of posting threads
+ */
+static void bench_event_producers(int nproducers)
+{
+    pthread_t producers[BENCH_MAX_PRODUCERS];
+    event_t events[EVENT_BATCH];
+    int next[BENCH_MAX_PRODUCERS] = { 0 };
+    unsigned long total = (unsigned long) nproducers * BENCH_EVENTS;
+    unsigned long taken = 0, reordered = 0;
+    event_stats_t stats;
+    uint64_t start, elapsed;
+    int i, n, producer;
+
+    event_queue_init(&g_queue);
+    g_post_worst = 0;
+
+    start = bench_now();
+    for (i = 0; i < nproducers; i++)
+        pthread_create(&producers[i], NULL, bench_event_producer,
+                       (void *) (intptr_t) i);
+
+    while (taken < total) {
+        event_wait(&g_queue, 10);
+        while ((n = event_take(&g_queue, events, EVENT_BATCH)) > 0) {
+            for (i = 0; i < n; i++) {
+                producer = events[i].value >> 24;
+                if ((events[i].value & 0xffffff) != next[producer])
+                    reordered++;
+                next[producer] = (events[i].value & 0xffffff) + 1;
+            }
+            taken += n;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    for (i = 0; i < nproducers; i++)
+        pthread_join(producers[i], NULL);
+
+    event_stats(&g_queue, &stats);
+    event_queue_release(&g_queue);
+
+    bench_report("event_post", nproducers, "ns_per_event",
+                 (double) elapsed / total);
+    bench_report("event_post", nproducers, "us_worst", g_post_worst / 1E3);
+    bench_report("event_batch", nproducers, "largest", stats.largest_batch);
+    bench_report("event_latency", nproducers, "us_worst",
+                 stats.worst_latency / 1E3);
+    bench_report("event_reordered", nproducers, "events", reordered);
+}
+
+/**
+ * The same load through the locked ring, taken in batches of the same
+ * size.
+ */
+static void bench_locked_producers(int nproducers)
+{
+    pthread_t producers[BENCH_MAX_PRODUCERS];
+    unsigned long total = (unsigned long) nproducers * BENCH_EVENTS;
+    unsigned long taken = 0;
+    uint64_t start, elapsed, now, worst = 0;
+    int i;
+
+    g_locked.head = g_locked.tail = 0;
+    g_post_worst = 0;
+
+    start = bench_now();
+    for (i = 0; i < nproducers; i++)
+        pthread_create(&producers[i], NULL, bench_locked_producer,
+                       (void *) (intptr_t) i);
+
+    pthread_mutex_lock(&g_locked.mutex);
+    while (taken < total) {
+        while (g_locked.head == g_locked.tail)
+            pthread_cond_wait(&g_locked.cond, &g_locked.mutex);
+
+        now = bench_now();
+        for (i = 0; i < EVENT_BATCH && g_locked.head != g_locked.tail; i++) {
+            if (now - g_locked.events[g_locked.head % EVENT_QUEUE_SIZE].time > worst)
+                worst = now - g_locked.events[g_locked.head % EVENT_QUEUE_SIZE].time;
+            g_locked.head++;
+            taken++;
+        }
+        pthread_cond_broadcast(&g_locked.space);
+    }
+    pthread_mutex_unlock(&g_locked.mutex);
+    elapsed = bench_now() - start;
+
+    for (i = 0; i < nproducers; i++)
+        pthread_join(producers[i], NULL);
+
+    bench_report("event_locked_post", nproducers, "ns_per_event",
+                 (double) elapsed / total);
+    bench_report("event_locked_post", nproducers, "us_worst", g_post_worst / 1E3);
+    bench_report("event_locked_latency", nproducers, "us_worst", worst / 1E3);
+}
+
+/**
+ * Throughput, batching and latency of the event queue with one to four
+ * posting threads, against the same ring under a mutex.
+ */
+void bench_event()
+{
+    size_t i;
+
+    for (i = 0; i < BENCH_NCOUNTS; i++) {
+        bench_event_producers(producer_counts[i]);
+        bench_locked_producers(producer_counts[i]);
+    }
+}
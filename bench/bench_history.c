@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "spotify/history.h"
+
+
+#define BENCH_YEARS         10
+#define BENCH_PLAYS_PER_DAY 60
+#define BENCH_PLAYS         (BENCH_YEARS * 365 * BENCH_PLAYS_PER_DAY)
+#define BENCH_TRACKS        20000
+#define BENCH_ARTISTS       2000
+#define BENCH_DAY           86400
+#define BENCH_YEAR          (365 * BENCH_DAY)
+#define BENCH_EPOCH         1300000000u
+#define BENCH_TOP           50
+#define BENCH_REPEAT        20
+
+static uint32_t g_seed = 1;
+
+
+static uint32_t bench_random()
+{
+    g_seed = g_seed * 1664525 + 1013904223;
+    return g_seed >> 8;
+}
+
+/**
+ * Writes a made up base62 id of n.
+ */
+static void bench_id(char *id, uint32_t n)
+{
+    static const char digits[] =
+        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    int i;
+
+    for (i = 0; i < HISTORY_ID_SIZE; i++) {
+        id[i] = digits[n % 62];
+        n = n / 62 + n * 13 + 7;
+    }
+}
+
+static double bench_ms(uint64_t start)
+{
+    return (bench_now() - start) / 1E6;
+}
+
+/**
+ * Waits until the writer thread caught up with the appends.
+ */
+static void bench_history_flush(history_t *history)
+{
+    int pending;
+
+    do {
+        pthread_mutex_lock(&history->mutex);
+        pending = history->npending;
+        pthread_mutex_unlock(&history->mutex);
+        if (pending > 0)
+            usleep(100);
+    } while (pending > 0);
+}
+
+/**
+ * Ten years of plays at 60 a day, what loading and querying them costs in
+ * ms. Listening favours a few tracks, as it does.
+ */
+void bench_history()
+{
+    char path[] = "/tmp/spoticli-history-XXXXXX";
+    history_t history;
+    history_record_t record;
+    history_count_t top[BENCH_TOP];
+    history_play_t recent[BENCH_TOP];
+    uint64_t start, appending = 0;
+    uint32_t i, track, now = BENCH_EPOCH + BENCH_YEARS * BENCH_YEAR;
+    double ms, worst;
+    int fd, r, n = 0;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror(path);
+        return;
+    }
+    close(fd);
+    unlink(path);
+
+    history_open(&history, path);
+
+    for (i = 0; i < BENCH_PLAYS; i++) {
+        memset(&record, 0, sizeof(record));
+
+        // skewed towards low numbers, a few favourites and a long tail
+        track = bench_random() % BENCH_TRACKS;
+        track = track * (bench_random() % BENCH_TRACKS) / BENCH_TRACKS;
+        bench_id(record.track, track);
+        bench_id(record.artist, track % BENCH_ARTISTS + BENCH_TRACKS);
+
+        record.started = BENCH_EPOCH + (uint64_t) i * BENCH_YEARS * BENCH_YEAR /
+                         BENCH_PLAYS;
+        record.duration_ms = 120000 + track % 240000;
+        record.played_ms = bench_random() % 8 ? record.duration_ms :
+                           bench_random() % record.duration_ms;
+        record.flags = record.played_ms < record.duration_ms ? HISTORY_SKIPPED : 0;
+        record.ended = record.started + record.played_ms / 1000;
+
+        if (i % (HISTORY_PENDING / 2) == 0)
+            bench_history_flush(&history);
+
+        start = bench_now();
+        history_append(&history, &record);
+        appending += bench_now() - start;
+    }
+    bench_report("history_append", BENCH_PLAYS, "us",
+                 appending / 1E3 / BENCH_PLAYS);
+
+    history_close(&history);
+
+    start = bench_now();
+    history_open(&history, path);
+    bench_report("history_open", history.count, "ms", bench_ms(start));
+
+    worst = 0;
+    for (r = 0; r < BENCH_REPEAT; r++) {
+        start = bench_now();
+        n = history_top_tracks(&history, now - BENCH_YEAR, now, top, BENCH_TOP);
+        ms = bench_ms(start);
+        worst = ms > worst ? ms : worst;
+    }
+    bench_report("history_top_tracks_year", n, "ms", worst);
+
+    worst = 0;
+    for (r = 0; r < BENCH_REPEAT; r++) {
+        start = bench_now();
+        n = history_top_tracks(&history, 0, UINT32_MAX, top, BENCH_TOP);
+        ms = bench_ms(start);
+        worst = ms > worst ? ms : worst;
+    }
+    bench_report("history_top_tracks_all", n, "ms", worst);
+
+    worst = 0;
+    for (r = 0; r < BENCH_REPEAT; r++) {
+        start = bench_now();
+        n = history_top_artists(&history, 0, UINT32_MAX, top, BENCH_TOP);
+        ms = bench_ms(start);
+        worst = ms > worst ? ms : worst;
+    }
+    bench_report("history_top_artists_all", n, "ms", worst);
+
+    start = bench_now();
+    n = history_recent(&history, recent, BENCH_TOP);
+    bench_report("history_recent", n, "ms", bench_ms(start));
+
+    history_close(&history);
+    unlink(path);
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bench.h"
+#include "spotify/track.h"
+
+
+#define BENCH_TRACKS    100000
+#define BENCH_ARTISTS   5000
+#define BENCH_ALBUMS    10000
+
+static const char *syllables[] = {
+    "la", "mo", "ve", "ri", "son", "dar", "ke", "lu", "ni", "to", "ban",
+    "ex", "po", "qui", "ra", "zel", "na", "gho", "sti", "lo", "me", "ov"
+};
+
+#define BENCH_NSYLLABLES (sizeof(syllables) / sizeof(syllables[0]))
+
+// the table as the obvious design would store it, for comparison
+typedef struct bench_track_s {
+    const char *title;
+    const char *artist;
+    const char *album;
+} bench_track_t;
+
+static uint32_t g_seed = 1;
+
+
+static uint32_t bench_random()
+{
+    g_seed = g_seed * 1664525 + 1013904223;
+    return g_seed >> 8;
+}
+
+/**
+ * Makes up a name of one to three words, the same n always gives the same
+ * name.
+ */
+static void bench_name(char *name, size_t size, uint32_t n)
+{
+    int words = 1 + n % 3;
+    size_t len = 0;
+    int w, s;
+
+    for (w = 0; w < words && len + 16 < size; w++) {
+        if (w > 0)
+            name[len++] = ' ';
+        for (s = 0; s < 2 + (int) (n % 2); s++) {
+            len += snprintf(name + len, size - len, "%s",
+                            syllables[n % BENCH_NSYLLABLES]);
+            n = n / BENCH_NSYLLABLES + n * 7 + 3;
+        }
+        if (w == 0)
+            name[0] -= 'a' - 'A';
+    }
+    name[len] = '\0';
+}
+
+static int bench_track_compare(const void *a, const void *b)
+{
+    const bench_track_t *x = *(const bench_track_t * const *) a;
+    const bench_track_t *y = *(const bench_track_t * const *) b;
+    int diff;
+
+    if ((diff = strcasecmp(x->artist, y->artist)))
+        return diff;
+    if ((diff = strcasecmp(x->album, y->album)))
+        return diff;
+    return strcasecmp(x->title, y->title);
+}
+
+static double bench_ms(uint64_t start)
+{
+    return (bench_now() - start) / 1E6;
+}
+
+/**
+ * Sorting and filtering a synthetic 100k track library, everything is
+ * given in ms. A redraw has 16 ms.
+ */
+void bench_library()
+{
+    static const char *typing[] = { "l", "lo", "lov", "love" };
+    track_table_t table;
+    track_sort_key_t by_artist[] = {
+        { TRACK_ARTIST, false }, { TRACK_ALBUM, false }, { TRACK_TITLE, false }
+    };
+    track_sort_key_t by_duration[] = { { TRACK_DURATION, true } };
+    track_sort_key_t by_added[] = { { TRACK_ADDED, true }, { TRACK_TITLE, false } };
+    bench_track_t *tracks, **pointers;
+    char title[64], artist[64], album[64];
+    uint64_t start, added;
+    double worst = 0, ms;
+    uint32_t i, a;
+    size_t k;
+
+    track_table_init(&table);
+    tracks = malloc(BENCH_TRACKS * sizeof(bench_track_t));
+    pointers = malloc(BENCH_TRACKS * sizeof(bench_track_t *));
+
+    // the worst add is one that ranks a batch of new strings
+    start = bench_now();
+    for (i = 0; i < BENCH_TRACKS; i++) {
+        a = bench_random() % BENCH_ALBUMS;
+        bench_name(title, sizeof(title), bench_random());
+        bench_name(album, sizeof(album), a * 31 + 7);
+        bench_name(artist, sizeof(artist), (a % BENCH_ARTISTS) * 17 + 5);
+
+        added = bench_now();
+        track_table_add(&table, title, artist, album,
+                        60000 + bench_random() % 400000,
+                        1300000000 + bench_random() % 300000000, NULL);
+        ms = bench_ms(added);
+        worst = ms > worst ? ms : worst;
+    }
+    bench_report("library_add", BENCH_TRACKS, "ms", bench_ms(start));
+    bench_report("library_add", BENCH_TRACKS, "ms_worst", worst);
+    worst = 0;
+
+    // the comparison points at the strings the table interned
+    for (i = 0; i < BENCH_TRACKS; i++) {
+        tracks[i].title = track_table_string(&table, table.title[i]);
+        tracks[i].artist = track_table_string(&table, table.artist[i]);
+        tracks[i].album = track_table_string(&table, table.album[i]);
+        pointers[i] = &tracks[i];
+    }
+
+    start = bench_now();
+    qsort(pointers, BENCH_TRACKS, sizeof(bench_track_t *), bench_track_compare);
+    bench_report("library_qsort", BENCH_TRACKS, "ms", bench_ms(start));
+
+    // the first sort ranks the strings added since the last batch
+    start = bench_now();
+    track_table_sort(&table, by_artist, 3);
+    bench_report("library_sort_first", BENCH_TRACKS, "ms", bench_ms(start));
+
+    start = bench_now();
+    track_table_sort(&table, by_duration, 1);
+    bench_report("library_sort_duration", BENCH_TRACKS, "ms", bench_ms(start));
+
+    start = bench_now();
+    track_table_sort(&table, by_added, 2);
+    bench_report("library_sort_added", BENCH_TRACKS, "ms", bench_ms(start));
+
+    start = bench_now();
+    track_table_sort(&table, by_artist, 3);
+    bench_report("library_sort_artist", BENCH_TRACKS, "ms", bench_ms(start));
+
+    // typing a query, every keystroke narrows the previous view
+    for (k = 0; k < sizeof(typing) / sizeof(typing[0]); k++) {
+        start = bench_now();
+        track_table_filter(&table, typing[k]);
+        ms = bench_ms(start);
+        worst = ms > worst ? ms : worst;
+    }
+    bench_report("library_filter_typing", table.nview, "ms_worst", worst);
+
+    start = bench_now();
+    track_table_filter(&table, "ra son");
+    bench_report("library_filter", table.nview, "ms", bench_ms(start));
+
+    start = bench_now();
+    track_table_filter(&table, "");
+    bench_report("library_filter_clear", table.nview, "ms", bench_ms(start));
+
+    free(pointers);
+    free(tracks);
+    track_table_release(&table);
+}
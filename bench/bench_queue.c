@@ -0,0 +1,62 @@
+#include <stdlib.h>
+
+#include "bench.h"
+#include "queue.h"
+
+
+static const int queue_sizes[] = { 16, 256, 4096, 16384 };
+
+#define QUEUE_NSIZES (sizeof(queue_sizes) / sizeof(queue_sizes[0]))
+
+/**
+ * Fills a queue of the given size and drains it again.
+ *
+ * @param size elements per round
+ */
+static void bench_queue_size(int size)
+{
+    int i, round;
+    int rounds = size < 65536 ? 65536 / size : 1;
+    uint64_t start, enqueue = 0, dequeue = 0, peek = 0;
+    queue_t *queue = queue_create();
+    queue_elem_t *elem;
+
+    for (round = 0; round < rounds; round++) {
+        start = bench_now();
+        for (i = 0; i < size; i++)
+            queue_enqueue(queue, queue);
+        enqueue += bench_now() - start;
+
+        start = bench_now();
+        for (i = 0; i < size; i++)
+            queue_peek(queue);
+        peek += bench_now() - start;
+
+        start = bench_now();
+        for (i = 0; i < size; i++) {
+            elem = queue_dequeue(queue);
+            free(elem);
+        }
+        dequeue += bench_now() - start;
+    }
+
+    queue_destroy(queue, NULL);
+
+    bench_report("queue_enqueue", size, "ns_per_op",
+                 (double) enqueue / ((uint64_t) rounds * size));
+    bench_report("queue_peek", size, "ns_per_op",
+                 (double) peek / ((uint64_t) rounds * size));
+    bench_report("queue_dequeue", size, "ns_per_op",
+                 (double) dequeue / ((uint64_t) rounds * size));
+}
+
+/**
+ * queue_t enqueue, peek and dequeue cost at varying queue sizes.
+ */
+void bench_queue()
+{
+    size_t i;
+
+    for (i = 0; i < QUEUE_NSIZES; i++)
+        bench_queue_size(queue_sizes[i]);
+}
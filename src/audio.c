@@ -1,249 +1,523 @@
+#include <math.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
-#include <alsa/asoundlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "audio.h"
+#include "audio/convert.h"
+#include "startup.h"
+#include "debug.h"
 
 
-#define PCM_DEVICE      "default"
-#define PERIOD_SIZE     1024
-#define BUFFER_SIZE     (PERIOD_SIZE * 4)
+#define WATERMARK_BASE      0.25    // seconds buffered for a perfect network
+#define WATERMARK_JITTER_K  4.0     // jitter multiples buffered on top
+#define WATERMARK_FORGET    60.0    // seconds to forget one second of stall
 
+#define DRAIN_CHUNK_FRAMES  4096    // frames per chunk when draining the tail
+
+// chunks allocated and not yet destroyed, for leak checks
+static long g_audio_data_live;
+// bytes of those chunks, the MEM_AUDIO budget caps these and not the fixed
+// crossfade, eq and device buffers beside them
+static size_t g_audio_chunk_bytes;
 
 /**
- * Opens and returns a handle to an alsa "pulse code modulator", which handles
- * playback. This function looks like it does a lot, but most of the code is
- * very much boilerplate code with tons of error checking. A basic outline of
- * the code is thus:
- *
- *      1. open a pcm device
- *      2. allocate and set hardware params struct
- *          * set access
- *          * set format
- *          * set sample rate
- *          * set channel number
- *      3. configure the period
- *      4. configure the buffer size
- *      5. write and free hardware params (finalize)
- *      6. allocate and set software params struct
- *      7. write and free software params
- *      8. prepare pcm device
- *      9. return pcm handle
+ * Fewest bytes any sink has waiting, this is what the producer
+ * paces itself against so that the fastest sink is never starved. Must be
+ * called with the fifo mutex held.
  *
- * @param device device name
- * @param rate sample rate
- * @param channels channel count
+ * @param af audio_fifo_t
  *
- * @return a pointer to an alsa pcm handle
+ * @return bytes buffered for the least backed up sink
  */
-static snd_pcm_t *alsa_open(char *device, int rate, int channels)
+static size_t audio_fifo_min_queued(audio_fifo_t *af)
 {
-    int error;
-    int dir;
-    snd_pcm_t *pcm_handle;
-    snd_pcm_hw_params_t *hw_params;
-    snd_pcm_sw_params_t *sw_params;
-    snd_pcm_uframes_t period_size;
-    snd_pcm_uframes_t buffer_size;
+    int i;
+    size_t min = 0;
 
-    // open pcm and return NULL if it fails
-    if (snd_pcm_open(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
-        fprintf(stderr, "ALSA: Error opening PCM device %s\n", device);
-        return NULL;
+    for (i = 0; i < af->nsinks; i++) {
+        if (i == 0 || af->sinks[i]->queued < min)
+            min = af->sinks[i]->queued;
     }
 
-    // allocate the hardware params struct
-    if ((error = snd_pcm_hw_params_malloc(&hw_params)) < 0) {
-        fprintf(stderr, "ALSA: unable to allocate hardware param struct (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
-    }
+    return min;
+}
 
-    // intialize the hardware params struct
-    if ((error = snd_pcm_hw_params_any(pcm_handle, hw_params)) < 0) {
-        fprintf(stderr, "ALSA: unable to initialize hardware param struct (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
-    }
+/**
+ * Returns the seconds elapsed from start to end.
+ *
+ * @param start earlier time
+ * @param end later time
+ *
+ * @return seconds between the two
+ */
+static double timespec_elapsed(const struct timespec *start,
+                               const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1E9;
+}
 
-    // set access type to interleaved
-    if ((error = snd_pcm_hw_params_set_access(pcm_handle,
-                    hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-        fprintf(stderr, "ALSA: unable to set access type (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
-    }
+/**
+ * Recomputes the buffer target after an accepted delivery. Jitter is
+ * estimated like RFC 3550 does for packets: the difference between the gap
+ * since the previous delivery and the audio that delivery carried, smoothed
+ * over 16 deliveries. The worst stall is remembered and slowly forgotten.
+ * Must be called with the fifo mutex held.
+ *
+ * @param af audio_fifo_t
+ * @param now time of this delivery
+ * @param channels channel count
+ * @param sample_rate sample rate
+ * @param nframes frames delivered
+ */
+static void audio_watermark_update(audio_fifo_t *af, struct timespec *now,
+                                   int channels, int sample_rate, int nframes)
+{
+    audio_watermark_t *wm = &af->watermark;
+    double gap, delta, elapsed, rate, seconds, bytes;
+    size_t previous = wm->high_bytes;
+    uint64_t frames = 0;
+    int i;
 
-    // set sample format to signed 16 bit little endian
-    if ((error = snd_pcm_hw_params_set_format(pcm_handle,
-                    hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
-        fprintf(stderr, "ALSA: unable to set sample format (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
-    }
+    // only gaps between two deliveries we accepted measure the network
+    if (wm->last_delivery.tv_sec != 0) {
+        gap = timespec_elapsed(&wm->last_delivery, now);
+        delta = gap - wm->last_duration;
 
-    // set sample rate
-    if ((error = snd_pcm_hw_params_set_rate(pcm_handle,
-                    hw_params, rate, 0)) < 0) {
-        fprintf(stderr, "ALSA: unable to set sample rate (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+        wm->jitter += ((delta < 0 ? -delta : delta) - wm->jitter) / 16;
+
+        wm->stall -= gap / WATERMARK_FORGET;
+        if (wm->stall < delta)
+            wm->stall = delta;
+        if (wm->stall < 0)
+            wm->stall = 0;
     }
 
-    // set channel count
-    if ((error = snd_pcm_hw_params_set_channels(pcm_handle,
-                    hw_params, channels)) < 0) {
-        fprintf(stderr, "ALSA: unable to set channel count (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    wm->last_delivery = *now;
+    wm->last_duration = (double) nframes / sample_rate;
+
+    // consumer rate of the fastest sink, over windows of at least a second
+    for (i = 0; i < af->nsinks; i++) {
+        if (af->sinks[i]->frames_read > frames)
+            frames = af->sinks[i]->frames_read;
     }
 
-    // configure the period
-    dir = 0;
-    period_size = PERIOD_SIZE;
-    if ((error = snd_pcm_hw_params_set_period_size_near(pcm_handle,
-                    hw_params, &period_size, &dir)) < 0) {
-        fprintf(stderr, "ALSA: unable to set period size %lu (%s)\n",
-                period_size, snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    elapsed = timespec_elapsed(&wm->rate_start, now);
+    if (wm->rate_start.tv_sec == 0 || frames < wm->rate_frames) {
+        wm->rate_start = *now;
+        wm->rate_frames = frames;
+    } else if (elapsed >= 1.0) {
+        // a paused sink reads nothing, keep the last rate
+        if (frames > wm->rate_frames) {
+            rate = (frames - wm->rate_frames) / elapsed;
+            wm->consumer_rate = wm->consumer_rate == 0 ?
+                rate : (wm->consumer_rate + rate) / 2;
+        }
+
+        wm->rate_start = *now;
+        wm->rate_frames = frames;
     }
 
-    // configure the buffer size
-    buffer_size = BUFFER_SIZE;
-    if ((error = snd_pcm_hw_params_set_buffer_size_near(pcm_handle,
-                    hw_params, &buffer_size)) < 0) {
-        fprintf(stderr, "ALSA: unable to set buffer size %lu (%s)\n",
-                buffer_size, snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    rate = wm->consumer_rate > 0 ? wm->consumer_rate : sample_rate;
+    seconds = WATERMARK_BASE + WATERMARK_JITTER_K * wm->jitter + wm->stall;
+    bytes = seconds * rate * channels * sizeof(float);
+
+    wm->high_bytes = MIN(MAX((size_t) bytes, wm->min_bytes), wm->max_bytes);
+    wm->low_bytes = wm->high_bytes / 4 * 3;
+
+    if (wm->high_bytes > previous + previous / 4 ||
+        wm->high_bytes < previous - previous / 4)
+        debug("buffer target %zu bytes (jitter %.1f ms, stall %.1f ms)\n",
+              wm->high_bytes, wm->jitter * 1000, wm->stall * 1000);
+}
+
+/**
+ * Publishes a snapshot of the sink every AUDIO_SNAPSHOT_MS, with the share
+ * of a core its thread used since the last one. A refresh long overdue was
+ * not watched and only starts a new window. Only called by the sink thread
+ * while anyone watches.
+ *
+ * @param sink audio_sink_t
+ */
+static void audio_sink_publish(audio_sink_t *sink)
+{
+    struct timespec now, cpu;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = timespec_elapsed(&sink->stats_time, &now);
+
+    if (elapsed * 1000 < AUDIO_SNAPSHOT_MS)
+        return;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+    if (elapsed * 1000 < 4 * AUDIO_SNAPSHOT_MS) {
+        __atomic_add_fetch(&sink->stats_seq, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        snprintf(sink->stats.name, sizeof(sink->stats.name), "%s", sink->name);
+        sink->stats.rate = sink->rate;
+        sink->stats.channels = sink->channels;
+        sink->stats.format = sink->format;
+        sink->stats.period = sink->period;
+        sink->stats.xruns = sink->xruns;
+        sink->stats.lost = sink->lost;
+        sink->stats.cpu_percent =
+            timespec_elapsed(&sink->stats_cpu, &cpu) / elapsed * 100;
+
+        __atomic_add_fetch(&sink->stats_seq, 1, __ATOMIC_RELEASE);
     }
 
-    // write the hw params
-    if ((error = snd_pcm_hw_params(pcm_handle, hw_params)) < 0) {
-        fprintf(stderr, "ALSA: unable to configure hardware params (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    sink->stats_time = now;
+    sink->stats_cpu = cpu;
+}
+
+/**
+ * Publishes the fill level, buffer target and how fast audio comes in every
+ * AUDIO_SNAPSHOT_MS. Only called while anyone watches, with the fifo mutex
+ * held, which also keeps producers from publishing at once.
+ *
+ * @param af audio_fifo_t
+ * @param now time of this delivery
+ * @param fill bytes buffered for the fastest sink
+ * @param seconds audio in this delivery
+ */
+static void audio_fifo_publish_snapshot(audio_fifo_t *af, struct timespec *now,
+                                        size_t fill, double seconds)
+{
+    double elapsed = timespec_elapsed(&af->snapshot_time, now);
+
+    af->snapshot_audio += seconds;
+
+    if (elapsed * 1000 < AUDIO_SNAPSHOT_MS)
+        return;
+
+    if (elapsed * 1000 < 4 * AUDIO_SNAPSHOT_MS) {
+        __atomic_add_fetch(&af->snapshot_seq, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        af->snapshot.fill_bytes = fill;
+        af->snapshot.target_bytes = af->watermark.high_bytes;
+        af->snapshot.intake = af->snapshot_audio / elapsed;
+
+        __atomic_add_fetch(&af->snapshot_seq, 1, __ATOMIC_RELEASE);
     }
 
-    // free the hw params
-    snd_pcm_hw_params_free(hw_params);
+    af->snapshot_time = *now;
+    af->snapshot_audio = 0;
+}
 
-    // allocate sw_params
-    if ((error = snd_pcm_sw_params_malloc(&sw_params)) < 0) {
-        fprintf(stderr, "ALSA: unable to allocate software params (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+/**
+ * Records the seek latency once the first chunk of the seeked to position
+ * has been written by any sink.
+ *
+ * @param af audio_fifo_t
+ * @param ad chunk just written
+ */
+static void audio_fifo_written(audio_fifo_t *af, audio_data_t *ad)
+{
+    struct timespec now;
+
+    pthread_mutex_lock(&af->mutex);
+
+    if (af->seek_pending && ad->generation == af->generation) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        af->seek_latency = timespec_elapsed(&af->seek_start, &now);
+        af->seek_pending = false;
     }
 
-    // configure wakeup threshold
-    if ((error = snd_pcm_sw_params_set_avail_min(pcm_handle,
-                    sw_params, PERIOD_SIZE)) < 0) {
-        fprintf(stderr, "ALSA: unable to configure wakeup threshold (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    pthread_mutex_unlock(&af->mutex);
+
+    startup_mark(STARTUP_FIRST_SAMPLE);
+}
+
+/**
+ * Opens a sink for the format of the stream. A device that can't be opened
+ * is reported once and treated as lost, it is retried every AUDIO_RETRY_MS
+ * until it comes back, e.g. a USB DAC plugged in again.
+ *
+ * @param sink audio_sink_t
+ * @param rate sample rate
+ * @param channels channel count
+ * @param retry when to try again after a failure, monotonic
+ *
+ * @return true if the device is open
+ */
+static bool audio_sink_open(audio_sink_t *sink, int rate, int channels,
+                            struct timespec *retry)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_elapsed(retry, &now) < 0)
+        return false;
+
+    sink->rate = rate;
+    sink->channels = channels;
+
+    if (sink->ops->open(sink, rate, channels) == 0) {
+        if (sink->lost)
+            log_info("%s: output is back\n", sink->name);
+        sink->lost = false;
+        startup_mark(STARTUP_AUDIO);
+        return true;
     }
 
-    // configure start threshold
-    if ((error = snd_pcm_sw_params_set_start_threshold(pcm_handle,
-                    sw_params, 0)) < 0) {
-        fprintf(stderr, "ALSA: unable to configure start threshold (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    if (!sink->lost)
+        log_error("%s: unable to open sink (%d channels %d Hz), retrying\n",
+                  sink->name, channels, rate);
+    sink->lost = true;
+
+    *retry = now;
+    retry->tv_nsec += AUDIO_RETRY_MS * 1000000L;
+    retry->tv_sec += retry->tv_nsec / 1000000000L;
+    retry->tv_nsec %= 1000000000L;
+
+    return false;
+}
+
+/**
+ * Opens the device a sink switches to, off the sink thread so playback
+ * goes on meanwhile. It is opened for the default format, the sink thread
+ * reopens it should the stream differ.
+ *
+ * @param arg audio_sink_t switching
+ */
+static void *audio_sink_opener(void *arg)
+{
+    audio_sink_t *sink = (audio_sink_t *) arg;
+    audio_sink_t *staged = audio_sink_create(sink->ops, sink->switch_name);
+
+    staged->rate = AUDIO_DEFAULT_RATE;
+    staged->channels = AUDIO_DEFAULT_CHANNELS;
+    if (staged->ops->open(staged, staged->rate, staged->channels) != 0) {
+        audio_sink_destroy(staged);
+        staged = NULL;
     }
 
-    // write the sw params
-    if ((error = snd_pcm_sw_params(pcm_handle, sw_params)) < 0) {
-        fprintf(stderr, "ALSA: unable to configure software params (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    pthread_mutex_lock(&sink->fifo->mutex);
+    sink->staged = staged;
+    sink->switch_done = true;
+    pthread_cond_broadcast(&sink->fifo->cond);
+    pthread_mutex_unlock(&sink->fifo->mutex);
+
+    return NULL;
+}
+
+/**
+ * Moves a sink over to the device its opener opened, if it finished. Only
+ * called by the sink thread between two chunks, which are written to the
+ * device in whole periods, so the old device stops at a period boundary.
+ * What it still had queued carries on from the new one where the output
+ * supports a handover.
+ *
+ * @param sink audio_sink_t
+ * @param opened whether the sink's device is open, updated
+ */
+static void audio_sink_hand_over(audio_sink_t *sink, bool *opened)
+{
+    audio_sink_t *staged;
+    char *name;
+
+    pthread_mutex_lock(&sink->fifo->mutex);
+
+    if (!sink->switch_done) {
+        pthread_mutex_unlock(&sink->fifo->mutex);
+        return;
     }
 
-    // free the sw params
-    snd_pcm_sw_params_free(sw_params);
+    staged = sink->staged;
+    name = sink->switch_name;
+    sink->staged = NULL;
+    sink->switch_name = NULL;
+    sink->switch_done = false;
+
+    pthread_mutex_unlock(&sink->fifo->mutex);
 
-    // prepare the audio device for playback
-    if ((error = snd_pcm_prepare(pcm_handle)) < 0) {
-        fprintf(stderr, "ALSA: unable to prepare audio device for playback (%s)\n",
-                snd_strerror(error));
-        snd_pcm_close(pcm_handle);
-        return NULL;
+    pthread_join(sink->opener, NULL);
+
+    if (staged == NULL) {
+        log_error("%s: unable to open, staying on %s\n", name, sink->name);
+        free(name);
+        return;
     }
 
-    // return the handle
-    return pcm_handle;
+    if (*opened && sink->ops->handover &&
+        staged->rate == sink->rate && staged->channels == sink->channels)
+        sink->ops->handover(sink, staged);
+
+    if (sink->handle)
+        sink->ops->close(sink);
+
+    log_info("%s: switched to %s\n", sink->name, name);
+
+    free(sink->name);
+    sink->name = name;
+    sink->handle = staged->handle;
+    sink->rate = staged->rate;
+    sink->channels = staged->channels;
+    sink->format = staged->format;
+    sink->period = staged->period;
+    sink->lost = false;
+    *opened = true;
+
+    staged->handle = NULL;
+    audio_sink_destroy(staged);
 }
 
 /**
- * Opens the alsa pcm device and feeds it the given audio. The audio pointer
- * is cast to audio_fifo_t, and then each sample is gathered with
- * audio_fifo_dequeue().This function will be passed as a parameter to a
- * pthread, hence why the argument is a void pointer.
+ * Drives a single sink, reading every chunk from the fifo through the sink's
+ * own cursor. The device is opened right away with the format libspotify
+ * normally delivers and reopened whenever the format of the stream changes.
+ * Whatever the device still holds is dropped when the fifo moves to a new
+ * generation, and it is paused and resumed along with the fifo. The
+ * equalizer runs here, so setting changes are heard right away instead of
+ * after everything buffered. A device that fails is closed and retried
+ * while the sink keeps reading at the pace of the audio, and a device
+ * switch is handed over between chunks. This function will be passed as a
+ * parameter to a pthread, hence why the argument is a void pointer.
  *
- * The majority of this function was borrowed from the example "jukebox"
- * supplied with libspotify. Some variable names were changed and other
- * minor changes to make the code more readable.
+ * The original loop was borrowed from the example "jukebox" supplied with
+ * libspotify.
  *
- * @param audio void pointer to an instance of audio_fifo_t
+ * @param arg void pointer to an instance of audio_sink_t
  */
-static void *alsa_audio_start(void *audio)
+static void *audio_sink_start(void *arg)
 {
-    audio_fifo_t *af = (audio_fifo_t *) audio;
-    snd_pcm_t *pcm_handle = NULL;
-    int cur_rate = 0;
-    int cur_channels = 0;
-
-    int error;
+    audio_sink_t *sink = (audio_sink_t *) arg;
     audio_data_t *ad;
+    const float *samples;
+    bool opened = false;
+    unsigned int generation = sink->generation;
+    bool paused = false;
+    bool switching;
+    int written;
+    struct timespec retry = { 0, 0 };
 
-    while (true) {
-        ad = audio_fifo_dequeue(af);
+    rt_stack_prefault();
+
+    // open early so the first chunk doesn't wait on the device
+    opened = audio_sink_open(sink, AUDIO_DEFAULT_RATE, AUDIO_DEFAULT_CHANNELS,
+                             &retry);
 
-        if (pcm_handle == NULL ||
-            cur_rate != ad->sample_rate ||
-            cur_channels != ad->channels) {
+    while (!sink->quit) {
+        audio_sink_hand_over(sink, &opened);
 
-            if (pcm_handle)
-                snd_pcm_close(pcm_handle);
+        ad = audio_fifo_dequeue(sink->fifo, sink);
+        if (ad == NULL) {
+            if (sink->quit)
+                break;
 
-            cur_rate = ad->sample_rate;
-            cur_channels = ad->channels;
+            // flushed or seeked, stop playing the old position right away
+            if (opened && sink->generation != generation && sink->ops->drop)
+                sink->ops->drop(sink);
 
-            pcm_handle = alsa_open(PCM_DEVICE, cur_rate, cur_channels);
-            if (pcm_handle == NULL) {
-                fprintf(stderr,
-                        "ALSA: unable to open pcm device (%d channels %d Hz)\n",
-                        cur_channels,
-                        cur_rate);
-                exit(EXIT_FAILURE);
+            if (opened && sink->paused != paused && sink->ops->pause)
+                sink->ops->pause(sink, sink->paused);
+
+            generation = sink->generation;
+            paused = sink->paused;
+            continue;
+        }
+
+        if (opened &&
+            (sink->rate != ad->sample_rate || sink->channels != ad->channels)) {
+            sink->ops->close(sink);
+            opened = false;
+            retry.tv_sec = 0;
+            retry.tv_nsec = 0;
+        }
+
+        if (!opened)
+            opened = audio_sink_open(sink, ad->sample_rate, ad->channels, &retry);
+
+        if (opened) {
+            samples = eq_process(&sink->fifo->eq, &sink->eq, ad->samples,
+                                 ad->nsamples, sink->rate, sink->channels);
+
+            written = sink->ops->write(sink, samples, ad->nsamples);
+            if (written > 0) {
+                audio_fifo_written(sink->fifo, ad);
+            } else if (written < 0) {
+                // unplugged, try to get it back every AUDIO_RETRY_MS
+                log_warning("%s: output lost\n", sink->name);
+                sink->ops->close(sink);
+                sink->lost = true;
+                opened = false;
+                clock_gettime(CLOCK_MONOTONIC, &retry);
             }
+        } else {
+            // without a device keep the pace of the audio, not of the cpu
+            usleep((useconds_t) ((int64_t) ad->nsamples * 1000000 /
+                                 ad->sample_rate));
+        }
 
-            error = snd_pcm_wait(pcm_handle, 1000);
-            if (error >= 0)
-                error = snd_pcm_avail_update(pcm_handle);
+        if (__atomic_load_n(&sink->fifo->watchers, __ATOMIC_RELAXED) > 0)
+            audio_sink_publish(sink);
 
-            if (error == -EPIPE)
-                snd_pcm_prepare(pcm_handle);
+        audio_data_release(ad);
+    }
+
+    // a switch still under way is abandoned
+    pthread_mutex_lock(&sink->fifo->mutex);
+    switching = sink->switch_name != NULL;
+    pthread_mutex_unlock(&sink->fifo->mutex);
 
-            snd_pcm_writei(pcm_handle, ad->samples, ad->nsamples);
-            free(ad);
+    if (switching) {
+        pthread_join(sink->opener, NULL);
+        if (sink->staged) {
+            sink->staged->ops->close(sink->staged);
+            audio_sink_destroy(sink->staged);
+            sink->staged = NULL;
         }
+        free(sink->switch_name);
+        sink->switch_name = NULL;
     }
+
+    if (sink->handle)
+        sink->ops->close(sink);
+
+    return NULL;
+}
+
+/**
+ * Returns the bytes an audio_data_t of nsamples takes, samples included.
+ */
+static size_t audio_data_size(int channels, int nsamples)
+{
+    return sizeof(audio_data_t) + (size_t) nsamples * sizeof(float) * channels;
+}
+
+/**
+ * Allocates a chunk that was already charged to g_audio_chunk_bytes.
+ */
+static audio_data_t *audio_data_alloc(int channels, int nsamples, int sample_rate)
+{
+    size_t size = audio_data_size(channels, nsamples);
+    audio_data_t *ad = malloc(size);
+
+    __sync_add_and_fetch(&g_audio_data_live, 1);
+
+    ad->refs = 1;
+    ad->channels = channels;
+    ad->nsamples = nsamples;
+    ad->sample_rate = sample_rate;
+    ad->sample_size = size - sizeof(audio_data_t);
+    ad->size = size;
+
+    return ad;
 }
 
 /**
  * Allocates and returns a pointer to a new audio_data_t, no data is held in
- * the samples flexable array.
+ * the samples flexable array. The caller holds the only reference. It is
+ * accounted to MEM_AUDIO even over budget, audio_fifo_write() is where the
+ * budget is enforced.
  *
  * @param channels number of channels
  * @param nsamples number of samples
@@ -253,18 +527,9 @@ static void *alsa_audio_start(void *audio)
  */
 audio_data_t *audio_data_create(int channels, int nsamples, int sample_rate)
 {
-    // calculate sample size
-    size_t sample_size = nsamples * sizeof(int16_t) * channels;
-
-    // allocate with sample size
-    audio_data_t *ad = malloc(sizeof(audio_data_t) + sample_size);
-
-    ad->channels = channels;
-    ad->nsamples = nsamples;
-    ad->sample_rate = sample_rate;
-    ad->sample_size = sample_size;
-
-    return ad;
+    mem_charge_part(MEM_AUDIO, &g_audio_chunk_bytes,
+                    audio_data_size(channels, nsamples));
+    return audio_data_alloc(channels, nsamples, sample_rate);
 }
 
 /**
@@ -274,72 +539,920 @@ audio_data_t *audio_data_create(int channels, int nsamples, int sample_rate)
  */
 void audio_data_destroy(audio_data_t *ad)
 {
+    __sync_sub_and_fetch(&g_audio_data_live, 1);
+    mem_uncharge_part(MEM_AUDIO, &g_audio_chunk_bytes, ad->size);
     free(ad);
 }
 
 /**
- * Initializes the audio_fifo_t and spawns a new pthread to handle audio
- * playback.
+ * Drops one reference to an audio_data_t, destroying it once the fifo and
+ * every sink are done with it. Thread safe.
+ *
+ * @param ad pointer to audio_data_t
+ */
+void audio_data_release(audio_data_t *ad)
+{
+    if (__sync_sub_and_fetch(&ad->refs, 1) == 0)
+        audio_data_destroy(ad);
+}
+
+/**
+ * Returns how many chunks are allocated right now, across all fifos.
+ *
+ * @return live audio_data_t count
+ */
+long audio_data_live()
+{
+    return __sync_add_and_fetch(&g_audio_data_live, 0);
+}
+
+/**
+ * Allocates a new sink, it does nothing until it is added to a fifo.
+ *
+ * @param ops output implementation
+ * @param name device name or file path handed to ops
+ *
+ * @return pointer to new audio_sink_t
+ */
+audio_sink_t *audio_sink_create(const audio_sink_ops_t *ops, const char *name)
+{
+    audio_sink_t *sink = calloc(1, sizeof(audio_sink_t));
+
+    sink->ops = ops;
+    sink->name = strdup(name);
+    eq_state_init(&sink->eq);
+
+    return sink;
+}
+
+/**
+ * Frees a sink. The sink must already be stopped by audio_fifo_release().
+ *
+ * @param sink pointer to audio_sink_t
+ */
+void audio_sink_destroy(audio_sink_t *sink)
+{
+    eq_state_release(&sink->eq);
+    free(sink->name);
+    free(sink);
+}
+
+/**
+ * Moves a sink to another device of the same kind without stopping
+ * playback. The new device is opened in the background while the old one
+ * keeps playing, then the sink thread hands over between two chunks and
+ * closes the old one. On failure the sink stays on its device. Thread safe.
  *
- * This function is borrowed from the example "jukebox" supplied with
- * libspotify. Some changes have been made to make it more readable.
+ * @param sink audio_sink_t, added to a fifo
+ * @param name device to play to
+ *
+ * @return false if a switch is already under way or the sink is stopping
+ */
+bool audio_sink_switch(audio_sink_t *sink, const char *name)
+{
+    audio_fifo_t *af = sink->fifo;
+
+    pthread_mutex_lock(&af->mutex);
+
+    if (sink->quit || sink->switch_name) {
+        pthread_mutex_unlock(&af->mutex);
+        return false;
+    }
+
+    sink->switch_name = strdup(name);
+    if (pthread_create(&sink->opener, NULL, audio_sink_opener, sink) != 0) {
+        free(sink->switch_name);
+        sink->switch_name = NULL;
+        pthread_mutex_unlock(&af->mutex);
+        return false;
+    }
+    rt_thread_name(sink->opener, "sink-open");
+
+    pthread_mutex_unlock(&af->mutex);
+
+    return true;
+}
+
+/**
+ * Initializes an empty audio_fifo_t, outputs are attached afterwards with
+ * audio_fifo_add_sink().
  *
  * @param af address of audio_fifo_t allocated on the stack
  */
 void audio_fifo_init(audio_fifo_t *af)
 {
-    pthread_t thread_id;
+    memset(af->slots, 0, sizeof(af->slots));
+    memset(&af->watermark, 0, sizeof(af->watermark));
+    memset(&af->rt, 0, sizeof(af->rt));
+    af->head = 0;
+    af->generation = 0;
+    af->paused = false;
+    af->seek_pending = false;
+    af->seek_latency = 0;
+    af->gain = 1.0f;
+    af->nsinks = 0;
+    eq_init(&af->eq);
+
+    af->watchers = 0;
+    af->snapshot_seq = 0;
+    memset(&af->snapshot, 0, sizeof(af->snapshot));
+    memset(&af->snapshot_time, 0, sizeof(af->snapshot_time));
+    af->snapshot_audio = 0;
 
-    // create queue
-    af->queue = queue_create();
+    loudness_reset(&af->loudness);
+    af->loudness_generation = 0;
+    af->loudness_gain = 1.0f;
 
-    // set total_samples to 0
-    af->total_samples = 0;
+    crossfade_init(&af->crossfade, 0, CROSSFADE_EQUAL_POWER);
+    af->duration_ms = 0;
+    af->position = 0;
+    af->next_queued = false;
+    af->mixing = false;
 
     pthread_mutex_init(&af->mutex, NULL);
     pthread_cond_init(&af->cond, NULL);
+    pthread_mutex_init(&af->loudness_mutex, NULL);
+
+    audio_fifo_set_limits(af, AUDIO_BUFFER_MIN, AUDIO_BUFFER_MAX);
+}
+
+/**
+ * Stops and destroys every sink, then frees all buffered audio.
+ *
+ * @param af audio_fifo_t
+ */
+void audio_fifo_release(audio_fifo_t *af)
+{
+    int i;
+
+    pthread_mutex_lock(&af->mutex);
+    for (i = 0; i < af->nsinks; i++)
+        af->sinks[i]->quit = true;
+    pthread_cond_broadcast(&af->cond);
+    pthread_mutex_unlock(&af->mutex);
+
+    for (i = 0; i < af->nsinks; i++) {
+        pthread_join(af->sinks[i]->thread, NULL);
+        audio_sink_destroy(af->sinks[i]);
+    }
+    af->nsinks = 0;
+
+    for (i = 0; i < AUDIO_FIFO_SLOTS; i++) {
+        if (af->slots[i])
+            audio_data_release(af->slots[i]);
+        af->slots[i] = NULL;
+    }
+
+    crossfade_release(&af->crossfade);
+
+    pthread_mutex_destroy(&af->mutex);
+    pthread_cond_destroy(&af->cond);
+    pthread_mutex_destroy(&af->loudness_mutex);
+}
+
+/**
+ * Sets the memory the fifo may buffer ahead of the fastest sink. The
+ * adaptive target always stays within these bounds.
+ *
+ * @param af audio_fifo_t
+ * @param min_bytes least bytes buffered before refusing data
+ * @param max_bytes most bytes ever buffered
+ */
+void audio_fifo_set_limits(audio_fifo_t *af, size_t min_bytes, size_t max_bytes)
+{
+    pthread_mutex_lock(&af->mutex);
+
+    af->watermark.min_bytes = min_bytes;
+    af->watermark.max_bytes = MAX(min_bytes, max_bytes);
+    af->watermark.high_bytes = min_bytes;
+    af->watermark.low_bytes = min_bytes / 4 * 3;
+
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Sets the scheduling used for sink threads added from now on.
+ *
+ * @param af audio_fifo_t
+ * @param rt scheduling policy, priority and cpu affinity
+ */
+void audio_fifo_set_rt(audio_fifo_t *af, const rt_config_t *rt)
+{
+    pthread_mutex_lock(&af->mutex);
+    af->rt = *rt;
+    pthread_mutex_unlock(&af->mutex);
+}
 
-    pthread_create(&thread_id, NULL, alsa_audio_start, af);
+/**
+ * Changes the equalizer of every sink, heard from the next chunk each sink
+ * plays. Lock free, but only one thread may change the equalizer.
+ *
+ * @param af audio_fifo_t
+ * @param params bands and preamp
+ */
+void audio_fifo_set_eq(audio_fifo_t *af, const eq_params_t *params)
+{
+    eq_set(&af->eq, params);
 }
 
 /**
- * Flushes the given audio_fifo queue of all members and resets the queue
- * length to 0. Thread safe.
+ * Sets how long the end of a track overlaps the start of the next one, 0
+ * plays them back to back. The tail buffer for the longest window is
+ * allocated here, switching tracks never allocates it. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param window_ms overlap, at most CROSSFADE_MAX_MS
+ * @param curve fade curve
+ */
+void audio_fifo_set_crossfade(audio_fifo_t *af, int window_ms,
+                              crossfade_curve_t curve)
+{
+    pthread_mutex_lock(&af->mutex);
+
+    crossfade_release(&af->crossfade);
+    crossfade_init(&af->crossfade, window_ms, curve);
+    af->mixing = false;
+
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Fills in the current buffer target and fill level. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param stats audio_fifo_stats_t to fill in
+ */
+void audio_fifo_stats(audio_fifo_t *af, audio_fifo_stats_t *stats)
+{
+    int i;
+
+    pthread_mutex_lock(&af->mutex);
+
+    stats->target_bytes = af->watermark.high_bytes;
+    stats->low_bytes = af->watermark.low_bytes;
+    stats->fill_bytes = audio_fifo_min_queued(af);
+    stats->jitter_ms = af->watermark.jitter * 1000;
+    stats->consumer_rate = af->watermark.consumer_rate;
+    stats->seek_latency_ms = af->seek_latency * 1000;
+    stats->seek_pending = af->seek_pending;
+
+    stats->dropped_chunks = 0;
+    for (i = 0; i < af->nsinks; i++)
+        stats->dropped_chunks += af->sinks[i]->dropped_chunks;
+
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Returns how far into the current track playback is: the audio written
+ * minus what the fastest sink still has buffered. Audio queued in the
+ * devices themselves counts as played. Thread safe.
+ *
+ * @param af audio_fifo_t
+ *
+ * @return milliseconds into the current track
+ */
+int audio_fifo_position(audio_fifo_t *af)
+{
+    audio_data_t *last;
+    double position;
+    size_t queued;
+
+    pthread_mutex_lock(&af->mutex);
+
+    position = af->position;
+    queued = audio_fifo_min_queued(af);
+    last = af->slots[(af->head + AUDIO_FIFO_SLOTS - 1) % AUDIO_FIFO_SLOTS];
+
+    // everything buffered has the format of the last chunk written
+    if (queued > 0 && last)
+        position -= (double) queued /
+                    (sizeof(float) * last->channels * last->sample_rate);
+
+    pthread_mutex_unlock(&af->mutex);
+
+    return position > 0 ? (int) (position * 1000) : 0;
+}
+
+/**
+ * Starts or stops watching the pipeline. Snapshots are only published while
+ * anyone watches, otherwise the audio threads skip them after a single
+ * load. Calls to start and stop must pair up. Lock free.
+ *
+ * @param af audio_fifo_t
+ * @param watching true to start watching, false to stop
+ */
+void audio_fifo_watch(audio_fifo_t *af, bool watching)
+{
+    __atomic_add_fetch(&af->watchers, watching ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies a sequence counted snapshot, retrying while its writer is busy.
+ *
+ * @param seq sequence counter, odd while the writer is busy
+ * @param src snapshot
+ * @param dst copy
+ * @param size size of the snapshot
+ */
+static void audio_snapshot_read(unsigned int *seq, const void *src, void *dst,
+                                size_t size)
+{
+    unsigned int start;
+
+    do {
+        while ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+
+        memcpy(dst, src, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(seq, __ATOMIC_RELAXED) != start);
+}
+
+/**
+ * Reads the latest snapshots of the fifo and every sink, at most
+ * AUDIO_SNAPSHOT_MS old while watched with audio_fifo_watch(). Never blocks
+ * the audio threads. Sinks that haven't published yet have no name.
+ *
+ * @param af audio_fifo_t
+ * @param snapshot audio_snapshot_t to fill in
+ */
+void audio_fifo_snapshot(audio_fifo_t *af, audio_snapshot_t *snapshot)
+{
+    int i;
+    audio_sink_t *sink;
+
+    audio_snapshot_read(&af->snapshot_seq, &af->snapshot, snapshot,
+                        offsetof(audio_snapshot_t, nsinks));
+
+    snapshot->nsinks = __atomic_load_n(&af->nsinks, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < snapshot->nsinks; i++) {
+        sink = af->sinks[i];
+        audio_snapshot_read(&sink->stats_seq, &sink->stats, &snapshot->sinks[i],
+                            sizeof(audio_sink_stats_t));
+    }
+}
+
+/**
+ * Attaches a sink to the fifo and spawns the thread feeding it, scheduled
+ * as set by audio_fifo_set_rt(). The sink starts reading at the current
+ * head, it never sees audio buffered before it was added.
+ *
+ * @param af audio_fifo_t
+ * @param sink audio_sink_t, owned by the fifo from now on
+ *
+ * @return true on success
+ */
+bool audio_fifo_add_sink(audio_fifo_t *af, audio_sink_t *sink)
+{
+    char name[32];
+
+    pthread_mutex_lock(&af->mutex);
+
+    if (af->nsinks == AUDIO_MAX_SINKS) {
+        pthread_mutex_unlock(&af->mutex);
+        log_error("%s: too many audio sinks (max %d)\n",
+                  sink->name, AUDIO_MAX_SINKS);
+        return false;
+    }
+
+    sink->fifo = af;
+    sink->cursor = af->head;
+    sink->queued = 0;
+    sink->frames_read = 0;
+    sink->generation = af->generation;
+    sink->prebuffering = true;
+    sink->paused = false;
+
+    snprintf(name, sizeof(name), "sink:%s", sink->name);
+    if (rt_thread_create(&sink->thread, &af->rt, name,
+                         audio_sink_start, sink) != 0) {
+        pthread_mutex_unlock(&af->mutex);
+        return false;
+    }
+
+    af->sinks[af->nsinks] = sink;
+    __atomic_add_fetch(&af->nsinks, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&af->mutex);
+
+    return true;
+}
+
+/**
+ * Flushes all chunks without taking the lock.
+ *
+ * @param af audio_fifo_t
+ */
+static void audio_fifo_flush_locked(audio_fifo_t *af)
+{
+    int i;
+
+    for (i = 0; i < AUDIO_FIFO_SLOTS; i++) {
+        if (af->slots[i])
+            audio_data_release(af->slots[i]);
+        af->slots[i] = NULL;
+    }
+
+    for (i = 0; i < af->nsinks; i++) {
+        af->sinks[i]->cursor = af->head;
+        af->sinks[i]->queued = 0;
+    }
+
+    // in flight deliveries belong to the old generation and are discarded
+    af->generation++;
+    af->watermark.last_delivery.tv_sec = 0;
+
+    // a cut, nothing is faded over it
+    crossfade_reset(&af->crossfade);
+    af->mixing = false;
+
+    pthread_cond_broadcast(&af->cond);
+}
+
+/**
+ * Flushes the given audio_fifo of all chunks and moves every sink's cursor
+ * to the head. Sinks drop what their outputs still hold. Thread safe.
  *
  * @param af audio_fifo_t
  */
 void audio_fifo_flush(audio_fifo_t *af)
 {
+    pthread_mutex_lock(&af->mutex);
+    audio_fifo_flush_locked(af);
+    af->position = 0;
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Flushes the fifo for a seek or track change and starts timing how long
+ * the first sample of the new position takes to reach an output. Call it
+ * right after asking libspotify for the new position. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param position_ms new position in the track
+ */
+void audio_fifo_seek(audio_fifo_t *af, int position_ms)
+{
+    pthread_mutex_lock(&af->mutex);
+
+    audio_fifo_flush_locked(af);
+    clock_gettime(CLOCK_MONOTONIC, &af->seek_start);
+    af->seek_pending = true;
+    af->position = position_ms / 1000.0;
+
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Starts a new track: flushes like audio_fifo_seek(), applies gain to all
+ * audio written from now on and starts measuring the loudness of the track
+ * over. Seeks within the track keep adding to the measurement. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param gain linear normalization gain of the track
+ * @param duration_ms length of the track, 0 if unknown
+ */
+void audio_fifo_track(audio_fifo_t *af, float gain, int duration_ms)
+{
+    unsigned int generation;
+
     pthread_mutex_lock(&af->mutex);
 
-    // flush the queue
-    queue_flush(af->queue);
+    audio_fifo_flush_locked(af);
+    clock_gettime(CLOCK_MONOTONIC, &af->seek_start);
+    af->seek_pending = true;
+    af->gain = gain;
+    af->duration_ms = duration_ms;
+    af->position = 0;
+    generation = af->generation;
 
     pthread_mutex_unlock(&af->mutex);
+
+    pthread_mutex_lock(&af->loudness_mutex);
+
+    loudness_reset(&af->loudness);
+    af->loudness_generation = generation;
+    af->loudness_gain = gain;
+
+    pthread_mutex_unlock(&af->loudness_mutex);
+}
+
+/**
+ * Continues with the next track once the current one was written to the
+ * end, without dropping anything still buffered. The held back end of the
+ * current track, if any, is faded out over the start of the next one.
+ * Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param gain linear normalization gain of the next track
+ * @param duration_ms length of the next track, 0 if unknown
+ */
+void audio_fifo_next(audio_fifo_t *af, float gain, int duration_ms)
+{
+    unsigned int generation;
+
+    pthread_mutex_lock(&af->mutex);
+
+    af->gain = gain;
+    af->duration_ms = duration_ms;
+    af->position = 0;
+    af->next_queued = false;
+    af->mixing = af->crossfade.tail_frames > 0;
+    generation = af->generation;
+
+    pthread_mutex_unlock(&af->mutex);
+
+    pthread_mutex_lock(&af->loudness_mutex);
+
+    loudness_reset(&af->loudness);
+    af->loudness_generation = generation;
+    af->loudness_gain = gain;
+
+    pthread_mutex_unlock(&af->loudness_mutex);
+}
+
+/**
+ * Tells the fifo whether another track follows the current one. Only then
+ * is the end of the current track held back for crossfading, otherwise it
+ * is played out as it is written. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param queued true if a track follows
+ */
+void audio_fifo_set_next(audio_fifo_t *af, bool queued)
+{
+    pthread_mutex_lock(&af->mutex);
+    af->next_queued = queued;
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Reads the loudness measured for the current track, corrected for the gain
+ * it is played with so it describes the track itself. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param result loudness_result_t to fill in
+ */
+void audio_fifo_loudness(audio_fifo_t *af, loudness_result_t *result)
+{
+    double db;
+
+    pthread_mutex_lock(&af->loudness_mutex);
+
+    loudness_result(&af->loudness, result);
+    db = 20.0 * log10(af->loudness_gain);
+
+    pthread_mutex_unlock(&af->loudness_mutex);
+
+    if (result->integrated > LOUDNESS_FLOOR)
+        result->integrated -= db;
+    if (result->true_peak > LOUDNESS_FLOOR)
+        result->true_peak -= db;
 }
 
 /**
- * Returns the data from the first element in the given audio_fifo_t queue.
+ * Pauses or resumes every sink. A paused sink stops its output within a
+ * period and keeps all buffered chunks, resuming plays them right away.
  * Thread safe.
  *
  * @param af audio_fifo_t
+ * @param paused true to pause, false to resume
+ */
+void audio_fifo_pause(audio_fifo_t *af, bool paused)
+{
+    pthread_mutex_lock(&af->mutex);
+
+    af->paused = paused;
+    pthread_cond_broadcast(&af->cond);
+
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/**
+ * Appends a chunk to the ring and accounts it to every sink. Must be called
+ * with the fifo mutex held.
+ *
+ * @param af audio_fifo_t
+ * @param ad chunk, the ring takes over the caller's reference
+ */
+static void audio_fifo_publish_locked(audio_fifo_t *af, audio_data_t *ad)
+{
+    int i;
+    audio_sink_t *sink;
+    audio_data_t **slot = &af->slots[af->head % AUDIO_FIFO_SLOTS];
+
+    // the slot is about to be overwritten, push back sinks still behind it
+    for (i = 0; i < af->nsinks; i++) {
+        sink = af->sinks[i];
+        if (af->head - sink->cursor >= AUDIO_FIFO_SLOTS) {
+            sink->cursor++;
+            sink->queued -= (*slot)->sample_size;
+            sink->dropped_chunks++;
+            sink->dropped_frames += (*slot)->nsamples;
+        }
+    }
+
+    if (*slot)
+        audio_data_release(*slot);
+
+    *slot = ad;
+    af->head++;
+
+    for (i = 0; i < af->nsinks; i++)
+        af->sinks[i]->queued += ad->sample_size;
+}
+
+/**
+ * Holds back the part of a chunk that falls into the crossfade window at the
+ * end of the track, the part before the window is published right away.
+ * Should the track run longer than its duration said, the held back frames
+ * are published once the tail is full and holding starts over, so the
+ * window always ends with the last frame written. Must be called with the
+ * fifo mutex held.
+ *
+ * @param af audio_fifo_t
+ * @param ad chunk just converted
+ * @param position seconds into the track the chunk starts at
+ *
+ * @return true if the chunk was taken care of, false to publish it as is
+ */
+static bool audio_fifo_hold_locked(audio_fifo_t *af, audio_data_t *ad,
+                                   double position)
+{
+    crossfade_t *cf = &af->crossfade;
+    int window = crossfade_window(cf, ad->sample_rate);
+    const float *samples;
+    double start;
+    int keep, held, remaining;
+    audio_data_t *overflow;
+
+    if (window == 0 || af->duration_ms == 0 ||
+        ad->channels > CROSSFADE_MAX_CHANNELS)
+        return false;
+
+    // frames of this chunk that play before the window
+    start = af->duration_ms / 1000.0 - (double) window / ad->sample_rate;
+    keep = (int) ((start - position) * ad->sample_rate + 0.5);
+    keep = MAX(0, MIN(keep, ad->nsamples));
+
+    if (keep == ad->nsamples)
+        return false;
+
+    samples = ad->samples + keep * ad->channels;
+    remaining = ad->nsamples - keep;
+
+    // the ring keeps the chunk alive until the mutex is released
+    if (keep > 0) {
+        ad->nsamples = keep;
+        ad->sample_size = (size_t) keep * ad->channels * sizeof(float);
+        audio_fifo_publish_locked(af, ad);
+    }
+
+    while (remaining > 0) {
+        held = crossfade_capture(cf, samples, remaining,
+                                 ad->sample_rate, ad->channels);
+        samples += held * ad->channels;
+        remaining -= held;
+
+        if (remaining > 0) {
+            overflow = audio_data_create(cf->tail_channels, cf->tail_frames,
+                                         cf->tail_rate);
+            overflow->generation = ad->generation;
+            crossfade_take(cf, overflow->samples, cf->tail_frames);
+            audio_fifo_publish_locked(af, overflow);
+        }
+    }
+
+    if (keep == 0)
+        audio_data_release(ad);
+
+    return true;
+}
+
+/**
+ * Converts decoded frames to float into a new chunk, applying the track's
+ * gain, measures its loudness and publishes it to every sink. When another
+ * track follows, the end of this one is held back for crossfading. Once
+ * the fastest sink has the high watermark buffered data is refused until it
+ * drains to the low watermark, and while the chunks are at the MEM_AUDIO
+ * budget. Sinks that are a full ring behind lose their oldest chunk. Thread
+ * safe.
+ *
+ * @param af audio_fifo_t
+ * @param channels channel count
+ * @param sample_rate sample rate
+ * @param frames interleaved 16 bit samples
+ * @param nframes number of frames in frames
+ *
+ * @return number of frames consumed, 0 if the fifo is full
+ */
+int audio_fifo_write(audio_fifo_t *af, int channels, int sample_rate,
+                     const int16_t *frames, int nframes)
+{
+    int i;
+    size_t fill;
+    uint64_t lag = AUDIO_FIFO_SLOTS;
+    struct timespec now;
+    unsigned int generation;
+    float gain;
+    double position;
+    audio_data_t *ad;
+    audio_watermark_t *wm = &af->watermark;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&af->mutex);
+
+    fill = audio_fifo_min_queued(af);
+    if (fill >= wm->high_bytes)
+        wm->refusing = true;
+    else if (fill <= wm->low_bytes)
+        wm->refusing = false;
+
+    // never overwrite a chunk the fastest sink has not read yet
+    for (i = 0; i < af->nsinks; i++)
+        lag = MIN(lag, af->head - af->sinks[i]->cursor);
+
+    // the chunk is charged up front, so a refusal costs no allocation
+    if ((af->nsinks > 0 && (wm->refusing || lag >= AUDIO_FIFO_SLOTS - 1)) ||
+        !mem_try_charge_part(MEM_AUDIO, &g_audio_chunk_bytes,
+                             audio_data_size(channels, nframes))) {
+        // the gap until the next accepted delivery is ours, not the network's
+        wm->last_delivery.tv_sec = 0;
+        pthread_mutex_unlock(&af->mutex);
+        return 0;
+    }
+
+    audio_watermark_update(af, &now, channels, sample_rate, nframes);
+    if (__atomic_load_n(&af->watchers, __ATOMIC_RELAXED) > 0)
+        audio_fifo_publish_snapshot(af, &now, fill, (double) nframes / sample_rate);
+
+    generation = af->generation;
+    gain = af->gain;
+
+    pthread_mutex_unlock(&af->mutex);
+
+    // allocate, convert and measure outside of the lock
+    ad = audio_data_alloc(channels, nframes, sample_rate);
+    ad->generation = generation;
+    convert_from_s16(frames, ad->samples, nframes * channels, gain);
+
+    pthread_mutex_lock(&af->loudness_mutex);
+    if ((int) (generation - af->loudness_generation) >= 0)
+        loudness_analyze(&af->loudness, ad->samples, nframes, sample_rate, channels);
+    pthread_mutex_unlock(&af->loudness_mutex);
+
+    pthread_mutex_lock(&af->mutex);
+
+    // flushed meanwhile, this is audio from before the seek
+    if (af->generation != generation) {
+        pthread_mutex_unlock(&af->mutex);
+        audio_data_release(ad);
+        return nframes;
+    }
+
+    position = af->position;
+    af->position += (double) nframes / sample_rate;
+
+    // the start of the next track fades in over the end of the last one
+    if (af->mixing) {
+        if (crossfade_mix(&af->crossfade, ad->samples, nframes,
+                          sample_rate, channels) == 0)
+            crossfade_reset(&af->crossfade);
+        af->mixing = af->crossfade.tail_frames > 0;
+        audio_fifo_publish_locked(af, ad);
+    } else if (!af->next_queued || !audio_fifo_hold_locked(af, ad, position)) {
+        audio_fifo_publish_locked(af, ad);
+    }
+
+    pthread_cond_broadcast(&af->cond);
+    pthread_mutex_unlock(&af->mutex);
+
+    return nframes;
+}
+
+/**
+ * Publishes what is left of the held back end of the track when no track
+ * follows it, as much as the watermark lets in at once. Called from the
+ * thread driving playback after the last frame was written, until it
+ * returns false. Thread safe.
+ *
+ * @param af audio_fifo_t
+ *
+ * @return true while part of the end is still held back
+ */
+bool audio_fifo_drain(audio_fifo_t *af)
+{
+    crossfade_t *cf = &af->crossfade;
+    audio_data_t *ad;
+    bool held;
+    int nframes;
+
+    pthread_mutex_lock(&af->mutex);
+
+    af->next_queued = false;
+
+    while (cf->tail_frames > 0 && cf->overlap == 0 && !af->mixing &&
+           (af->nsinks == 0 || audio_fifo_min_queued(af) < af->watermark.high_bytes)) {
+        nframes = MIN(cf->tail_frames, DRAIN_CHUNK_FRAMES);
+
+        ad = audio_data_create(cf->tail_channels, nframes, cf->tail_rate);
+        ad->generation = af->generation;
+        crossfade_take(cf, ad->samples, nframes);
+
+        audio_fifo_publish_locked(af, ad);
+    }
+
+    held = cf->tail_frames > 0 && !af->mixing;
+
+    pthread_cond_broadcast(&af->cond);
+    pthread_mutex_unlock(&af->mutex);
+
+    return held;
+}
+
+/**
+ * Returns the next chunk for the given sink, blocking until one is written
+ * and while the fifo is paused. After a flush, or when the sink was just
+ * added, nothing is returned until AUDIO_PREBUFFER bytes are buffered or
+ * AUDIO_PREBUFFER_MS have passed, so a new position doesn't start with an
+ * underrun. The caller owns a reference and must call audio_data_release()
+ * when done. Thread safe.
+ *
+ * @param af audio_fifo_t
+ * @param sink audio_sink_t reading
  *
- * @return pointer to audio_fifo_t
+ * @return pointer to audio_data_t, NULL once the sink is told to quit, its
+ *         device switch is ready to hand over or the fifo was flushed,
+ *         paused or resumed since the last call
  */
-audio_data_t *audio_fifo_dequeue(audio_fifo_t *af)
+audio_data_t *audio_fifo_dequeue(audio_fifo_t *af, audio_sink_t *sink)
 {
     audio_data_t *ad;
+    struct timespec deadline;
+    bool waiting = false;
+
     pthread_mutex_lock(&af->mutex);
 
-    // wait until more audio data shows up
-    while (queue_is_empty(af->queue))
-        pthread_cond_wait(&af->cond, &af->mutex);
+    while (true) {
+        if (sink->quit || sink->switch_done) {
+            pthread_mutex_unlock(&af->mutex);
+            return NULL;
+        }
+
+        if (sink->generation != af->generation) {
+            sink->generation = af->generation;
+            sink->prebuffering = true;
+            pthread_mutex_unlock(&af->mutex);
+            return NULL;
+        }
+
+        if (sink->paused != af->paused) {
+            sink->paused = af->paused;
+            pthread_mutex_unlock(&af->mutex);
+            return NULL;
+        }
+
+        if (sink->paused) {
+            pthread_cond_wait(&af->cond, &af->mutex);
+            continue;
+        }
+
+        // wait until more audio data shows up
+        if (sink->cursor == af->head) {
+            pthread_cond_wait(&af->cond, &af->mutex);
+            continue;
+        }
+
+        // never wait for more than the producer is willing to buffer
+        if (sink->prebuffering &&
+            sink->queued < MIN(AUDIO_PREBUFFER, af->watermark.low_bytes)) {
+            if (!waiting) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += AUDIO_PREBUFFER_MS * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+                waiting = true;
+            }
+
+            // give up on the prebuffer when it takes too long
+            if (pthread_cond_timedwait(&af->cond, &af->mutex, &deadline) != 0)
+                sink->prebuffering = false;
+            continue;
+        }
+
+        sink->prebuffering = false;
+        break;
+    }
 
-    // dequeue and cast back to audio_data_t
-    ad = (audio_data_t *) queue_dequeue(af->queue);
+    ad = af->slots[sink->cursor % AUDIO_FIFO_SLOTS];
+    __sync_add_and_fetch(&ad->refs, 1);
 
-    // update the total samples in the queue
-    af->total_samples -= ad->nsamples;
+    sink->cursor++;
+    sink->queued -= ad->sample_size;
+    sink->frames_read += ad->nsamples;
 
     pthread_mutex_unlock(&af->mutex);
     return ad;
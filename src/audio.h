@@ -1,31 +1,249 @@
 #ifndef SPOTICLI_AUDIO_H
 #define SPOTICLI_AUDIO_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
-#include "queue.h"
+#include "audio/rt.h"
+#include "audio/loudness.h"
+#include "audio/eq.h"
+#include "audio/crossfade.h"
+#include "mem.h"
+
+#define AUDIO_FIFO_SLOTS    256     // chunks held by the ring
+#define AUDIO_MAX_SINKS     8       // simultaneous outputs
+
+#define AUDIO_BUFFER_MIN    (64 * 1024)     // default buffer floor, bytes
+#define AUDIO_BUFFER_MAX    (1024 * 1024)   // default buffer ceiling, bytes
+#define AUDIO_PREBUFFER     (32 * 1024)     // buffered before playing a new position
+#define AUDIO_PREBUFFER_MS  200             // longest wait for the prebuffer
+
+#define AUDIO_DEFAULT_RATE      44100   // outputs are opened with this format
+#define AUDIO_DEFAULT_CHANNELS  2       // before the first chunk arrives
+
+#define AUDIO_SNAPSHOT_MS   500     // snapshot refresh while someone watches
+#define AUDIO_NAME_SIZE     64      // sink names as published in snapshots
+#define AUDIO_RETRY_MS      1000    // reopen interval of a lost device
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
 
 typedef struct audio_data_s {
+    int refs;               // held by the fifo ring and by sinks playing it
+    unsigned int generation;    // fifo generation the chunk was written in
     int channels;
     int nsamples;
     int sample_rate;
     size_t sample_size;     // size of samples array
-    int16_t samples[];      // flexable array
+    size_t size;            // bytes allocated, accounted to MEM_AUDIO
+    float samples[];        // flexable array, interleaved full scale floats
 } audio_data_t;
 
+struct audio_sink_s;
+struct audio_fifo_s;
+
+/**
+ * What a sink last published about itself, see audio_fifo_snapshot().
+ */
+typedef struct audio_sink_stats_s {
+    char name[AUDIO_NAME_SIZE]; // device playing to, empty if not published
+    int rate;
+    int channels;
+    const char *format;         // device sample format, NULL if not known
+    int period;                 // frames per device period, 0 if none
+    unsigned long xruns;        // device underruns since the sink started
+    bool lost;                  // device gone, retried every AUDIO_RETRY_MS
+    double cpu_percent;         // of one core, over the last refresh
+} audio_sink_stats_t;
+
+/**
+ * Pipeline health as published by the audio threads at most every
+ * AUDIO_SNAPSHOT_MS, and only while anyone watches.
+ */
+typedef struct audio_snapshot_s {
+    size_t fill_bytes;          // buffered for the fastest sink
+    size_t target_bytes;        // current high watermark
+    double intake;              // seconds of audio written per second
+    int nsinks;
+    audio_sink_stats_t sinks[AUDIO_MAX_SINKS];
+} audio_snapshot_t;
+
+/**
+ * Operations implemented by an output. Each sink is driven by its own thread,
+ * so none of these need to be thread safe. open() is called again whenever
+ * the format of the stream changes. write() gets float samples and converts
+ * them to whatever the output takes. drop() is optional, it throws away
+ * audio the output has buffered but not yet played. pause() is optional too,
+ * it stops and restarts playback without losing buffered audio. handover()
+ * is optional as well, it moves audio the sink's device has queued but not
+ * played over to next, a sink of the same ops opened for another device,
+ * along with the pause state. Without it that audio is lost on a switch.
+ */
+typedef struct audio_sink_ops_s {
+    int (*open)(struct audio_sink_s *sink, int rate, int channels);
+    int (*write)(struct audio_sink_s *sink, const float *samples, int nframes);
+    void (*close)(struct audio_sink_s *sink);
+    void (*drop)(struct audio_sink_s *sink);
+    void (*pause)(struct audio_sink_s *sink, bool paused);
+    void (*handover)(struct audio_sink_s *sink, struct audio_sink_s *next);
+} audio_sink_ops_t;
+
+typedef struct audio_sink_s {
+    const audio_sink_ops_t *ops;
+    char *name;                 // device name or file path, owned by the thread
+    void *handle;               // owned by ops, NULL while closed
+    int rate;
+    int channels;
+
+    struct audio_fifo_s *fifo;
+    pthread_t thread;
+    bool quit;
+    eq_state_t eq;              // equalizer filters, used by the sink thread
+
+    // set by ops for the snapshot, used by the sink thread
+    const char *format;         // negotiated device format
+    int period;                 // frames per device period
+    unsigned long xruns;        // underruns the device recovered from
+    bool lost;                  // set by the sink thread while it can't open
+
+    // snapshot published by the sink thread under stats_seq
+    unsigned int stats_seq;     // odd while publishing
+    audio_sink_stats_t stats;
+    struct timespec stats_time; // wall and thread cpu time of the last one
+    struct timespec stats_cpu;
+
+    // guarded by the fifo mutex
+    uint64_t cursor;            // next chunk this sink reads
+    size_t queued;              // bytes waiting for this sink
+    uint64_t frames_read;       // frames handed to this sink
+    unsigned int generation;    // fifo generation this sink is playing
+    bool prebuffering;          // waiting for AUDIO_PREBUFFER before playing
+    bool paused;                // pause state last applied to the output
+    unsigned long dropped_chunks;
+    unsigned long dropped_frames;
+
+    // device switch, guarded by the fifo mutex
+    char *switch_name;          // device opened in the background, NULL if none
+    struct audio_sink_s *staged;    // switch_name opened, NULL if that failed
+    bool switch_done;           // opener finished, the sink thread takes over
+    pthread_t opener;
+} audio_sink_t;
+
+/**
+ * Adaptive buffer target. Delivery jitter is the smoothed difference between
+ * the time between two deliveries and the audio those deliveries carried,
+ * the consumer rate is measured from the fastest sink.
+ */
+typedef struct audio_watermark_s {
+    size_t min_bytes;           // configured floor
+    size_t max_bytes;           // configured ceiling
+    size_t high_bytes;          // refuse data above this
+    size_t low_bytes;           // accept data again below this
+    bool refusing;              // between high and low after hitting high
+
+    double jitter;              // smoothed delivery jitter, seconds
+    double stall;               // decaying worst delivery stall, seconds
+    double consumer_rate;       // frames per second, 0 until measured
+
+    struct timespec last_delivery;
+    double last_duration;       // seconds of audio in the last delivery
+    struct timespec rate_start; // start of the consumer rate window
+    uint64_t rate_frames;       // frames read by the fastest sink at start
+} audio_watermark_t;
+
+typedef struct audio_fifo_stats_s {
+    size_t target_bytes;        // current high watermark
+    size_t low_bytes;           // current low watermark
+    size_t fill_bytes;          // bytes buffered for the fastest sink
+    double jitter_ms;
+    double consumer_rate;
+    unsigned long dropped_chunks;   // summed over all sinks
+    double seek_latency_ms;     // last seek until its first sample was written
+    bool seek_pending;          // a seek is waiting for its first sample
+} audio_fifo_stats_t;
+
+/**
+ * Single producer, multiple consumer ring of decoded chunks. The producer
+ * writes each chunk once and every sink reads it through its own cursor.
+ * A sink that falls a full ring behind loses its oldest chunks instead of
+ * holding back the producer. Flushing starts a new generation, chunks from
+ * an older generation are never played.
+ */
 typedef struct audio_fifo_s {
-    queue_t *queue;         // generic queue to hold audio_data_t
-    int total_samples;      // total samples in the queue
+    audio_data_t *slots[AUDIO_FIFO_SLOTS];
+    uint64_t head;              // total chunks written
+    unsigned int generation;    // bumped by every flush or seek
+    bool paused;                // sinks hold their chunks while set
+    audio_sink_t *sinks[AUDIO_MAX_SINKS];
+    int nsinks;
+    audio_watermark_t watermark;
+    rt_config_t rt;             // scheduling of sink threads
+    struct timespec seek_start; // when the pending seek was requested
+    bool seek_pending;          // no sample of the new position written yet
+    double seek_latency;        // seconds, last completed seek
+    float gain;                 // normalization applied to the current track
+    eq_t eq;                    // equalizer settings shared by the sinks
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+
+    // snapshot published by the producer under snapshot_seq
+    int watchers;               // audio_fifo_watch() calls still watching
+    unsigned int snapshot_seq;  // odd while publishing
+    audio_snapshot_t snapshot;  // only the fifo part is used
+    struct timespec snapshot_time;
+    double snapshot_audio;      // seconds of audio written since snapshot_time
+
+    // transition into the next track, guarded by mutex
+    crossfade_t crossfade;
+    int duration_ms;            // of the current track, 0 when unknown
+    double position;            // seconds of the current track written
+    bool next_queued;           // hold back the end of the current track
+    bool mixing;                // fading the held back end into this track
+
+    // loudness of the current track, measured by the producer
+    loudness_t loudness;
+    unsigned int loudness_generation;   // first generation of the track
+    float loudness_gain;        // gain the measured audio was written with
+    pthread_mutex_t loudness_mutex;
 } audio_fifo_t;
 
-audio_data_t *audio_data_create();
-void audio_data_destroy(audio_data_t *afd);
+audio_data_t *audio_data_create(int channels, int nsamples, int sample_rate);
+void audio_data_destroy(audio_data_t *ad);
+void audio_data_release(audio_data_t *ad);
+long audio_data_live();
+
+audio_sink_t *audio_sink_create(const audio_sink_ops_t *ops, const char *name);
+void audio_sink_destroy(audio_sink_t *sink);
+bool audio_sink_switch(audio_sink_t *sink, const char *name);
 
 void audio_fifo_init(audio_fifo_t *af);
+void audio_fifo_release(audio_fifo_t *af);
+void audio_fifo_set_limits(audio_fifo_t *af, size_t min_bytes, size_t max_bytes);
+void audio_fifo_set_rt(audio_fifo_t *af, const rt_config_t *rt);
+void audio_fifo_set_eq(audio_fifo_t *af, const eq_params_t *params);
+void audio_fifo_set_crossfade(audio_fifo_t *af, int window_ms,
+                              crossfade_curve_t curve);
+void audio_fifo_stats(audio_fifo_t *af, audio_fifo_stats_t *stats);
+int audio_fifo_position(audio_fifo_t *af);
+void audio_fifo_watch(audio_fifo_t *af, bool watching);
+void audio_fifo_snapshot(audio_fifo_t *af, audio_snapshot_t *snapshot);
+bool audio_fifo_add_sink(audio_fifo_t *af, audio_sink_t *sink);
 void audio_fifo_flush(audio_fifo_t *af);
-audio_data_t *audio_fifo_dequeue(audio_fifo_t *af);
+void audio_fifo_seek(audio_fifo_t *af, int position_ms);
+void audio_fifo_track(audio_fifo_t *af, float gain, int duration_ms);
+void audio_fifo_next(audio_fifo_t *af, float gain, int duration_ms);
+void audio_fifo_set_next(audio_fifo_t *af, bool queued);
+bool audio_fifo_drain(audio_fifo_t *af);
+void audio_fifo_loudness(audio_fifo_t *af, loudness_result_t *result);
+void audio_fifo_pause(audio_fifo_t *af, bool paused);
+int audio_fifo_write(audio_fifo_t *af, int channels, int sample_rate,
+                     const int16_t *frames, int nframes);
+audio_data_t *audio_fifo_dequeue(audio_fifo_t *af, audio_sink_t *sink);
 
 #endif
@@ -0,0 +1,688 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+
+#include "alsa.h"
+#include "convert.h"
+#include "mem.h"
+#include "debug.h"
+
+
+#define PERIOD_SIZE     1024
+#define BUFFER_SIZE     (PERIOD_SIZE * 4)
+
+/**
+ * State behind audio_sink_t.handle for alsa outputs.
+ */
+typedef struct alsa_handle_s {
+    snd_pcm_t *pcm;
+    sample_format_t format;     // negotiated device format
+    size_t frame_size;          // bytes per frame in the device format
+    bool can_pause;             // device supports snd_pcm_pause()
+    dither_t dither;
+    char buffer[PERIOD_SIZE * 8 * sizeof(int32_t)];    // converted period
+
+    // the last buffer_size frames written, replayed after a software pause
+    char *history;
+    snd_pcm_uframes_t buffer_size;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t history_pos;  // next frame written in history
+    snd_pcm_uframes_t history_fill;
+    snd_pcm_uframes_t replay;       // frames to replay on resume
+} alsa_handle_t;
+
+/**
+ * Device formats in order of preference, the deepest the device takes wins.
+ */
+static const struct {
+    snd_pcm_format_t alsa;
+    sample_format_t format;
+} alsa_formats[] = {
+    { SND_PCM_FORMAT_S32_LE, SAMPLE_S32 },
+    { SND_PCM_FORMAT_S24_LE, SAMPLE_S24 },
+    { SND_PCM_FORMAT_S16_LE, SAMPLE_S16 }
+};
+
+#define ALSA_NFORMATS (sizeof(alsa_formats) / sizeof(alsa_formats[0]))
+#define ALSA_MAX_CHANNELS 8
+
+/**
+ * Negotiates the hardware params for playback: access, the deepest format
+ * the device takes, rate, channels, period and buffer size, then writes
+ * them to the device. The caller owns and frees the params struct.
+ *
+ * @param pcm_handle pcm device
+ * @param hw_params allocated hardware params struct
+ * @param rate sample rate
+ * @param channels channel count
+ * @param handle gets the negotiated format, period and buffer size and pause
+ *        support
+ *
+ * @return false if the device can't be configured
+ */
+static bool alsa_set_hw_params(snd_pcm_t *pcm_handle,
+                               snd_pcm_hw_params_t *hw_params, int rate,
+                               int channels, alsa_handle_t *handle)
+{
+    int error;
+    int dir;
+    size_t i;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+
+    // intialize the hardware params struct
+    if ((error = snd_pcm_hw_params_any(pcm_handle, hw_params)) < 0) {
+        fprintf(stderr, "ALSA: unable to initialize hardware param struct (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    // set access type to interleaved
+    if ((error = snd_pcm_hw_params_set_access(pcm_handle,
+                    hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+        fprintf(stderr, "ALSA: unable to set access type (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    // pick the deepest integer format the device takes
+    for (i = 0; i < ALSA_NFORMATS; i++) {
+        if (snd_pcm_hw_params_test_format(pcm_handle,
+                    hw_params, alsa_formats[i].alsa) == 0)
+            break;
+    }
+
+    if (i == ALSA_NFORMATS) {
+        fprintf(stderr, "ALSA: no supported sample format\n");
+        return false;
+    }
+
+    if ((error = snd_pcm_hw_params_set_format(pcm_handle,
+                    hw_params, alsa_formats[i].alsa)) < 0) {
+        fprintf(stderr, "ALSA: unable to set sample format (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    handle->format = alsa_formats[i].format;
+
+    // set sample rate
+    if ((error = snd_pcm_hw_params_set_rate(pcm_handle,
+                    hw_params, rate, 0)) < 0) {
+        fprintf(stderr, "ALSA: unable to set sample rate (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    // set channel count
+    if ((error = snd_pcm_hw_params_set_channels(pcm_handle,
+                    hw_params, channels)) < 0) {
+        fprintf(stderr, "ALSA: unable to set channel count (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    // configure the period
+    dir = 0;
+    period_size = PERIOD_SIZE;
+    if ((error = snd_pcm_hw_params_set_period_size_near(pcm_handle,
+                    hw_params, &period_size, &dir)) < 0) {
+        fprintf(stderr, "ALSA: unable to set period size %lu (%s)\n",
+                period_size, snd_strerror(error));
+        return false;
+    }
+
+    // configure the buffer size
+    buffer_size = BUFFER_SIZE;
+    if ((error = snd_pcm_hw_params_set_buffer_size_near(pcm_handle,
+                    hw_params, &buffer_size)) < 0) {
+        fprintf(stderr, "ALSA: unable to set buffer size %lu (%s)\n",
+                buffer_size, snd_strerror(error));
+        return false;
+    }
+
+    // write the hw params
+    if ((error = snd_pcm_hw_params(pcm_handle, hw_params)) < 0) {
+        fprintf(stderr, "ALSA: unable to configure hardware params (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    handle->buffer_size = buffer_size;
+    handle->period_size = period_size;
+    handle->can_pause = snd_pcm_hw_params_can_pause(hw_params);
+    return true;
+}
+
+/**
+ * Sets the wakeup and start thresholds and writes them to the device. The
+ * caller owns and frees the params struct.
+ *
+ * @param pcm_handle pcm device
+ * @param sw_params allocated software params struct
+ *
+ * @return false if the device can't be configured
+ */
+static bool alsa_set_sw_params(snd_pcm_t *pcm_handle,
+                               snd_pcm_sw_params_t *sw_params)
+{
+    int error;
+
+    // configure wakeup threshold
+    if ((error = snd_pcm_sw_params_set_avail_min(pcm_handle,
+                    sw_params, PERIOD_SIZE)) < 0) {
+        fprintf(stderr, "ALSA: unable to configure wakeup threshold (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    // configure start threshold
+    if ((error = snd_pcm_sw_params_set_start_threshold(pcm_handle,
+                    sw_params, 0)) < 0) {
+        fprintf(stderr, "ALSA: unable to configure start threshold (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    // write the sw params
+    if ((error = snd_pcm_sw_params(pcm_handle, sw_params)) < 0) {
+        fprintf(stderr, "ALSA: unable to configure software params (%s)\n",
+                snd_strerror(error));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Opens and returns a handle to an alsa "pulse code modulator", which handles
+ * playback. A basic outline of the code is thus:
+ *
+ *      1. open a pcm device
+ *      2. allocate, set and free the hardware params struct
+ *      3. allocate, set and free the software params struct
+ *      4. prepare pcm device
+ *      5. return pcm handle
+ *
+ * The params structs are freed whether or not configuring succeeds, so a
+ * device that keeps failing to open doesn't leak on every retry.
+ *
+ * @param device device name
+ * @param rate sample rate
+ * @param channels channel count
+ * @param handle gets the negotiated format, period and buffer size and pause
+ *        support
+ *
+ * @return a pointer to an alsa pcm handle
+ */
+static snd_pcm_t *alsa_open(const char *device, int rate, int channels,
+                            alsa_handle_t *handle)
+{
+    int error;
+    bool ok;
+    snd_pcm_t *pcm_handle;
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+
+    // open pcm and return NULL if it fails
+    if (snd_pcm_open(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        fprintf(stderr, "ALSA: Error opening PCM device %s\n", device);
+        return NULL;
+    }
+
+    // allocate, set and free the hardware params struct
+    if ((error = snd_pcm_hw_params_malloc(&hw_params)) < 0) {
+        fprintf(stderr, "ALSA: unable to allocate hardware param struct (%s)\n",
+                snd_strerror(error));
+        snd_pcm_close(pcm_handle);
+        return NULL;
+    }
+
+    ok = alsa_set_hw_params(pcm_handle, hw_params, rate, channels, handle);
+    snd_pcm_hw_params_free(hw_params);
+    if (!ok) {
+        fprintf(stderr, "ALSA: unable to configure %s\n", device);
+        snd_pcm_close(pcm_handle);
+        return NULL;
+    }
+
+    // allocate, set and free the software params struct
+    if ((error = snd_pcm_sw_params_malloc(&sw_params)) < 0) {
+        fprintf(stderr, "ALSA: unable to allocate software params (%s)\n",
+                snd_strerror(error));
+        snd_pcm_close(pcm_handle);
+        return NULL;
+    }
+
+    ok = alsa_set_sw_params(pcm_handle, sw_params);
+    snd_pcm_sw_params_free(sw_params);
+    if (!ok) {
+        snd_pcm_close(pcm_handle);
+        return NULL;
+    }
+
+    // prepare the audio device for playback
+    if ((error = snd_pcm_prepare(pcm_handle)) < 0) {
+        fprintf(stderr, "ALSA: unable to prepare audio device for playback (%s)\n",
+                snd_strerror(error));
+        snd_pcm_close(pcm_handle);
+        return NULL;
+    }
+
+    // return the handle
+    return pcm_handle;
+}
+
+/**
+ * Opens the pcm device named by the sink for the given format.
+ *
+ * @param sink audio_sink_t
+ * @param rate sample rate
+ * @param channels channel count
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int alsa_sink_open(audio_sink_t *sink, int rate, int channels)
+{
+    alsa_handle_t *handle;
+
+    if (channels > ALSA_MAX_CHANNELS) {
+        log_error("ALSA: %s: %d channels not supported\n", sink->name, channels);
+        return -1;
+    }
+
+    handle = malloc(sizeof(alsa_handle_t));
+    handle->pcm = alsa_open(sink->name, rate, channels, handle);
+    if (handle->pcm == NULL) {
+        free(handle);
+        return -1;
+    }
+
+    handle->frame_size = channels * sample_format_size(handle->format);
+    handle->history = mem_alloc(MEM_AUDIO, handle->buffer_size * handle->frame_size);
+    handle->history_pos = 0;
+    handle->history_fill = 0;
+    handle->replay = 0;
+
+    dither_init(&handle->dither, (uint32_t) (uintptr_t) handle);
+    log_info("ALSA: %s: %s %d channels %d Hz\n", sink->name,
+             sample_format_name(handle->format), channels, rate);
+
+    sink->format = sample_format_name(handle->format);
+    sink->period = handle->period_size;
+
+    sink->handle = handle;
+    return 0;
+}
+
+/**
+ * Remembers frames just handed to the device, the history always holds the
+ * last buffer_size frames.
+ *
+ * @param handle alsa_handle_t
+ * @param frames frames in the device format
+ * @param count number of frames
+ */
+static void alsa_history_append(alsa_handle_t *handle, const char *frames,
+                                snd_pcm_uframes_t count)
+{
+    snd_pcm_uframes_t n;
+
+    // only the tail fits
+    if (count > handle->buffer_size) {
+        frames += (count - handle->buffer_size) * handle->frame_size;
+        count = handle->buffer_size;
+    }
+
+    while (count > 0) {
+        n = MIN(count, handle->buffer_size - handle->history_pos);
+        memcpy(handle->history + handle->history_pos * handle->frame_size,
+               frames, n * handle->frame_size);
+
+        handle->history_pos = (handle->history_pos + n) % handle->buffer_size;
+        handle->history_fill = MIN(handle->history_fill + n, handle->buffer_size);
+        frames += n * handle->frame_size;
+        count -= n;
+    }
+}
+
+/**
+ * Writes frames to the device, recovering from underruns.
+ *
+ * @param sink audio_sink_t
+ * @param frames frames in the device format
+ * @param count number of frames
+ * @param remember append the frames to the history
+ *
+ * @return frames written, negative alsa error otherwise
+ */
+static snd_pcm_sframes_t alsa_write_frames(audio_sink_t *sink, const char *frames,
+                                           snd_pcm_uframes_t count, bool remember)
+{
+    alsa_handle_t *handle = (alsa_handle_t *) sink->handle;
+    snd_pcm_sframes_t written;
+    snd_pcm_uframes_t offset = 0;
+
+    while (offset < count) {
+        written = snd_pcm_writei(handle->pcm,
+                                 frames + offset * handle->frame_size,
+                                 count - offset);
+
+        if (written < 0) {
+            if (written == -EPIPE)
+                sink->xruns++;
+
+            // underrun or suspend, try to get the device going again
+            if ((written = snd_pcm_recover(handle->pcm, written, 1)) < 0) {
+                log_error("ALSA: %s: write failed (%s)\n",
+                          sink->name, snd_strerror(written));
+                return written;
+            }
+            continue;
+        }
+
+        if (remember)
+            alsa_history_append(handle, frames + offset * handle->frame_size,
+                                written);
+        offset += written;
+    }
+
+    return offset;
+}
+
+/**
+ * Writes interleaved frames to the pcm device a period at a time, converting
+ * each period to the device format first. Recovers from underruns.
+ *
+ * @param sink audio_sink_t
+ * @param samples interleaved float samples
+ * @param nframes number of frames
+ *
+ * @return number of frames written, negative alsa error otherwise
+ */
+static int alsa_sink_write(audio_sink_t *sink, const float *samples, int nframes)
+{
+    alsa_handle_t *handle = (alsa_handle_t *) sink->handle;
+    snd_pcm_sframes_t written;
+    int offset;
+    int period;
+
+    for (offset = 0; offset < nframes; offset += period) {
+        period = MIN(nframes - offset, PERIOD_SIZE);
+        convert_to_format(samples + offset * sink->channels, handle->buffer,
+                          period * sink->channels, handle->format,
+                          &handle->dither);
+
+        written = alsa_write_frames(sink, handle->buffer, period, true);
+        if (written < 0)
+            return written;
+    }
+
+    return offset;
+}
+
+/**
+ * Closes the pcm device.
+ *
+ * @param sink audio_sink_t
+ */
+static void alsa_sink_close(audio_sink_t *sink)
+{
+    alsa_handle_t *handle = (alsa_handle_t *) sink->handle;
+
+    snd_pcm_close(handle->pcm);
+    mem_free(MEM_AUDIO, handle->history, handle->buffer_size * handle->frame_size);
+    free(handle);
+    sink->handle = NULL;
+}
+
+/**
+ * Throws away everything the device has buffered and readies it for new
+ * audio, so a seek is heard within a period instead of a buffer.
+ *
+ * @param sink audio_sink_t
+ */
+static void alsa_sink_drop(audio_sink_t *sink)
+{
+    alsa_handle_t *handle = (alsa_handle_t *) sink->handle;
+    int error;
+
+    snd_pcm_drop(handle->pcm);
+
+    // the old position is gone for good, nothing to replay on resume
+    handle->history_fill = 0;
+    handle->replay = 0;
+
+    if ((error = snd_pcm_prepare(handle->pcm)) < 0)
+        log_error("ALSA: %s: unable to prepare after drop (%s)\n",
+                  sink->name, snd_strerror(error));
+}
+
+/**
+ * Writes the frames noted for replay from the history, they may wrap around
+ * it.
+ *
+ * @param sink audio_sink_t
+ */
+static void alsa_replay(audio_sink_t *sink)
+{
+    alsa_handle_t *handle = (alsa_handle_t *) sink->handle;
+    snd_pcm_uframes_t start, n;
+
+    start = (handle->history_pos + handle->buffer_size - handle->replay) %
+            handle->buffer_size;
+
+    while (handle->replay > 0) {
+        n = MIN(handle->replay, handle->buffer_size - start);
+        if (alsa_write_frames(sink, handle->history + start * handle->frame_size,
+                              n, false) < 0)
+            break;
+
+        handle->replay -= n;
+        start = (start + n) % handle->buffer_size;
+    }
+
+    handle->replay = 0;
+}
+
+/**
+ * Pauses or resumes the device. Devices that support it are paused in
+ * hardware, keeping their buffer. Otherwise the frames still queued in the
+ * device are noted, the device is dropped, and those frames are replayed
+ * from the history on resume, so nothing is lost or fetched again.
+ *
+ * @param sink audio_sink_t
+ * @param paused true to pause, false to resume
+ */
+static void alsa_sink_pause(audio_sink_t *sink, bool paused)
+{
+    alsa_handle_t *handle = (alsa_handle_t *) sink->handle;
+    snd_pcm_sframes_t delay = 0;
+    int error;
+
+    if (paused) {
+        if (handle->can_pause &&
+            snd_pcm_state(handle->pcm) == SND_PCM_STATE_RUNNING &&
+            snd_pcm_pause(handle->pcm, 1) == 0)
+            return;
+
+        if (snd_pcm_delay(handle->pcm, &delay) < 0 || delay < 0)
+            delay = 0;
+
+        handle->replay = MIN((snd_pcm_uframes_t) delay, handle->history_fill);
+        snd_pcm_drop(handle->pcm);
+        return;
+    }
+
+    if (snd_pcm_state(handle->pcm) == SND_PCM_STATE_PAUSED) {
+        if ((error = snd_pcm_pause(handle->pcm, 0)) < 0)
+            log_error("ALSA: %s: unable to resume (%s)\n",
+                      sink->name, snd_strerror(error));
+        return;
+    }
+
+    if ((error = snd_pcm_prepare(handle->pcm)) < 0) {
+        log_error("ALSA: %s: unable to prepare after pause (%s)\n",
+                  sink->name, snd_strerror(error));
+        return;
+    }
+
+    // replay what was queued when paused
+    alsa_replay(sink);
+}
+
+/**
+ * Converts frames between device formats through 32 bit samples. Only used
+ * for the little audio moved on a handover, so it doesn't dither.
+ *
+ * @param in samples in format from
+ * @param from format of in
+ * @param out samples in format to
+ * @param to format of out
+ * @param nsamples number of samples
+ */
+static void alsa_recode(const char *in, sample_format_t from, char *out,
+                        sample_format_t to, size_t nsamples)
+{
+    size_t i;
+    int32_t sample = 0;
+
+    for (i = 0; i < nsamples; i++) {
+        switch (from) {
+        case SAMPLE_S16:
+            sample = (int32_t) ((uint32_t) ((const int16_t *) in)[i] << 16);
+            break;
+        case SAMPLE_S24:
+            sample = (int32_t) ((uint32_t) ((const int32_t *) in)[i] << 8);
+            break;
+        case SAMPLE_S32:
+            sample = ((const int32_t *) in)[i];
+            break;
+        }
+
+        switch (to) {
+        case SAMPLE_S16:
+            ((int16_t *) out)[i] = sample >> 16;
+            break;
+        case SAMPLE_S24:
+            ((int32_t *) out)[i] = sample >> 8;
+            break;
+        case SAMPLE_S32:
+            ((int32_t *) out)[i] = sample;
+            break;
+        }
+    }
+}
+
+/**
+ * Hands playback over to another device. The frames the old device has
+ * queued but not played are taken from its history, converted to the new
+ * device's format and replayed there, then the old device is stopped, so
+ * the switch loses no more than what plays while this runs. A paused device
+ * leaves them for the new one to replay on resume.
+ *
+ * @param sink audio_sink_t playing
+ * @param next audio_sink_t opened for the new device, same rate and channels
+ */
+static void alsa_sink_handover(audio_sink_t *sink, audio_sink_t *next)
+{
+    alsa_handle_t *from = (alsa_handle_t *) sink->handle;
+    alsa_handle_t *to = (alsa_handle_t *) next->handle;
+    snd_pcm_state_t state = snd_pcm_state(from->pcm);
+    snd_pcm_sframes_t delay = 0;
+    snd_pcm_uframes_t count, start, n, left;
+
+    // paused in software the device was dropped and noted what to replay
+    if (state == SND_PCM_STATE_SETUP) {
+        count = from->replay;
+    } else {
+        if (snd_pcm_delay(from->pcm, &delay) < 0 || delay < 0)
+            delay = 0;
+        count = MIN((snd_pcm_uframes_t) delay, from->history_fill);
+    }
+
+    snd_pcm_drop(from->pcm);
+    count = MIN(count, to->buffer_size);
+
+    start = (from->history_pos + from->buffer_size - count) % from->buffer_size;
+    for (left = count; left > 0; left -= n) {
+        n = MIN(MIN(left, from->buffer_size - start), PERIOD_SIZE);
+        alsa_recode(from->history + start * from->frame_size, from->format,
+                    to->buffer, to->format, n * sink->channels);
+        alsa_history_append(to, to->buffer, n);
+        start = (start + n) % from->buffer_size;
+    }
+
+    to->replay = count;
+    if (state != SND_PCM_STATE_SETUP && state != SND_PCM_STATE_PAUSED)
+        alsa_replay(next);
+}
+
+static const audio_sink_ops_t alsa_sink_ops = {
+    .open   = &alsa_sink_open,
+    .write  = &alsa_sink_write,
+    .close  = &alsa_sink_close,
+    .drop   = &alsa_sink_drop,
+    .pause  = &alsa_sink_pause,
+    .handover = &alsa_sink_handover
+};
+
+/**
+ * Creates a sink playing to an alsa pcm device.
+ *
+ * @param device alsa device name, e.g. "default" or "hw:1,0"
+ *
+ * @return pointer to new audio_sink_t
+ */
+audio_sink_t *alsa_sink_create(const char *device)
+{
+    return audio_sink_create(&alsa_sink_ops, device);
+}
+
+/**
+ * Lists the pcm devices that can play, in the order alsa hints them.
+ *
+ * @param devices filled in
+ * @param max size of devices
+ *
+ * @return number of devices filled in
+ */
+int alsa_devices(alsa_device_t *devices, int max)
+{
+    void **hints, **hint;
+    char *name, *description, *direction, *newline;
+    int count = 0;
+
+    if (snd_device_name_hint(-1, "pcm", &hints) < 0)
+        return 0;
+
+    for (hint = hints; *hint && count < max; hint++) {
+        name = snd_device_name_get_hint(*hint, "NAME");
+        description = snd_device_name_get_hint(*hint, "DESC");
+        direction = snd_device_name_get_hint(*hint, "IOID");
+
+        // no direction means both
+        if (name && strcmp(name, "null") != 0 &&
+            (direction == NULL || strcmp(direction, "Output") == 0)) {
+            snprintf(devices[count].name, sizeof(devices[count].name),
+                     "%s", name);
+
+            // the first line names the card, the second the device
+            if (description && (newline = strchr(description, '\n')))
+                *newline = ' ';
+            snprintf(devices[count].description,
+                     sizeof(devices[count].description), "%s",
+                     description ? description : "");
+            count++;
+        }
+
+        free(name);
+        free(description);
+        free(direction);
+    }
+
+    snd_device_name_free_hint(hints);
+
+    return count;
+}
@@ -0,0 +1,17 @@
+#ifndef SPOTICLI_AUDIO_ALSA_H
+#define SPOTICLI_AUDIO_ALSA_H
+
+#include "audio.h"
+
+#define ALSA_DEFAULT_DEVICE "default"
+#define ALSA_MAX_DEVICES    64
+
+typedef struct alsa_device_s {
+    char name[AUDIO_NAME_SIZE];     // as taken by alsa_sink_create()
+    char description[128];
+} alsa_device_t;
+
+audio_sink_t *alsa_sink_create(const char *device);
+int alsa_devices(alsa_device_t *devices, int max);
+
+#endif // SPOTICLI_AUDIO_ALSA_H
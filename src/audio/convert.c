@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "convert.h"
+
+
+// gcc and clang vector extensions, lowered to sse2/neon where available
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+
+#define S16_SCALE   32768.0f
+#define S24_SCALE   8388608.0f
+#define S32_SCALE   2147483648.0f
+
+// largest floats that still convert into range
+#define S16_MAX     32767.0f
+#define S24_MAX     8388607.0f
+#define S32_MAX     2147483520.0f
+
+
+/**
+ * Seeds the dither generator, lanes must never be all zero.
+ *
+ * @param dither dither_t
+ * @param seed any value
+ */
+void dither_init(dither_t *dither, uint32_t seed)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        seed = seed * 1664525 + 1013904223;
+        dither->state[i] = seed ? seed : 0x9e3779b9;
+    }
+}
+
+/**
+ * Returns the bytes a single sample takes in the given format.
+ *
+ * @param format sample_format_t
+ *
+ * @return sample size in bytes
+ */
+size_t sample_format_size(sample_format_t format)
+{
+    return format == SAMPLE_S16 ? sizeof(int16_t) : sizeof(int32_t);
+}
+
+/**
+ * Returns a short printable name for the format.
+ *
+ * @param format sample_format_t
+ *
+ * @return "s16", "s24" or "s32"
+ */
+const char *sample_format_name(sample_format_t format)
+{
+    switch (format) {
+    case SAMPLE_S16:
+        return "s16";
+    case SAMPLE_S24:
+        return "s24";
+    default:
+        return "s32";
+    }
+}
+
+/**
+ * Picks lanes from a where mask is set and from b elsewhere.
+ *
+ * @param mask result of a vector comparison
+ * @param a lanes taken where mask is set
+ * @param b lanes taken where mask is clear
+ *
+ * @return blended vector
+ */
+static inline v4sf v4sf_select(v4si mask, v4sf a, v4sf b)
+{
+    return (v4sf) ((mask & (v4si) a) | (~mask & (v4si) b));
+}
+
+/**
+ * Advances all four xorshift lanes and returns uniform floats in [0, 1).
+ *
+ * @param state generator lanes
+ *
+ * @return four uniform floats
+ */
+static inline v4sf dither_next(v4su *state)
+{
+    v4su x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return __builtin_convertvector(x >> 8, v4sf) * (1.0f / 16777216.0f);
+}
+
+/**
+ * Converts samples to the full scale range of float, [-1, 1), applying a
+ * gain on the way for free.
+ *
+ * @param in 16 bit samples
+ * @param out float samples
+ * @param nsamples number of samples, all channels counted
+ * @param gain linear gain, 1 to convert only
+ */
+void convert_from_s16(const int16_t *in, float *out, int nsamples, float gain)
+{
+    float scale = gain / S16_SCALE;
+    int i;
+
+    for (i = 0; i < nsamples; i++)
+        out[i] = in[i] * scale;
+}
+
+/**
+ * Quantizes float samples to an integer device format with TPDF dither of
+ * one LSB of the target format. Four samples are handled per step, the tail
+ * goes through the same vector path with padding.
+ *
+ * @param in float samples
+ * @param out buffer of nsamples * sample_format_size(format) bytes
+ * @param nsamples number of samples, all channels counted
+ * @param format target sample_format_t
+ * @param dither per output dither state
+ */
+void convert_to_format(const float *in, void *out, int nsamples,
+                       sample_format_t format, dither_t *dither)
+{
+    int i, j, n;
+    float scale, max;
+    v4su state;
+    v4sf x, tpdf, hi, lo;
+    v4sf half = { 0.5f, 0.5f, 0.5f, 0.5f };
+    v4si q;
+    float tail[4];
+
+    switch (format) {
+    case SAMPLE_S16:
+        scale = S16_SCALE;
+        max = S16_MAX;
+        break;
+    case SAMPLE_S24:
+        scale = S24_SCALE;
+        max = S24_MAX;
+        break;
+    default:
+        scale = S32_SCALE;
+        max = S32_MAX;
+        break;
+    }
+
+    memcpy(&state, dither->state, sizeof(state));
+    hi = (v4sf) { max, max, max, max };
+    lo = -hi - 1.0f;
+
+    for (i = 0; i < nsamples; i += 4) {
+        n = nsamples - i < 4 ? nsamples - i : 4;
+
+        if (n == 4) {
+            memcpy(&x, in + i, sizeof(x));
+        } else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, in + i, n * sizeof(float));
+            memcpy(&x, tail, sizeof(x));
+        }
+
+        // triangular pdf, difference of two uniforms spanning +-1 LSB
+        tpdf = dither_next(&state) - dither_next(&state);
+        x = x * scale + tpdf;
+
+        x = v4sf_select(x > hi, hi, x);
+        x = v4sf_select(x < lo, lo, x);
+
+        // round half away from zero, the conversion truncates
+        q = __builtin_convertvector(x + v4sf_select(x < 0.0f, -half, half), v4si);
+
+        if (format == SAMPLE_S16) {
+            for (j = 0; j < n; j++)
+                ((int16_t *) out)[i + j] = (int16_t) q[j];
+        } else if (n == 4) {
+            memcpy((int32_t *) out + i, &q, sizeof(q));
+        } else {
+            for (j = 0; j < n; j++)
+                ((int32_t *) out)[i + j] = q[j];
+        }
+    }
+
+    memcpy(dither->state, &state, sizeof(state));
+}
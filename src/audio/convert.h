@@ -0,0 +1,30 @@
+#ifndef SPOTICLI_AUDIO_CONVERT_H
+#define SPOTICLI_AUDIO_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum sample_format_e {
+    SAMPLE_S16 = 0,             // signed 16 bit
+    SAMPLE_S24,                 // signed 24 bit in the low bits of 32
+    SAMPLE_S32                  // signed 32 bit
+} sample_format_t;
+
+/**
+ * Four lane xorshift generator feeding the TPDF dither, one per output so
+ * outputs never share state across threads.
+ */
+typedef struct dither_s {
+    uint32_t state[4];
+} dither_t;
+
+void dither_init(dither_t *dither, uint32_t seed);
+
+size_t sample_format_size(sample_format_t format);
+const char *sample_format_name(sample_format_t format);
+
+void convert_from_s16(const int16_t *in, float *out, int nsamples, float gain);
+void convert_to_format(const float *in, void *out, int nsamples,
+                       sample_format_t format, dither_t *dither);
+
+#endif // SPOTICLI_AUDIO_CONVERT_H
@@ -0,0 +1,328 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crossfade.h"
+#include "mem.h"
+
+
+// gcc and clang vector extensions, lowered to sse2/neon where available
+typedef float v4sf __attribute__((vector_size(16)));
+
+
+/**
+ * Parses a curve name: linear, equal-power or smooth.
+ *
+ * @param name curve name
+ * @param curve crossfade_curve_t to set
+ *
+ * @return false if the name is unknown
+ */
+bool crossfade_parse_curve(const char *name, crossfade_curve_t *curve)
+{
+    if (strcmp(name, "linear") == 0)
+        *curve = CROSSFADE_LINEAR;
+    else if (strcmp(name, "equal-power") == 0)
+        *curve = CROSSFADE_EQUAL_POWER;
+    else if (strcmp(name, "smooth") == 0)
+        *curve = CROSSFADE_SMOOTH;
+    else
+        return false;
+
+    return true;
+}
+
+/**
+ * Allocates the tail buffer for the longest window at the highest rate.
+ * A window of 0 disables crossfading and allocates nothing.
+ *
+ * @param cf crossfade_t
+ * @param window_ms overlap, at most CROSSFADE_MAX_MS
+ * @param curve fade curve
+ */
+void crossfade_init(crossfade_t *cf, int window_ms, crossfade_curve_t curve)
+{
+    memset(cf, 0, sizeof(crossfade_t));
+
+    cf->window_ms = window_ms < CROSSFADE_MAX_MS ? window_ms : CROSSFADE_MAX_MS;
+    cf->curve = curve;
+
+    if (cf->window_ms <= 0)
+        return;
+
+    cf->capacity = (size_t) cf->window_ms * CROSSFADE_MAX_RATE / 1000;
+    cf->tail = mem_calloc(MEM_AUDIO, cf->capacity * CROSSFADE_MAX_CHANNELS,
+                          sizeof(float));
+}
+
+/**
+ * Frees the tail buffer.
+ *
+ * @param cf crossfade_t
+ */
+void crossfade_release(crossfade_t *cf)
+{
+    mem_free(MEM_AUDIO, cf->tail,
+             cf->capacity * CROSSFADE_MAX_CHANNELS * sizeof(float));
+    memset(cf, 0, sizeof(crossfade_t));
+}
+
+/**
+ * Drops the held back tail, for a seek or a track change that cuts.
+ *
+ * @param cf crossfade_t
+ */
+void crossfade_reset(crossfade_t *cf)
+{
+    cf->tail_frames = 0;
+    cf->overlap = 0;
+    cf->mixed = 0;
+}
+
+/**
+ * Returns how many frames at the end of a track are held back.
+ *
+ * @param cf crossfade_t
+ * @param rate sample rate of the track
+ *
+ * @return frames, 0 when crossfading is disabled
+ */
+int crossfade_window(const crossfade_t *cf, int rate)
+{
+    size_t frames = (size_t) cf->window_ms * rate / 1000;
+
+    return (int) (frames < cf->capacity ? frames : cf->capacity);
+}
+
+/**
+ * Holds back frames of the outgoing track. Nothing is taken once the tail is
+ * full or when the format differs from what the tail already holds, the
+ * caller makes room with crossfade_take() or plays the frames as they are.
+ *
+ * @param cf crossfade_t
+ * @param samples interleaved samples
+ * @param nframes number of frames
+ * @param rate sample rate
+ * @param channels channel count
+ *
+ * @return frames held back
+ */
+int crossfade_capture(crossfade_t *cf, const float *samples, int nframes,
+                      int rate, int channels)
+{
+    int room;
+
+    if (cf->tail == NULL || channels > CROSSFADE_MAX_CHANNELS || cf->overlap > 0)
+        return 0;
+
+    if (cf->tail_frames == 0) {
+        cf->tail_rate = rate;
+        cf->tail_channels = channels;
+    } else if (cf->tail_rate != rate || cf->tail_channels != channels) {
+        return 0;
+    }
+
+    room = (int) cf->capacity - cf->tail_frames;
+    nframes = nframes < room ? nframes : room;
+
+    memcpy(cf->tail + (size_t) cf->tail_frames * channels, samples,
+           (size_t) nframes * channels * sizeof(float));
+    cf->tail_frames += nframes;
+
+    return nframes;
+}
+
+/**
+ * Removes the oldest held back frames, to play them without a fade.
+ *
+ * @param cf crossfade_t
+ * @param samples buffer for nframes frames in the tail's format
+ * @param nframes most frames to take
+ *
+ * @return frames taken
+ */
+int crossfade_take(crossfade_t *cf, float *samples, int nframes)
+{
+    int channels = cf->tail_channels;
+
+    if (cf->overlap > 0)
+        return 0;
+
+    nframes = nframes < cf->tail_frames ? nframes : cf->tail_frames;
+
+    memcpy(samples, cf->tail, (size_t) nframes * channels * sizeof(float));
+    memmove(cf->tail, cf->tail + (size_t) nframes * channels,
+            (size_t) (cf->tail_frames - nframes) * channels * sizeof(float));
+    cf->tail_frames -= nframes;
+
+    return nframes;
+}
+
+/**
+ * Returns the gains of both tracks at a point of the fade.
+ *
+ * @param curve crossfade_curve_t
+ * @param t progress of the fade, 0 to 1
+ * @param out gain of the outgoing track
+ * @param in gain of the incoming track
+ */
+static void crossfade_gains(crossfade_curve_t curve, double t, float *out, float *in)
+{
+    double s;
+
+    switch (curve) {
+    case CROSSFADE_EQUAL_POWER:
+        *out = cos(t * M_PI / 2);
+        *in = sin(t * M_PI / 2);
+        break;
+    case CROSSFADE_SMOOTH:
+        s = t * t * (3 - 2 * t);
+        *out = 1 - s;
+        *in = s;
+        break;
+    default:
+        *out = 1 - t;
+        *in = t;
+        break;
+    }
+}
+
+/**
+ * Reads tail frames in the incoming track's format into the block buffer,
+ * resampling linearly and mapping channels when the formats differ.
+ *
+ * @param cf crossfade_t
+ * @param nframes frames wanted, at most CROSSFADE_BLOCK
+ * @param rate sample rate of the incoming track
+ * @param channels channel count of the incoming track
+ *
+ * @return tail frames in the incoming format
+ */
+static const float *crossfade_fetch(crossfade_t *cf, int nframes, int rate,
+                                    int channels)
+{
+    double step = (double) cf->tail_rate / rate;
+    double pos;
+    float frac;
+    int i, c, src, next, ch;
+
+    if (rate == cf->tail_rate && channels == cf->tail_channels)
+        return cf->tail + (size_t) cf->mixed * channels;
+
+    for (i = 0; i < nframes; i++) {
+        pos = (cf->mixed + i) * step;
+        src = (int) pos;
+        frac = (float) (pos - src);
+        next = src + 1 < cf->tail_frames ? src + 1 : cf->tail_frames - 1;
+        src = src < cf->tail_frames ? src : cf->tail_frames - 1;
+
+        for (c = 0; c < channels; c++) {
+            ch = c < cf->tail_channels ? c : cf->tail_channels - 1;
+            cf->block[i * channels + c] =
+                cf->tail[src * cf->tail_channels + ch] * (1 - frac) +
+                cf->tail[next * cf->tail_channels + ch] * frac;
+        }
+    }
+
+    return cf->block;
+}
+
+/**
+ * Mixes two streams of the same format, ramping both gains linearly across
+ * the frames. Mono and stereo go four samples at a time.
+ *
+ * @param head incoming samples, mixed in place
+ * @param tail outgoing samples
+ * @param nframes number of frames
+ * @param channels channel count
+ * @param in0 incoming gain at the first frame
+ * @param in1 incoming gain after the last frame
+ * @param out0 outgoing gain at the first frame
+ * @param out1 outgoing gain after the last frame
+ */
+static void crossfade_blend(float *head, const float *tail, int nframes,
+                            int channels, float in0, float in1,
+                            float out0, float out1)
+{
+    float din = (in1 - in0) / nframes;
+    float dout = (out1 - out0) / nframes;
+    int nsamples = nframes * channels;
+    v4sf lanes, frame, gin, gout, h, t;
+    int i = 0;
+    float f;
+
+    if (channels <= 2) {
+        lanes = channels == 2 ? (v4sf) { 0, 0, 1, 1 } : (v4sf) { 0, 1, 2, 3 };
+
+        for (; i + 4 <= nsamples; i += 4) {
+            f = (float) (i / channels);
+            frame = lanes + f;
+            gin = in0 + frame * din;
+            gout = out0 + frame * dout;
+
+            memcpy(&h, head + i, sizeof(v4sf));
+            memcpy(&t, tail + i, sizeof(v4sf));
+            h = h * gin + t * gout;
+            memcpy(head + i, &h, sizeof(v4sf));
+        }
+    }
+
+    for (; i < nsamples; i++) {
+        f = (float) (i / channels);
+        head[i] = head[i] * (in0 + f * din) + tail[i] * (out0 + f * dout);
+    }
+}
+
+/**
+ * Fades the held back tail out over the start of the incoming track, in
+ * place. The fade lasts as long as the tail, at the incoming rate. Once
+ * the whole tail is mixed it is dropped.
+ *
+ * @param cf crossfade_t
+ * @param samples incoming interleaved samples, mixed in place
+ * @param nframes number of frames
+ * @param rate sample rate of the incoming track
+ * @param channels channel count of the incoming track
+ *
+ * @return frames mixed, 0 without a tail
+ */
+int crossfade_mix(crossfade_t *cf, float *samples, int nframes,
+                  int rate, int channels)
+{
+    const float *tail;
+    float in0, in1, out0, out1;
+    int n, done, count;
+
+    if (cf->tail_frames == 0 || channels > CROSSFADE_MAX_CHANNELS)
+        return 0;
+
+    if (cf->overlap == 0) {
+        cf->overlap = (int) ((double) cf->tail_frames * rate / cf->tail_rate);
+        cf->mixed = 0;
+        if (cf->overlap == 0) {
+            crossfade_reset(cf);
+            return 0;
+        }
+    }
+
+    n = cf->overlap - cf->mixed;
+    n = nframes < n ? nframes : n;
+
+    for (done = 0; done < n; done += count) {
+        count = n - done < CROSSFADE_BLOCK ? n - done : CROSSFADE_BLOCK;
+
+        tail = crossfade_fetch(cf, count, rate, channels);
+        crossfade_gains(cf->curve, (double) cf->mixed / cf->overlap, &out0, &in0);
+        crossfade_gains(cf->curve, (double) (cf->mixed + count) / cf->overlap,
+                        &out1, &in1);
+
+        crossfade_blend(samples + done * channels, tail, count, channels,
+                        in0, in1, out0, out1);
+        cf->mixed += count;
+    }
+
+    if (cf->mixed >= cf->overlap)
+        crossfade_reset(cf);
+
+    return n;
+}
@@ -0,0 +1,54 @@
+#ifndef SPOTICLI_AUDIO_CROSSFADE_H
+#define SPOTICLI_AUDIO_CROSSFADE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CROSSFADE_MAX_MS        12000   // longest configurable overlap
+#define CROSSFADE_MAX_RATE      48000   // tail buffer is sized for this rate
+#define CROSSFADE_MAX_CHANNELS  2
+#define CROSSFADE_BLOCK         1024    // frames resampled per pass
+
+typedef enum crossfade_curve_e {
+    CROSSFADE_LINEAR = 0,       // constant amplitude
+    CROSSFADE_EQUAL_POWER,      // constant power, no dip for unrelated tracks
+    CROSSFADE_SMOOTH            // s-curve, gentle at both ends
+} crossfade_curve_t;
+
+/**
+ * Overlaps the end of one track with the start of the next. libspotify
+ * decodes one track at a time, so the last window of the outgoing track is
+ * held back in the tail buffer as it is decoded and mixed into the incoming
+ * track once that starts. The incoming track sets the format, the tail is
+ * resampled and remapped to it while mixing. All memory is allocated by
+ * crossfade_init(), nothing is allocated while playing. Not thread safe.
+ */
+typedef struct crossfade_s {
+    int window_ms;              // 0 when disabled
+    crossfade_curve_t curve;
+
+    float *tail;                // held back end of the outgoing track
+    size_t capacity;            // frames the tail holds
+    int tail_rate;
+    int tail_channels;
+    int tail_frames;            // frames held back
+
+    int overlap;                // frames of the incoming track the fade lasts
+    int mixed;                  // frames of it mixed so far
+
+    float block[CROSSFADE_BLOCK * CROSSFADE_MAX_CHANNELS];
+} crossfade_t;
+
+bool crossfade_parse_curve(const char *name, crossfade_curve_t *curve);
+
+void crossfade_init(crossfade_t *cf, int window_ms, crossfade_curve_t curve);
+void crossfade_release(crossfade_t *cf);
+void crossfade_reset(crossfade_t *cf);
+int crossfade_window(const crossfade_t *cf, int rate);
+int crossfade_capture(crossfade_t *cf, const float *samples, int nframes,
+                      int rate, int channels);
+int crossfade_take(crossfade_t *cf, float *samples, int nframes);
+int crossfade_mix(crossfade_t *cf, float *samples, int nframes,
+                  int rate, int channels);
+
+#endif // SPOTICLI_AUDIO_CROSSFADE_H
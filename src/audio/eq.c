@@ -0,0 +1,436 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eq.h"
+#include "mem.h"
+#include "debug.h"
+
+
+// gcc and clang vector extensions, lowered to sse2/neon where available
+typedef float v4sf __attribute__((vector_size(16)));
+
+#define EQ_MAX_CHANNELS 2       // one lane pair per band
+#define EQ_DENORMAL     1e-15f  // filter state below this is flushed
+
+/**
+ * Ten band graphic presets on the iso octave centers.
+ */
+static const float eq_preset_freqs[EQ_MAX_BANDS] = {
+    31, 62, 125, 250, 500, 1000, 2000, 4000, 8000, 16000
+};
+
+static const struct {
+    const char *name;
+    float gains[EQ_MAX_BANDS];
+} eq_presets[] = {
+    { "flat",      {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 } },
+    { "bass",      {  6,  5,  4,  2,  0,  0,  0,  0,  0,  0 } },
+    { "treble",    {  0,  0,  0,  0,  0,  0,  2,  4,  5,  6 } },
+    { "vocal",     { -3, -2, -1,  0,  2,  3,  3,  2,  0, -1 } },
+    { "loudness",  {  5,  4,  2,  0, -1, -1,  0,  1,  3,  4 } },
+    { "rock",      {  4,  3,  2,  0, -1, -1,  0,  2,  3,  4 } },
+    { "classical", {  0,  0,  0,  0,  0,  0, -1, -2, -2, -3 } }
+};
+
+#define EQ_NPRESETS (sizeof(eq_presets) / sizeof(eq_presets[0]))
+
+
+/**
+ * Starts with a flat equalizer.
+ *
+ * @param eq eq_t
+ */
+void eq_init(eq_t *eq)
+{
+    memset(eq, 0, sizeof(eq_t));
+}
+
+/**
+ * Publishes new settings, sinks apply them from their next chunk on. Never
+ * blocks, but only one thread may call it at a time.
+ *
+ * @param eq eq_t
+ * @param params new settings
+ */
+void eq_set(eq_t *eq, const eq_params_t *params)
+{
+    __atomic_add_fetch(&eq->seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&eq->params, params, sizeof(eq_params_t));
+
+    __atomic_add_fetch(&eq->seq, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the shared settings if they changed since the sink last read
+ * them. A read racing eq_set() is thrown away and tried again with the
+ * next chunk.
+ *
+ * @param eq eq_t
+ * @param state eq_state_t of the reading sink
+ *
+ * @return true if state->params was updated
+ */
+static bool eq_read(eq_t *eq, eq_state_t *state)
+{
+    eq_params_t params;
+    unsigned int seq = __atomic_load_n(&eq->seq, __ATOMIC_ACQUIRE);
+
+    if (seq == state->seq || (seq & 1))
+        return false;
+
+    memcpy(&params, &eq->params, sizeof(eq_params_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&eq->seq, __ATOMIC_RELAXED) != seq)
+        return false;
+
+    state->params = params;
+    state->seq = seq;
+    return true;
+}
+
+/**
+ * Computes a band with the biquad formulas of the audio eq cookbook,
+ * normalized so a0 is 1.
+ *
+ * @param band eq_band_t
+ * @param rate sample rate
+ * @param b numerator
+ * @param a denominator without a0
+ *
+ * @return false if the band can't be represented at this rate
+ */
+static bool eq_band_coefs(const eq_band_t *band, int rate, double b[3], double a[2])
+{
+    double amp = pow(10.0, band->gain / 40.0);
+    double w0 = 2.0 * M_PI * band->freq / rate;
+    double alpha, cosw, sqrt_amp, a0;
+
+    if (band->freq <= 0 || band->freq >= rate / 2.0 || band->q <= 0)
+        return false;
+
+    cosw = cos(w0);
+    alpha = sin(w0) / (2.0 * band->q);
+    sqrt_amp = 2.0 * sqrt(amp) * alpha;
+
+    switch (band->type) {
+    case EQ_LOW_SHELF:
+        b[0] = amp * ((amp + 1) - (amp - 1) * cosw + sqrt_amp);
+        b[1] = 2 * amp * ((amp - 1) - (amp + 1) * cosw);
+        b[2] = amp * ((amp + 1) - (amp - 1) * cosw - sqrt_amp);
+        a0 = (amp + 1) + (amp - 1) * cosw + sqrt_amp;
+        a[0] = -2 * ((amp - 1) + (amp + 1) * cosw);
+        a[1] = (amp + 1) + (amp - 1) * cosw - sqrt_amp;
+        break;
+    case EQ_HIGH_SHELF:
+        b[0] = amp * ((amp + 1) + (amp - 1) * cosw + sqrt_amp);
+        b[1] = -2 * amp * ((amp - 1) + (amp + 1) * cosw);
+        b[2] = amp * ((amp + 1) + (amp - 1) * cosw - sqrt_amp);
+        a0 = (amp + 1) - (amp - 1) * cosw + sqrt_amp;
+        a[0] = 2 * ((amp - 1) - (amp + 1) * cosw);
+        a[1] = (amp + 1) - (amp - 1) * cosw - sqrt_amp;
+        break;
+    default:
+        b[0] = 1 + alpha * amp;
+        b[1] = -2 * cosw;
+        b[2] = 1 - alpha * amp;
+        a0 = 1 + alpha / amp;
+        a[0] = -2 * cosw;
+        a[1] = 1 - alpha / amp;
+        break;
+    }
+
+    b[0] /= a0;
+    b[1] /= a0;
+    b[2] /= a0;
+    a[0] /= a0;
+    a[1] /= a0;
+
+    return true;
+}
+
+/**
+ * Rebuilds the filters of a sink from its settings and rate. Flat bands are
+ * left out, band pairs share a stage. Filter state is kept when only the
+ * settings change so an update doesn't click.
+ *
+ * @param state eq_state_t
+ * @param rate sample rate
+ */
+static void eq_build(eq_state_t *state, int rate)
+{
+    double b[3], a[2];
+    int band, lane, stage, half, i;
+    int nactive = 0;
+
+    // identity everywhere an odd band count leaves a half stage unused
+    for (stage = 0; stage < EQ_STAGES; stage++) {
+        for (lane = 0; lane < 4; lane++) {
+            state->b[stage][0][lane] = 1;
+            state->b[stage][1][lane] = 0;
+            state->b[stage][2][lane] = 0;
+            state->a[stage][0][lane] = 0;
+            state->a[stage][1][lane] = 0;
+        }
+    }
+
+    for (band = 0; band < state->params.nbands && band < EQ_MAX_BANDS; band++) {
+        if (state->params.bands[band].gain == 0 ||
+            !eq_band_coefs(&state->params.bands[band], rate, b, a))
+            continue;
+
+        stage = nactive / 2;
+        half = (nactive % 2) * 2;
+
+        for (lane = half; lane < half + 2; lane++) {
+            for (i = 0; i < 3; i++)
+                state->b[stage][i][lane] = b[i];
+            for (i = 0; i < 2; i++)
+                state->a[stage][i][lane] = a[i];
+        }
+
+        nactive++;
+    }
+
+    if (rate != state->rate) {
+        memset(state->z, 0, sizeof(state->z));
+        memset(state->carry, 0, sizeof(state->carry));
+        state->rate = rate;
+    }
+
+    state->nstages = (nactive + 1) / 2;
+    state->preamp = pow(10.0, state->params.preamp / 20.0);
+}
+
+/**
+ * Runs interleaved frames through one stage in place. The second band of
+ * the stage filters what the first band produced a frame earlier, so both
+ * bands of both channels go through one vector at the cost of a frame of
+ * delay per stage.
+ *
+ * @param state eq_state_t
+ * @param stage stage index
+ * @param samples interleaved samples, filtered in place
+ * @param nframes number of frames
+ * @param channels 1 or 2
+ */
+static void eq_stage(eq_state_t *state, int stage, float *samples, int nframes,
+                     int channels)
+{
+    v4sf b0, b1, b2, a1, a2, z0, z1, x, y;
+    float carry_l = state->carry[stage][0];
+    float carry_r = state->carry[stage][1];
+    int i;
+
+    memcpy(&b0, state->b[stage][0], sizeof(v4sf));
+    memcpy(&b1, state->b[stage][1], sizeof(v4sf));
+    memcpy(&b2, state->b[stage][2], sizeof(v4sf));
+    memcpy(&a1, state->a[stage][0], sizeof(v4sf));
+    memcpy(&a2, state->a[stage][1], sizeof(v4sf));
+    memcpy(&z0, state->z[stage][0], sizeof(v4sf));
+    memcpy(&z1, state->z[stage][1], sizeof(v4sf));
+
+    if (channels == 2) {
+        for (i = 0; i < nframes; i++, samples += 2) {
+            x = (v4sf) { samples[0], samples[1], carry_l, carry_r };
+
+            // transposed direct form II
+            y = b0 * x + z0;
+            z0 = b1 * x - a1 * y + z1;
+            z1 = b2 * x - a2 * y;
+
+            carry_l = y[0];
+            carry_r = y[1];
+            samples[0] = y[2];
+            samples[1] = y[3];
+        }
+    } else {
+        for (i = 0; i < nframes; i++, samples++) {
+            x = (v4sf) { samples[0], 0, carry_l, 0 };
+
+            y = b0 * x + z0;
+            z0 = b1 * x - a1 * y + z1;
+            z1 = b2 * x - a2 * y;
+
+            carry_l = y[0];
+            samples[0] = y[2];
+        }
+    }
+
+    memcpy(state->z[stage][0], &z0, sizeof(v4sf));
+    memcpy(state->z[stage][1], &z1, sizeof(v4sf));
+    state->carry[stage][0] = carry_l;
+    state->carry[stage][1] = carry_r;
+
+    // a silent tail would otherwise decay into slow denormals
+    for (i = 0; i < 4; i++) {
+        if (fabsf(state->z[stage][0][i]) < EQ_DENORMAL)
+            state->z[stage][0][i] = 0;
+        if (fabsf(state->z[stage][1][i]) < EQ_DENORMAL)
+            state->z[stage][1][i] = 0;
+    }
+}
+
+/**
+ * Parses a preset name, or a comma separated list of bands written as
+ * [ls|hs]FREQ:GAIN[:Q], e.g. "ls80:4,3000:-2:0.7". Shelves are marked ls
+ * and hs, other bands are peaks. The preamp is set to leave headroom for
+ * the largest boost.
+ *
+ * @param spec preset or band list
+ * @param params eq_params_t to fill in
+ *
+ * @return false if spec is invalid
+ */
+bool eq_parse(const char *spec, eq_params_t *params)
+{
+    eq_band_t *band;
+    const char *p = spec;
+    char *end;
+    float boost = 0;
+    size_t i;
+    int j;
+
+    memset(params, 0, sizeof(eq_params_t));
+
+    for (i = 0; i < EQ_NPRESETS; i++) {
+        if (strcmp(spec, eq_presets[i].name) != 0)
+            continue;
+
+        params->nbands = EQ_MAX_BANDS;
+        for (j = 0; j < EQ_MAX_BANDS; j++) {
+            params->bands[j].type = EQ_PEAK;
+            params->bands[j].freq = eq_preset_freqs[j];
+            params->bands[j].gain = eq_presets[i].gains[j];
+            params->bands[j].q = EQ_DEFAULT_Q;
+            boost = eq_presets[i].gains[j] > boost ? eq_presets[i].gains[j] : boost;
+        }
+
+        params->preamp = -boost;
+        return true;
+    }
+
+    while (*p) {
+        if (params->nbands == EQ_MAX_BANDS)
+            return false;
+
+        band = &params->bands[params->nbands++];
+        band->type = EQ_PEAK;
+        band->q = EQ_DEFAULT_Q;
+
+        if (strncmp(p, "ls", 2) == 0) {
+            band->type = EQ_LOW_SHELF;
+            band->q = EQ_SHELF_Q;
+            p += 2;
+        } else if (strncmp(p, "hs", 2) == 0) {
+            band->type = EQ_HIGH_SHELF;
+            band->q = EQ_SHELF_Q;
+            p += 2;
+        }
+
+        band->freq = strtof(p, &end);
+        if (end == p || *end != ':' || band->freq <= 0)
+            return false;
+
+        p = end + 1;
+        band->gain = strtof(p, &end);
+        if (end == p)
+            return false;
+
+        p = end;
+        if (*p == ':') {
+            band->q = strtof(p + 1, &end);
+            if (end == p + 1 || band->q <= 0)
+                return false;
+            p = end;
+        }
+
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return false;
+
+        boost = band->gain > boost ? band->gain : boost;
+    }
+
+    params->preamp = -boost;
+    return params->nbands > 0;
+}
+
+/**
+ * Prepares the filters of a sink, they start flat.
+ *
+ * @param state eq_state_t
+ */
+void eq_state_init(eq_state_t *state)
+{
+    memset(state, 0, sizeof(eq_state_t));
+
+    // odd, never equal to a published sequence
+    state->seq = 1;
+    state->preamp = 1;
+}
+
+/**
+ * Frees the buffer of a sink's filters.
+ *
+ * @param state eq_state_t
+ */
+void eq_state_release(eq_state_t *state)
+{
+    mem_free(MEM_AUDIO, state->buffer, state->capacity * sizeof(float));
+    state->buffer = NULL;
+    state->capacity = 0;
+}
+
+/**
+ * Equalizes a chunk for one sink, picking up new settings first. Chunks are
+ * shared between sinks, so the result goes to a buffer of the sink's own.
+ * A flat equalizer costs nothing, the chunk is returned as is. Only mono
+ * and stereo are equalized.
+ *
+ * @param eq shared settings
+ * @param state eq_state_t of the sink
+ * @param samples interleaved samples
+ * @param nframes number of frames
+ * @param rate sample rate
+ * @param channels channel count
+ *
+ * @return samples to play, valid until the next call
+ */
+const float *eq_process(eq_t *eq, eq_state_t *state, const float *samples,
+                        int nframes, int rate, int channels)
+{
+    int nsamples = nframes * channels;
+    int stage, i;
+
+    if (eq_read(eq, state) || rate != state->rate)
+        eq_build(state, rate);
+
+    if (state->nstages == 0 && state->preamp == 1)
+        return samples;
+
+    if (channels > EQ_MAX_CHANNELS) {
+        if (!state->warned)
+            log_warning("equalizer skipped, %d channels\n", channels);
+        state->warned = true;
+        return samples;
+    }
+
+    if (nsamples > state->capacity) {
+        mem_free(MEM_AUDIO, state->buffer, state->capacity * sizeof(float));
+        state->buffer = mem_alloc(MEM_AUDIO, nsamples * sizeof(float));
+        state->capacity = nsamples;
+    }
+
+    for (i = 0; i < nsamples; i++)
+        state->buffer[i] = samples[i] * state->preamp;
+
+    for (stage = 0; stage < state->nstages; stage++)
+        eq_stage(state, stage, state->buffer, nframes, channels);
+
+    return state->buffer;
+}
@@ -0,0 +1,71 @@
+#ifndef SPOTICLI_AUDIO_EQ_H
+#define SPOTICLI_AUDIO_EQ_H
+
+#include <stdbool.h>
+
+#define EQ_MAX_BANDS    10
+#define EQ_STAGES       ((EQ_MAX_BANDS + 1) / 2)    // two bands per vector
+#define EQ_DEFAULT_Q    1.41f                       // one octave wide
+#define EQ_SHELF_Q      0.707f                      // shelf without overshoot
+
+typedef enum eq_band_type_e {
+    EQ_PEAK = 0,                // bell around freq
+    EQ_LOW_SHELF,               // everything below freq
+    EQ_HIGH_SHELF               // everything above freq
+} eq_band_type_t;
+
+typedef struct eq_band_s {
+    eq_band_type_t type;
+    float freq;                 // Hz
+    float gain;                 // dB, 0 leaves the band out
+    float q;
+} eq_band_t;
+
+typedef struct eq_params_s {
+    int nbands;
+    eq_band_t bands[EQ_MAX_BANDS];
+    float preamp;               // dB applied before the bands
+} eq_params_t;
+
+/**
+ * Equalizer settings shared by all sinks. A single control thread publishes
+ * new settings with eq_set() under a sequence counter, sinks pick them up
+ * between chunks without ever taking a lock or blocking the writer.
+ */
+typedef struct eq_s {
+    unsigned int seq;           // odd while eq_set() is writing
+    eq_params_t params;
+} eq_t;
+
+/**
+ * Filters of one sink. Coefficients are derived from the shared settings
+ * for the sink's own sample rate whenever either changes.
+ */
+typedef struct eq_state_s {
+    unsigned int seq;           // settings the filters were built from
+    eq_params_t params;
+    int rate;
+    int nstages;                // 0 when every band is flat
+    float preamp;               // linear
+    bool warned;                // logged that the format is unsupported
+
+    // per stage vector, lanes 0-1 one band and lanes 2-3 the next
+    float b[EQ_STAGES][3][4];
+    float a[EQ_STAGES][2][4];
+    float z[EQ_STAGES][2][4];
+    float carry[EQ_STAGES][2];  // first band's last output
+
+    float *buffer;              // filtered copy of the chunk
+    int capacity;               // samples buffer holds
+} eq_state_t;
+
+void eq_init(eq_t *eq);
+void eq_set(eq_t *eq, const eq_params_t *params);
+bool eq_parse(const char *spec, eq_params_t *params);
+
+void eq_state_init(eq_state_t *state);
+void eq_state_release(eq_state_t *state);
+const float *eq_process(eq_t *eq, eq_state_t *state, const float *samples,
+                        int nframes, int rate, int channels);
+
+#endif // SPOTICLI_AUDIO_EQ_H
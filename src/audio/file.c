@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "file.h"
+#include "convert.h"
+#include "debug.h"
+
+
+#define FILE_BLOCK_SIZE 4096    // samples converted per fwrite
+
+/**
+ * State behind audio_sink_t.handle for file outputs.
+ */
+typedef struct file_handle_s {
+    FILE *file;
+    dither_t dither;
+    int16_t buffer[FILE_BLOCK_SIZE];
+} file_handle_t;
+
+/**
+ * Opens the recording file for appending. The file holds raw interleaved
+ * native endian 16 bit pcm, dithered down from the float stream. A format
+ * change is only noted in the log.
+ *
+ * @param sink audio_sink_t
+ * @param rate sample rate
+ * @param channels channel count
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int file_sink_open(audio_sink_t *sink, int rate, int channels)
+{
+    file_handle_t *handle;
+    FILE *file = fopen(sink->name, "ab");
+
+    if (file == NULL) {
+        log_error("%s: unable to open recording file\n", sink->name);
+        return -1;
+    }
+
+    log_info("%s: recording s16 %d channels %d Hz\n", sink->name, channels, rate);
+
+    handle = malloc(sizeof(file_handle_t));
+    handle->file = file;
+    dither_init(&handle->dither, (uint32_t) (uintptr_t) handle);
+
+    sink->format = sample_format_name(SAMPLE_S16);
+    sink->handle = handle;
+    return 0;
+}
+
+/**
+ * Appends interleaved frames to the recording file.
+ *
+ * @param sink audio_sink_t
+ * @param samples interleaved float samples
+ * @param nframes number of frames
+ *
+ * @return number of frames written
+ */
+static int file_sink_write(audio_sink_t *sink, const float *samples, int nframes)
+{
+    file_handle_t *handle = (file_handle_t *) sink->handle;
+    int total = nframes * sink->channels;
+    int offset;
+    int count;
+
+    for (offset = 0; offset < total; offset += count) {
+        count = MIN(total - offset, FILE_BLOCK_SIZE);
+
+        convert_to_format(samples + offset, handle->buffer, count,
+                          SAMPLE_S16, &handle->dither);
+
+        if (fwrite(handle->buffer, sizeof(int16_t), count, handle->file) != count)
+            return offset / sink->channels;
+    }
+
+    return nframes;
+}
+
+/**
+ * Closes the recording file.
+ *
+ * @param sink audio_sink_t
+ */
+static void file_sink_close(audio_sink_t *sink)
+{
+    file_handle_t *handle = (file_handle_t *) sink->handle;
+
+    fclose(handle->file);
+    free(handle);
+    sink->handle = NULL;
+}
+
+static const audio_sink_ops_t file_sink_ops = {
+    .open   = &file_sink_open,
+    .write  = &file_sink_write,
+    .close  = &file_sink_close
+};
+
+/**
+ * Creates a sink recording the stream to a file.
+ *
+ * @param path file to append to
+ *
+ * @return pointer to new audio_sink_t
+ */
+audio_sink_t *file_sink_create(const char *path)
+{
+    return audio_sink_create(&file_sink_ops, path);
+}
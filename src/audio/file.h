@@ -0,0 +1,8 @@
+#ifndef SPOTICLI_AUDIO_FILE_H
+#define SPOTICLI_AUDIO_FILE_H
+
+#include "audio.h"
+
+audio_sink_t *file_sink_create(const char *path);
+
+#endif // SPOTICLI_AUDIO_FILE_H
@@ -0,0 +1,382 @@
+#include <math.h>
+#include <string.h>
+
+#include "loudness.h"
+
+
+// gcc and clang vector extensions, lowered to sse2/neon where available
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+#define LOUDNESS_TP_BLOCK   256     // frames oversampled per pass
+#define LOUDNESS_TP_RATE    96000   // rates from here on are peak read as is
+#define LOUDNESS_DENORMAL   1e-15f  // filter state below this is flushed
+
+/**
+ * Polyphase 4x interpolator of ITU-R BS.1770-4 annex 2, one lane per phase.
+ */
+static const float tp_coefs[LOUDNESS_TP_TAPS][4] = {
+    {  0.0017089843750f, -0.0291748046875f, -0.0189208984375f, -0.0083007812500f },
+    {  0.0109863281250f,  0.0292968750000f,  0.0330810546875f,  0.0148925781250f },
+    { -0.0196533203125f, -0.0517578125000f, -0.0582275390625f, -0.0266113281250f },
+    {  0.0332031250000f,  0.0891113281250f,  0.1015625000000f,  0.0476074218750f },
+    { -0.0594482421875f, -0.1665039062500f, -0.2003173828125f, -0.1022949218750f },
+    {  0.1373291015625f,  0.4650878906250f,  0.7797851562500f,  0.9721679687500f },
+    {  0.9721679687500f,  0.7797851562500f,  0.4650878906250f,  0.1373291015625f },
+    { -0.1022949218750f, -0.2003173828125f, -0.1665039062500f, -0.0594482421875f },
+    {  0.0476074218750f,  0.1015625000000f,  0.0891113281250f,  0.0332031250000f },
+    { -0.0266113281250f, -0.0582275390625f, -0.0517578125000f, -0.0196533203125f },
+    {  0.0148925781250f,  0.0330810546875f,  0.0292968750000f,  0.0109863281250f },
+    { -0.0083007812500f, -0.0189208984375f, -0.0291748046875f,  0.0017089843750f }
+};
+
+
+/**
+ * Picks lanes from a where mask is set and from b elsewhere.
+ *
+ * @param mask result of a vector comparison
+ * @param a lanes taken where mask is set
+ * @param b lanes taken where mask is clear
+ *
+ * @return blended vector
+ */
+static inline v4sf v4sf_select(v4si mask, v4sf a, v4sf b)
+{
+    return (v4sf) ((mask & (v4si) a) | (~mask & (v4si) b));
+}
+
+/**
+ * Computes the k-weighting filters for a sample rate, the same way
+ * libebur128 derives them from the 48 kHz reference. Lanes 0 and 1 hold the
+ * high shelf, lanes 2 and 3 the high pass. The histogram is kept, so a
+ * format change within a track doesn't lose what was measured.
+ *
+ * @param ln loudness_t
+ * @param rate sample rate
+ * @param channels channel count
+ */
+static void loudness_setup(loudness_t *ln, int rate, int channels)
+{
+    double f0, gain, q, k, vh, vb, a0;
+    double shelf_b[3], shelf_a[2], pass_a[2];
+    double pass_b[3] = { 1.0, -2.0, 1.0 };
+    int i;
+
+    // stage 1, head related high shelf
+    f0 = 1681.974450955533;
+    gain = 3.999843853973347;
+    q = 0.7071752369554196;
+
+    k = tan(M_PI * f0 / rate);
+    vh = pow(10.0, gain / 20.0);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+
+    shelf_b[0] = (vh + vb * k / q + k * k) / a0;
+    shelf_b[1] = 2.0 * (k * k - vh) / a0;
+    shelf_b[2] = (vh - vb * k / q + k * k) / a0;
+    shelf_a[0] = 2.0 * (k * k - 1.0) / a0;
+    shelf_a[1] = (1.0 - k / q + k * k) / a0;
+
+    // stage 2, revised low frequency b-curve high pass
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+
+    k = tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+
+    pass_a[0] = 2.0 * (k * k - 1.0) / a0;
+    pass_a[1] = (1.0 - k / q + k * k) / a0;
+
+    for (i = 0; i < 4; i++) {
+        ln->b[0][i] = i < 2 ? shelf_b[0] : pass_b[0];
+        ln->b[1][i] = i < 2 ? shelf_b[1] : pass_b[1];
+        ln->b[2][i] = i < 2 ? shelf_b[2] : pass_b[2];
+        ln->a[0][i] = i < 2 ? shelf_a[0] : pass_a[0];
+        ln->a[1][i] = i < 2 ? shelf_a[1] : pass_a[1];
+    }
+
+    memset(ln->z, 0, sizeof(ln->z));
+    memset(ln->y, 0, sizeof(ln->y));
+    memset(ln->tp_history, 0, sizeof(ln->tp_history));
+
+    ln->rate = rate;
+    ln->channels = channels;
+    ln->block_frames = rate / 10;
+    ln->block_fill = 0;
+    ln->block_energy = 0;
+    ln->nsub = 0;
+}
+
+/**
+ * Runs frames through the k-weighting and returns their energy, summed over
+ * channels. Both stages share one vector: the high pass lanes filter what
+ * the shelf lanes produced one frame earlier, which only delays the weighted
+ * signal by a frame.
+ *
+ * @param ln loudness_t
+ * @param samples interleaved samples
+ * @param nframes number of frames
+ *
+ * @return sum of the squared weighted samples
+ */
+static float loudness_filter(loudness_t *ln, const float *samples, int nframes)
+{
+    v4sf b0, b1, b2, a1, a2, z0, z1, x, y;
+    v4sf energy = { 0, 0, 0, 0 };
+    int stride = ln->channels;
+    int right = ln->channels > 1 ? 1 : 0;
+    float shelf_l = ln->y[0];
+    float shelf_r = ln->y[1];
+    int i;
+
+    memcpy(&b0, ln->b[0], sizeof(v4sf));
+    memcpy(&b1, ln->b[1], sizeof(v4sf));
+    memcpy(&b2, ln->b[2], sizeof(v4sf));
+    memcpy(&a1, ln->a[0], sizeof(v4sf));
+    memcpy(&a2, ln->a[1], sizeof(v4sf));
+    memcpy(&z0, ln->z[0], sizeof(v4sf));
+    memcpy(&z1, ln->z[1], sizeof(v4sf));
+
+    for (i = 0; i < nframes; i++) {
+        x = (v4sf) { samples[0], right ? samples[1] : 0.0f, shelf_l, shelf_r };
+        samples += stride;
+
+        // transposed direct form II
+        y = b0 * x + z0;
+        z0 = b1 * x - a1 * y + z1;
+        z1 = b2 * x - a2 * y;
+
+        shelf_l = y[0];
+        shelf_r = y[1];
+        energy += y * y;
+    }
+
+    memcpy(ln->z[0], &z0, sizeof(v4sf));
+    memcpy(ln->z[1], &z1, sizeof(v4sf));
+    ln->y[0] = shelf_l;
+    ln->y[1] = shelf_r;
+
+    return energy[2] + energy[3];
+}
+
+/**
+ * Closes the filling 100 ms sub-block and, once four exist, counts the
+ * 400 ms gating block ending with it.
+ *
+ * @param ln loudness_t
+ */
+static void loudness_block(loudness_t *ln)
+{
+    double energy, lufs;
+    int bin, i, j;
+
+    ln->sub[ln->nsub % 4] = ln->block_energy;
+    ln->nsub++;
+
+    ln->block_fill = 0;
+    ln->block_energy = 0;
+
+    // a silent tail would otherwise decay into slow denormals
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 4; j++) {
+            if (fabsf(ln->z[i][j]) < LOUDNESS_DENORMAL)
+                ln->z[i][j] = 0;
+        }
+        if (fabsf(ln->y[i]) < LOUDNESS_DENORMAL)
+            ln->y[i] = 0;
+    }
+
+    if (ln->nsub < 4)
+        return;
+
+    energy = (ln->sub[0] + ln->sub[1] + ln->sub[2] + ln->sub[3]) /
+             (4.0 * ln->block_frames);
+    if (energy <= 0)
+        return;
+
+    lufs = -0.691 + 10.0 * log10(energy);
+    if (lufs < LOUDNESS_FLOOR)
+        return;
+
+    bin = (int) ((lufs - LOUDNESS_FLOOR) / LOUDNESS_BIN_LU);
+    ln->histogram[bin < LOUDNESS_BINS ? bin : LOUDNESS_BINS - 1]++;
+}
+
+/**
+ * Raises the true peak with the given frames, four interpolated samples are
+ * computed per input sample, one per vector lane.
+ *
+ * @param ln loudness_t
+ * @param samples interleaved samples
+ * @param nframes number of frames
+ */
+static void loudness_true_peak(loudness_t *ln, const float *samples, int nframes)
+{
+    float buffer[LOUDNESS_TP_TAPS - 1 + LOUDNESS_TP_BLOCK];
+    const int history = LOUDNESS_TP_TAPS - 1;
+    v4sf coefs[LOUDNESS_TP_TAPS];
+    v4sf peak = { 0, 0, 0, 0 };
+    v4sf acc;
+    v4si abs_mask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+    int channels = ln->channels < 2 ? ln->channels : 2;
+    int ch, offset, n, i;
+
+    memcpy(coefs, tp_coefs, sizeof(coefs));
+
+    for (ch = 0; ch < channels; ch++) {
+        for (offset = 0; offset < nframes; offset += n) {
+            n = nframes - offset < LOUDNESS_TP_BLOCK ?
+                nframes - offset : LOUDNESS_TP_BLOCK;
+
+            memcpy(buffer, ln->tp_history[ch], history * sizeof(float));
+            for (i = 0; i < n; i++)
+                buffer[history + i] = samples[(offset + i) * ln->channels + ch];
+
+            if (ln->rate >= LOUDNESS_TP_RATE) {
+                // enough bandwidth, the samples themselves are the peak
+                for (i = 0; i < n; i++) {
+                    acc = (v4sf) { buffer[history + i] };
+                    acc = (v4sf) ((v4si) acc & abs_mask);
+                    peak = v4sf_select(acc > peak, acc, peak);
+                }
+            } else {
+                for (i = 0; i < n; i++) {
+                    const float *x = buffer + history + i;
+
+                    // spelled out, so the taps stay in registers at -O2
+                    acc = coefs[0] * x[0] + coefs[1] * x[-1] +
+                          coefs[2] * x[-2] + coefs[3] * x[-3];
+                    acc += coefs[4] * x[-4] + coefs[5] * x[-5] +
+                           coefs[6] * x[-6] + coefs[7] * x[-7];
+                    acc += coefs[8] * x[-8] + coefs[9] * x[-9] +
+                           coefs[10] * x[-10] + coefs[11] * x[-11];
+
+                    acc = (v4sf) ((v4si) acc & abs_mask);
+                    peak = v4sf_select(acc > peak, acc, peak);
+                }
+            }
+
+            memcpy(ln->tp_history[ch], buffer + n, history * sizeof(float));
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (peak[i] > ln->peak)
+            ln->peak = peak[i];
+    }
+}
+
+/**
+ * Forgets everything measured, for the start of a new track.
+ *
+ * @param ln loudness_t
+ */
+void loudness_reset(loudness_t *ln)
+{
+    memset(ln, 0, sizeof(loudness_t));
+}
+
+/**
+ * Measures a chunk of audio. Cheap enough to run on every chunk delivered.
+ *
+ * @param ln loudness_t
+ * @param samples interleaved full scale float samples
+ * @param nframes number of frames
+ * @param rate sample rate
+ * @param channels channel count
+ */
+void loudness_analyze(loudness_t *ln, const float *samples, int nframes,
+                      int rate, int channels)
+{
+    int n;
+
+    if (rate != ln->rate || channels != ln->channels)
+        loudness_setup(ln, rate, channels);
+
+    loudness_true_peak(ln, samples, nframes);
+    ln->frames += nframes;
+
+    while (nframes > 0) {
+        n = ln->block_frames - ln->block_fill;
+        n = nframes < n ? nframes : n;
+
+        ln->block_energy += loudness_filter(ln, samples, n);
+        ln->block_fill += n;
+
+        samples += n * channels;
+        nframes -= n;
+
+        if (ln->block_fill == ln->block_frames)
+            loudness_block(ln);
+    }
+}
+
+/**
+ * Reads the integrated loudness, with the absolute gate at LOUDNESS_FLOOR
+ * and the relative gate 10 LU below the absolutely gated loudness, and the
+ * true peak of everything measured so far.
+ *
+ * @param ln loudness_t
+ * @param result loudness_result_t to fill in
+ */
+void loudness_result(const loudness_t *ln, loudness_result_t *result)
+{
+    double energy[LOUDNESS_BINS];
+    double sum = 0, relative;
+    uint64_t count = 0;
+    int bin, first;
+
+    for (bin = 0; bin < LOUDNESS_BINS; bin++) {
+        energy[bin] = pow(10.0, (LOUDNESS_FLOOR + (bin + 0.5) * LOUDNESS_BIN_LU +
+                                 0.691) / 10.0);
+        sum += energy[bin] * ln->histogram[bin];
+        count += ln->histogram[bin];
+    }
+
+    result->integrated = LOUDNESS_FLOOR;
+    result->true_peak = ln->peak > 0 ? 20.0 * log10(ln->peak) : LOUDNESS_FLOOR;
+    result->seconds = ln->rate ? (double) ln->frames / ln->rate : 0;
+
+    if (count == 0)
+        return;
+
+    relative = -0.691 + 10.0 * log10(sum / count) - 10.0;
+    first = relative > LOUDNESS_FLOOR ?
+            (int) ((relative - LOUDNESS_FLOOR) / LOUDNESS_BIN_LU) : 0;
+
+    sum = 0;
+    count = 0;
+    for (bin = first; bin < LOUDNESS_BINS; bin++) {
+        sum += energy[bin] * ln->histogram[bin];
+        count += ln->histogram[bin];
+    }
+
+    if (count > 0)
+        result->integrated = -0.691 + 10.0 * log10(sum / count);
+}
+
+/**
+ * Returns the gain bringing a measured track to the target loudness, held
+ * back so the true peak stays below LOUDNESS_PEAK_DBTP. Measurements of too
+ * little audio give unity gain.
+ *
+ * @param result measured loudness
+ * @param target target loudness, LUFS
+ *
+ * @return linear gain
+ */
+float loudness_gain(const loudness_result_t *result, double target)
+{
+    double db;
+
+    if (result->seconds < LOUDNESS_MIN_SECONDS ||
+        result->integrated <= LOUDNESS_FLOOR)
+        return 1.0f;
+
+    db = target - result->integrated;
+    if (db > LOUDNESS_PEAK_DBTP - result->true_peak)
+        db = LOUDNESS_PEAK_DBTP - result->true_peak;
+
+    return (float) pow(10.0, db / 20.0);
+}
@@ -0,0 +1,59 @@
+#ifndef SPOTICLI_AUDIO_LOUDNESS_H
+#define SPOTICLI_AUDIO_LOUDNESS_H
+
+#include <stdint.h>
+
+#define LOUDNESS_FLOOR      -70.0   // absolute gate, LUFS
+#define LOUDNESS_CEILING    5.0     // loudest block tracked, LUFS
+#define LOUDNESS_BIN_LU     0.1     // histogram resolution
+#define LOUDNESS_BINS       750     // (CEILING - FLOOR) / BIN_LU
+#define LOUDNESS_TP_TAPS    12      // taps per phase of the true peak filter
+#define LOUDNESS_TARGET     -14.0   // default normalization target, LUFS
+#define LOUDNESS_PEAK_DBTP  -1.0    // true peak allowed after normalization
+#define LOUDNESS_MIN_SECONDS 10.0   // audio needed for a usable measurement
+
+/**
+ * Incremental EBU R128 / ITU-R BS.1770 meter. Samples are K-weighted, cut
+ * into 400 ms blocks overlapping by 75% and every block's loudness is counted
+ * in a histogram, so the integrated loudness with its two gates can be read
+ * at any time in constant memory. The true peak is measured on a 4x
+ * oversampled signal. Only the first two channels are measured, libspotify
+ * never delivers more.
+ */
+typedef struct loudness_s {
+    int rate;                   // 0 until the first chunk
+    int channels;
+
+    // k-weighting, shelf and high pass run side by side in one vector
+    float b[3][4];              // numerator per lane
+    float a[2][4];              // denominator per lane
+    float z[2][4];              // filter state
+    float y[2];                 // last shelf output, input of the high pass
+
+    // 100 ms sub-blocks, four make a gating block
+    int block_frames;
+    int block_fill;
+    float block_energy;         // weighted energy of the filling sub-block
+    double sub[4];              // energy of the last four sub-blocks
+    int nsub;
+
+    uint32_t histogram[LOUDNESS_BINS];
+    uint64_t frames;            // frames measured since the reset
+
+    float tp_history[2][LOUDNESS_TP_TAPS - 1];
+    float peak;                 // linear true peak
+} loudness_t;
+
+typedef struct loudness_result_s {
+    double integrated;          // LUFS, LOUDNESS_FLOOR when all was gated
+    double true_peak;           // dBTP
+    double seconds;             // audio measured
+} loudness_result_t;
+
+void loudness_reset(loudness_t *ln);
+void loudness_analyze(loudness_t *ln, const float *samples, int nframes,
+                      int rate, int channels);
+void loudness_result(const loudness_t *ln, loudness_result_t *result);
+float loudness_gain(const loudness_result_t *result, double target);
+
+#endif // SPOTICLI_AUDIO_LOUDNESS_H
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "loudness_store.h"
+#include "mem.h"
+#include "debug.h"
+
+
+#define LOUDNESS_STORE_MAGIC    "SCL1"  // format tag and version
+#define LOUDNESS_STORE_SLOTS    1024    // initial hash slots
+
+
+/**
+ * FNV-1a over a track id.
+ *
+ * @param id LOUDNESS_ID_SIZE characters
+ *
+ * @return hash
+ */
+static uint32_t loudness_store_hash(const char *id)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < LOUDNESS_ID_SIZE; i++) {
+        hash ^= (uint8_t) id[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Returns the slot holding id, or the empty slot it would go in.
+ *
+ * @param store loudness_store_t
+ * @param id LOUDNESS_ID_SIZE characters
+ *
+ * @return pointer into store->slots
+ */
+static int *loudness_store_find(loudness_store_t *store, const char *id)
+{
+    uint32_t i = loudness_store_hash(id) & (store->nslots - 1);
+
+    while (store->slots[i] >= 0 &&
+           memcmp(store->records[store->slots[i]].id, id, LOUDNESS_ID_SIZE) != 0)
+        i = (i + 1) & (store->nslots - 1);
+
+    return &store->slots[i];
+}
+
+/**
+ * Sizes the hash to nslots and inserts every record again.
+ *
+ * @param store loudness_store_t
+ * @param nslots power of two
+ */
+static void loudness_store_rehash(loudness_store_t *store, int nslots)
+{
+    int i;
+
+    mem_free(MEM_METADATA, store->slots, store->nslots * sizeof(int));
+    store->slots = mem_alloc(MEM_METADATA, nslots * sizeof(int));
+    store->nslots = nslots;
+    memset(store->slots, 0xff, nslots * sizeof(int));
+
+    for (i = 0; i < store->nrecords; i++)
+        *loudness_store_find(store, store->records[i].id) = i;
+}
+
+/**
+ * Adds a record in memory, replacing the one with the same id.
+ *
+ * @param store loudness_store_t
+ * @param record loudness_record_t
+ */
+static void loudness_store_insert(loudness_store_t *store,
+                                  const loudness_record_t *record)
+{
+    int *slot = loudness_store_find(store, record->id);
+    int capacity;
+
+    if (*slot >= 0) {
+        store->records[*slot] = *record;
+        return;
+    }
+
+    if (store->nrecords == store->capacity) {
+        capacity = store->capacity ? store->capacity * 2 : 256;
+        store->records = mem_realloc(MEM_METADATA, store->records,
+                                     store->capacity * sizeof(loudness_record_t),
+                                     capacity * sizeof(loudness_record_t));
+        store->capacity = capacity;
+    }
+
+    *slot = store->nrecords;
+    store->records[store->nrecords++] = *record;
+
+    if (store->nrecords * 2 > store->nslots)
+        loudness_store_rehash(store, store->nslots * 2);
+}
+
+/**
+ * Writes every record to a new file that replaces the old one, so a crash
+ * while compacting never loses the store.
+ *
+ * @param store loudness_store_t
+ *
+ * @return true on success
+ */
+static bool loudness_store_rewrite(loudness_store_t *store)
+{
+    size_t size = strlen(store->path) + 5;
+    char *tmp = malloc(size);
+    FILE *file;
+    bool ok;
+
+    snprintf(tmp, size, "%s.tmp", store->path);
+
+    file = fopen(tmp, "wb");
+    if (file == NULL) {
+        free(tmp);
+        return false;
+    }
+
+    ok = fwrite(LOUDNESS_STORE_MAGIC, 4, 1, file) == 1 &&
+         fwrite(store->records, sizeof(loudness_record_t),
+                store->nrecords, file) == (size_t) store->nrecords;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmp, store->path) == 0;
+
+    if (!ok)
+        remove(tmp);
+
+    free(tmp);
+    return ok;
+}
+
+/**
+ * Loads the store and opens it for appending, a missing or unreadable file
+ * starts an empty store. A partial record at the end, left by a crash, is
+ * dropped.
+ *
+ * @param store loudness_store_t
+ * @param path store file
+ *
+ * @return false if measurements can't be saved, lookups still work
+ */
+bool loudness_store_open(loudness_store_t *store, const char *path)
+{
+    loudness_record_t record;
+    struct stat st;
+    char magic[4];
+    int nread = 0;
+    bool valid = false, torn;
+    off_t whole;
+    FILE *file;
+
+    memset(store, 0, sizeof(loudness_store_t));
+    store->path = strdup(path);
+    loudness_store_rehash(store, LOUDNESS_STORE_SLOTS);
+
+    file = fopen(path, "rb");
+    if (file) {
+        valid = fread(magic, 4, 1, file) == 1 &&
+                memcmp(magic, LOUDNESS_STORE_MAGIC, 4) == 0;
+
+        while (valid && fread(&record, sizeof(record), 1, file) == 1) {
+            loudness_store_insert(store, &record);
+            nread++;
+        }
+
+        fclose(file);
+
+        if (!valid)
+            log_warning("%s: not a loudness store, starting over\n", path);
+    }
+
+    // a record torn by a crash would misalign every record appended after
+    // it, it is cut off, or the store rewritten if that fails
+    whole = 4 + (off_t) nread * sizeof(loudness_record_t);
+    torn = valid && stat(path, &st) == 0 && st.st_size != whole;
+    if (torn && truncate(path, whole) == 0)
+        torn = false;
+    else if (torn)
+        log_warning("%s: %s\n", path, strerror(errno));
+
+    // replaced records are dead weight, drop them once they are half
+    if (!valid || torn ||
+        (nread > store->nrecords && nread >= store->nrecords * 2)) {
+        if (!loudness_store_rewrite(store))
+            log_warning("%s: unable to write loudness store\n", path);
+    }
+
+    store->file = fopen(path, "ab");
+    if (store->file == NULL) {
+        log_warning("%s: loudness measurements won't be saved\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Closes the store file and frees all records.
+ *
+ * @param store loudness_store_t
+ */
+void loudness_store_close(loudness_store_t *store)
+{
+    if (store->file)
+        fclose(store->file);
+
+    mem_free(MEM_METADATA, store->slots, store->nslots * sizeof(int));
+    mem_free(MEM_METADATA, store->records,
+             store->capacity * sizeof(loudness_record_t));
+    free(store->path);
+    memset(store, 0, sizeof(loudness_store_t));
+}
+
+/**
+ * Looks up the measured loudness of a track.
+ *
+ * @param store loudness_store_t
+ * @param id base62 track id
+ * @param result filled in when the track was measured
+ *
+ * @return true if the track was measured
+ */
+bool loudness_store_get(loudness_store_t *store, const char *id,
+                        loudness_result_t *result)
+{
+    const loudness_record_t *record;
+    int slot;
+
+    if (store->slots == NULL || strlen(id) != LOUDNESS_ID_SIZE)
+        return false;
+
+    slot = *loudness_store_find(store, id);
+    if (slot < 0)
+        return false;
+
+    record = &store->records[slot];
+    result->integrated = record->integrated / 100.0;
+    result->true_peak = record->true_peak / 100.0;
+    result->seconds = record->seconds;
+
+    return true;
+}
+
+/**
+ * Saves the measured loudness of a track, unless it covers less audio than
+ * the measurement already stored. Measurements too short to be used are
+ * ignored.
+ *
+ * @param store loudness_store_t
+ * @param id base62 track id
+ * @param result measured loudness
+ */
+void loudness_store_put(loudness_store_t *store, const char *id,
+                        const loudness_result_t *result)
+{
+    loudness_record_t record;
+    loudness_result_t stored;
+
+    if (result->seconds < LOUDNESS_MIN_SECONDS ||
+        result->integrated <= LOUDNESS_FLOOR ||
+        strlen(id) != LOUDNESS_ID_SIZE)
+        return;
+
+    if (loudness_store_get(store, id, &stored) &&
+        stored.seconds > (int) result->seconds)
+        return;
+
+    memcpy(record.id, id, LOUDNESS_ID_SIZE);
+    record.integrated = (int16_t) (result->integrated * 100);
+    record.true_peak = (int16_t) (result->true_peak > LOUDNESS_FLOOR ?
+                                  result->true_peak * 100 : LOUDNESS_FLOOR * 100);
+    record.seconds = (uint16_t) (result->seconds < UINT16_MAX ?
+                                 result->seconds : UINT16_MAX);
+
+    loudness_store_insert(store, &record);
+
+    if (store->file && (fwrite(&record, sizeof(record), 1, store->file) != 1 ||
+                        fflush(store->file) != 0))
+        log_warning("%s: unable to save loudness\n", store->path);
+}
@@ -0,0 +1,46 @@
+#ifndef SPOTICLI_AUDIO_LOUDNESS_STORE_H
+#define SPOTICLI_AUDIO_LOUDNESS_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "loudness.h"
+
+#define LOUDNESS_ID_SIZE    22      // base62 spotify track id
+
+/**
+ * One measured track as stored on disk, 28 bytes.
+ */
+typedef struct __attribute__((packed)) loudness_record_s {
+    char id[LOUDNESS_ID_SIZE];  // not nul terminated
+    int16_t integrated;         // centi LUFS
+    int16_t true_peak;          // centi dBTP
+    uint16_t seconds;           // audio the measurement covers
+} loudness_record_t;
+
+/**
+ * Measured loudness per track. Records are appended to the file as tracks
+ * are measured, a later record replaces an earlier one for the same track.
+ * The file is compacted on open once replaced records make up half of it.
+ * Lookups go through an open addressing hash of the track id. Not thread
+ * safe.
+ */
+typedef struct loudness_store_s {
+    FILE *file;                 // opened for appending, NULL when read only
+    char *path;
+    loudness_record_t *records;
+    int nrecords;
+    int capacity;
+    int *slots;                 // index into records, -1 when empty
+    int nslots;                 // power of two, at least twice nrecords
+} loudness_store_t;
+
+bool loudness_store_open(loudness_store_t *store, const char *path);
+void loudness_store_close(loudness_store_t *store);
+bool loudness_store_get(loudness_store_t *store, const char *id,
+                        loudness_result_t *result);
+void loudness_store_put(loudness_store_t *store, const char *id,
+                        const loudness_result_t *result);
+
+#endif // SPOTICLI_AUDIO_LOUDNESS_STORE_H
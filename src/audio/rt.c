@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "rt.h"
+#include "debug.h"
+
+
+#define RT_STACK_PREFAULT   (64 * 1024)     // stack touched by audio threads
+#define RT_STACK_SIZE       (512 * 1024)    // stack of an audio thread
+#define RT_PAGE_SIZE        4096
+#define RT_THREAD_NAME_MAX  16              // including the terminator
+
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT         4               // linux 4.4, older headers lack it
+#endif
+
+// memory locking was asked for, audio threads lock the stack they touch
+static bool g_memory_locked = false;
+
+
+/**
+ * Parses a cpu list such as "0,2-3" into a cpu set.
+ *
+ * @param list cpu list
+ * @param set cpu_set_t to fill in
+ *
+ * @return true if the list was valid
+ */
+static bool rt_parse_cpus(const char *list, cpu_set_t *set)
+{
+    char *end;
+    long first, last, cpu;
+
+    CPU_ZERO(set);
+
+    while (*list) {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0)
+            return false;
+
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return false;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return false;
+
+        for (cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return false;
+
+        list = end;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Parses a scheduling policy name.
+ *
+ * @param name "other", "fifo" or "rr"
+ * @param policy set to the matching SCHED_* constant
+ *
+ * @return true if the name was known
+ */
+bool rt_parse_policy(const char *name, int *policy)
+{
+    if (strcmp(name, "other") == 0)
+        *policy = SCHED_OTHER;
+    else if (strcmp(name, "fifo") == 0)
+        *policy = SCHED_FIFO;
+    else if (strcmp(name, "rr") == 0)
+        *policy = SCHED_RR;
+    else
+        return false;
+
+    return true;
+}
+
+/**
+ * Spawns a thread with the requested policy, priority and cpu affinity, and
+ * names it. When the realtime policy is refused (usually EPERM without
+ * CAP_SYS_NICE or an RLIMIT_RTPRIO) the thread is created with default
+ * scheduling instead, the same goes for the affinity. The stack is
+ * RT_STACK_SIZE instead of the default 8 MB, so a thread costs little when
+ * memory is locked.
+ *
+ * @param thread set to the new thread
+ * @param rt requested scheduling, NULL for defaults
+ * @param name thread name, truncated to 15 characters
+ * @param start thread function
+ * @param arg argument to start
+ *
+ * @return 0 on success, an errno value from pthread_create() otherwise
+ */
+int rt_thread_create(pthread_t *thread, const rt_config_t *rt, const char *name,
+                     void *(*start)(void *), void *arg)
+{
+    int error;
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+
+    if (rt == NULL || rt->policy == SCHED_OTHER) {
+        error = pthread_create(thread, &attr, start, arg);
+    } else {
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, rt->policy);
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = rt->priority;
+        pthread_attr_setschedparam(&attr, &param);
+
+        error = pthread_create(thread, &attr, start, arg);
+
+        if (error == EPERM || error == EINVAL) {
+            log_warning("%s: realtime scheduling unavailable (%s), "
+                        "using default scheduling\n", name, strerror(error));
+            pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+            error = pthread_create(thread, &attr, start, arg);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (error != 0) {
+        log_error("%s: unable to create thread (%s)\n", name, strerror(error));
+        return error;
+    }
+
+    if (rt && rt->cpus) {
+        if (!rt_parse_cpus(rt->cpus, &cpus))
+            log_warning("%s: invalid cpu list '%s'\n", name, rt->cpus);
+        else if ((error = pthread_setaffinity_np(*thread, sizeof(cpus), &cpus)))
+            log_warning("%s: unable to set cpu affinity (%s)\n",
+                        name, strerror(error));
+    }
+
+    rt_thread_name(*thread, name);
+
+    return 0;
+}
+
+/**
+ * Names a thread so it shows up in top -H, ps -L and debuggers.
+ *
+ * @param thread thread to name
+ * @param name thread name, truncated to 15 characters
+ */
+void rt_thread_name(pthread_t thread, const char *name)
+{
+    char buffer[RT_THREAD_NAME_MAX];
+
+    strncpy(buffer, name, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    pthread_setname_np(thread, buffer);
+}
+
+/**
+ * Pre-faults enough heap for the audio buffers and locks memory. malloc is
+ * told to keep freed memory instead of returning it to the kernel, so
+ * chunks allocated on the audio path reuse the locked pages.
+ *
+ * Future mappings are locked as they are faulted in, not when mapped, so a
+ * thread's stack reservation doesn't become resident. They still count
+ * against RLIMIT_MEMLOCK in full, so under a finite limit only what is
+ * mapped now is locked, and audio threads lock the stack they touch in
+ * rt_stack_prefault(). Otherwise any later thread or allocation could fail
+ * on the limit.
+ *
+ * @param prefault_bytes heap to fault in up front
+ */
+void rt_memory_lock(size_t prefault_bytes)
+{
+    struct rlimit limit;
+    int flags = MCL_CURRENT;
+    char *heap;
+    size_t i;
+
+    // keep the heap we touch below, and never hand chunks out via mmap
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    heap = malloc(prefault_bytes);
+    if (heap) {
+        for (i = 0; i < prefault_bytes; i += RT_PAGE_SIZE)
+            heap[i] = 0;
+        free(heap);
+    }
+
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 &&
+        limit.rlim_cur == RLIM_INFINITY)
+        flags |= MCL_FUTURE | MCL_ONFAULT;
+    else
+        log_info("RLIMIT_MEMLOCK is finite, locking current memory only\n");
+
+    if (mlockall(flags) != 0 &&
+        ((flags & MCL_ONFAULT) == 0 ||
+         mlockall(flags & ~MCL_ONFAULT) != 0)) {
+        log_warning("unable to lock memory (%s), continuing unlocked\n",
+                    strerror(errno));
+        return;
+    }
+
+    g_memory_locked = true;
+}
+
+/**
+ * Touches the top of the calling thread's stack so later calls never fault
+ * on it, and locks it when memory is locked. Meant to be called first thing
+ * in an audio thread.
+ */
+void rt_stack_prefault()
+{
+    volatile char stack[RT_STACK_PREFAULT];
+    size_t i;
+
+    // volatile stores, the compiler can't drop them for never being read
+    for (i = 0; i < sizeof(stack); i += RT_PAGE_SIZE)
+        stack[i] = 0;
+
+    if (g_memory_locked && mlock((const void *) stack, sizeof(stack)) != 0)
+        debug("unable to lock the stack (%s)\n", strerror(errno));
+}
@@ -0,0 +1,25 @@
+#ifndef SPOTICLI_AUDIO_RT_H
+#define SPOTICLI_AUDIO_RT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Scheduling requested for audio threads. Everything defaults to off, any
+ * part that can't be applied falls back to normal scheduling with a warning.
+ */
+typedef struct rt_config_s {
+    int policy;                 // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;               // 1-99 for the realtime policies
+    const char *cpus;           // cpu list like "2" or "0,2-3", NULL for any
+} rt_config_t;
+
+bool rt_parse_policy(const char *name, int *policy);
+int rt_thread_create(pthread_t *thread, const rt_config_t *rt, const char *name,
+                     void *(*start)(void *), void *arg);
+void rt_thread_name(pthread_t thread, const char *name);
+void rt_memory_lock(size_t prefault_bytes);
+void rt_stack_prefault();
+
+#endif // SPOTICLI_AUDIO_RT_H
@@ -0,0 +1,244 @@
+#include <getopt.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+// global configuration, filled in by config_parse()
+config_t g_config = {
+    .buffer_min = AUDIO_BUFFER_MIN,
+    .buffer_max = AUDIO_BUFFER_MAX,
+    .rt         = { .policy = SCHED_OTHER, .priority = 0, .cpus = NULL },
+    .mlock      = false,
+    .normalize  = true,
+    .loudness_target = LOUDNESS_TARGET,
+    .crossfade_ms = 0,
+    .crossfade_curve = CROSSFADE_EQUAL_POWER
+};
+
+static struct option long_options[] = {
+    { "output",      required_argument, NULL, 'o' },
+    { "buffer-min",  required_argument, NULL, 'b' },
+    { "buffer-max",  required_argument, NULL, 'B' },
+    { "rt-policy",   required_argument, NULL, 'P' },
+    { "rt-priority", required_argument, NULL, 'p' },
+    { "cpus",        required_argument, NULL, 'c' },
+    { "mlock",       no_argument,       NULL, 'm' },
+    { "normalize",   required_argument, NULL, 'n' },
+    { "no-normalize", no_argument,      NULL, 'N' },
+    { "eq",          required_argument, NULL, 'e' },
+    { "crossfade",   required_argument, NULL, 'x' },
+    { "crossfade-curve", required_argument, NULL, 'X' },
+    { "mem-budget",  required_argument, NULL, 'M' },
+    { "list-devices", no_argument,      NULL, 'L' },
+    { "help",        no_argument,       NULL, 'h' },
+    { NULL,          0,                 NULL, 0   }
+};
+
+/**
+ * Prints the command line usage to stderr.
+ *
+ * @param program name the program was invoked as
+ */
+void config_usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "\n"
+            "  -o, --output SINK   play to SINK, may be given up to %d times\n"
+            "                      alsa:<device>  alsa pcm device (default)\n"
+            "                      file:<path>    append raw s16 pcm to path\n"
+            "  -L, --list-devices  list the alsa devices outputs can play to\n"
+            "  -b, --buffer-min KB least audio buffered ahead (default %d)\n"
+            "  -B, --buffer-max KB most audio buffered ahead (default %d)\n"
+            "  -P, --rt-policy POL audio thread policy: other, fifo or rr\n"
+            "  -p, --rt-priority N audio thread realtime priority (1-99)\n"
+            "  -c, --cpus LIST     pin audio threads to cpus, e.g. 2 or 0,2-3\n"
+            "  -m, --mlock         lock memory and pre-fault audio buffers\n"
+            "  -n, --normalize LUFS play tracks at this loudness (default %.0f)\n"
+            "  -N, --no-normalize  play tracks as loud as they were mastered\n"
+            "  -e, --eq EQ         equalize with a preset (flat, bass, treble,\n"
+            "                      vocal, loudness, rock, classical) or bands\n"
+            "                      [ls|hs]HZ:DB[:Q],... e.g. ls80:4,3000:-2:0.7\n"
+            "  -x, --crossfade SEC overlap tracks by up to %d seconds (default 0)\n"
+            "  -X, --crossfade-curve CURVE\n"
+            "                      linear, equal-power (default) or smooth\n"
+            "  -M, --mem-budget POOL=MB,...\n"
+            "                      cap memory of audio, metadata, images, search\n"
+            "                      or logs, e.g. audio=16,metadata=64\n"
+            "  -h, --help          show this help\n",
+            program, AUDIO_MAX_SINKS,
+            AUDIO_BUFFER_MIN / 1024, AUDIO_BUFFER_MAX / 1024, LOUDNESS_TARGET,
+            CROSSFADE_MAX_MS / 1000);
+}
+
+/**
+ * Parses a size given in kilobytes, exits if it is not a positive number.
+ *
+ * @param program name the program was invoked as
+ * @param arg option argument
+ *
+ * @return size in bytes
+ */
+static size_t config_parse_kb(const char *program, const char *arg)
+{
+    char *end;
+    long kb = strtol(arg, &end, 10);
+
+    if (*end != '\0' || kb <= 0) {
+        fprintf(stderr, "%s: invalid size '%s'\n", program, arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return (size_t) kb * 1024;
+}
+
+/**
+ * Resolves an XDG base directory for spoticli and creates it. Falls back to
+ * the given directory under $HOME, and to the working directory without a
+ * $HOME.
+ *
+ * @param path buffer for the resolved path
+ * @param size size of path
+ * @param xdg_var XDG variable, e.g. "XDG_CACHE_HOME"
+ * @param fallback directory below $HOME, e.g. ".cache"
+ */
+static void config_dir(char *path, size_t size, const char *xdg_var,
+                       const char *fallback)
+{
+    const char *base = getenv(xdg_var);
+    const char *home = getenv("HOME");
+    char *slash;
+
+    if (base && *base)
+        snprintf(path, size, "%s/spoticli", base);
+    else if (home && *home)
+        snprintf(path, size, "%s/%s/spoticli", home, fallback);
+    else
+        snprintf(path, size, ".spoticli");
+
+    // mkdir -p
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+
+    if (mkdir(path, 0700) != 0 && errno != EEXIST)
+        fprintf(stderr, "unable to create %s: %s\n", path, strerror(errno));
+}
+
+/**
+ * Parses the command line into g_config, exits on invalid options.
+ *
+ * @param argc argument count
+ * @param argv argument vector
+ */
+void config_parse(int argc, char **argv)
+{
+    int opt;
+    char *end;
+    double seconds;
+
+    while ((opt = getopt_long(argc, argv, "o:b:B:P:p:c:mn:Ne:x:X:M:Lh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            if (g_config.noutputs == AUDIO_MAX_SINKS) {
+                fprintf(stderr, "%s: too many outputs\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            g_config.outputs[g_config.noutputs++] = optarg;
+            break;
+        case 'b':
+            g_config.buffer_min = config_parse_kb(argv[0], optarg);
+            break;
+        case 'B':
+            g_config.buffer_max = config_parse_kb(argv[0], optarg);
+            break;
+        case 'P':
+            if (!rt_parse_policy(optarg, &g_config.rt.policy)) {
+                fprintf(stderr, "%s: unknown policy '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            g_config.rt.priority = atoi(optarg);
+            if (g_config.rt.priority < 1 || g_config.rt.priority > 99) {
+                fprintf(stderr, "%s: priority must be 1-99\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            g_config.rt.cpus = optarg;
+            break;
+        case 'm':
+            g_config.mlock = true;
+            break;
+        case 'n':
+            g_config.loudness_target = strtod(optarg, &end);
+            if (*end != '\0' || g_config.loudness_target > 0 ||
+                g_config.loudness_target < LOUDNESS_FLOOR) {
+                fprintf(stderr, "%s: invalid loudness '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            g_config.normalize = true;
+            break;
+        case 'N':
+            g_config.normalize = false;
+            break;
+        case 'e':
+            if (!eq_parse(optarg, &g_config.eq)) {
+                fprintf(stderr, "%s: invalid equalizer '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            seconds = strtod(optarg, &end);
+            if (*end != '\0' || seconds < 0 || seconds * 1000 > CROSSFADE_MAX_MS) {
+                fprintf(stderr, "%s: invalid crossfade '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            g_config.crossfade_ms = (int) (seconds * 1000);
+            break;
+        case 'X':
+            if (!crossfade_parse_curve(optarg, &g_config.crossfade_curve)) {
+                fprintf(stderr, "%s: unknown curve '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            if (!mem_parse_budgets(optarg, g_config.mem_budgets)) {
+                fprintf(stderr, "%s: invalid memory budget '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            g_config.list_devices = true;
+            break;
+        case 'h':
+            config_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            config_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    config_dir(g_config.cache_dir, sizeof(g_config.cache_dir),
+               "XDG_CACHE_HOME", ".cache");
+    config_dir(g_config.settings_dir, sizeof(g_config.settings_dir),
+               "XDG_CONFIG_HOME", ".config");
+
+    // a realtime policy without a priority gets a modest one
+    if (g_config.rt.policy != SCHED_OTHER && g_config.rt.priority == 0)
+        g_config.rt.priority = 50;
+
+    // normal scheduling has no priority
+    if (g_config.rt.policy == SCHED_OTHER && g_config.rt.priority > 0)
+        fprintf(stderr, "%s: --rt-priority is ignored without --rt-policy "
+                "fifo or rr\n", argv[0]);
+}
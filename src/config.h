@@ -0,0 +1,28 @@
+#ifndef SPOTICLI_CONFIG_H
+#define SPOTICLI_CONFIG_H
+
+#include "audio.h"
+#include "mem.h"
+
+typedef struct config_s {
+    const char *outputs[AUDIO_MAX_SINKS];   // "alsa:<device>" or "file:<path>"
+    int noutputs;
+    bool list_devices;                      // print the alsa devices and exit
+    size_t buffer_min;                      // bytes, adaptive buffer floor
+    size_t buffer_max;                      // bytes, adaptive buffer ceiling
+    rt_config_t rt;                         // audio thread scheduling
+    bool mlock;                             // lock and pre-fault memory
+    bool normalize;                         // play tracks at the same loudness
+    double loudness_target;                 // LUFS tracks are normalized to
+    eq_params_t eq;                         // equalizer, flat by default
+    int crossfade_ms;                       // overlap between tracks, 0 is gapless
+    crossfade_curve_t crossfade_curve;
+    size_t mem_budgets[MEM_POOLS];          // bytes per mem_pool_t, 0 is unlimited
+    char cache_dir[256];                    // libspotify cache
+    char settings_dir[256];                 // libspotify settings
+} config_t;
+
+void config_parse(int argc, char **argv);
+void config_usage(const char *program);
+
+#endif // SPOTICLI_CONFIG_H
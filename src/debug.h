@@ -11,6 +11,12 @@
 
 #define log_error(str, ...)   fprintf(stderr, "ERROR   %s:%d: " str, __FILE__, __LINE__, ##__VA_ARGS__)
 #define log_warning(str, ...) fprintf(stderr, "WARNING %s:%d: " str, __FILE__, __LINE__, ##__VA_ARGS__)
+
+// QUIET still compiles the arguments so nothing only logged goes unused
+#ifdef QUIET
+#define log_info(str, ...)    do { if (0) fprintf(stderr, str, ##__VA_ARGS__); } while (0)
+#else
 #define log_info(str, ...)    fprintf(stderr, "INFO    %s:%d: " str, __FILE__, __LINE__, ##__VA_ARGS__)
+#endif
 
 #endif
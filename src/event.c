@@ -0,0 +1,312 @@
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "debug.h"
+
+
+static uint64_t event_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Initializes an empty queue.
+ *
+ * @param queue event_queue_t
+ */
+void event_queue_init(event_queue_t *queue)
+{
+    unsigned long i;
+
+    memset(queue, 0, sizeof(event_queue_t));
+
+    // slot i is free for position i first, for i + EVENT_QUEUE_SIZE next
+    for (i = 0; i < EVENT_QUEUE_SIZE; i++)
+        queue->slots[i].seq = i;
+
+    queue->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->wakeup < 0)
+        log_error("unable to create eventfd\n");
+}
+
+/**
+ * Releases a queue, events still queued are dropped.
+ *
+ * @param queue event_queue_t
+ */
+void event_queue_release(event_queue_t *queue)
+{
+    if (queue->wakeup >= 0)
+        close(queue->wakeup);
+    queue->wakeup = -1;
+}
+
+/**
+ * Returns whether an event of a type is folded into one already queued.
+ * libspotify only asks for its events to be processed or says that some
+ * metadata arrived, a resize only needs the latest size and quitting
+ * happens once, none of them cares how often.
+ */
+static bool event_coalesces(event_type_t type)
+{
+    return type == EVENT_NOTIFY || type == EVENT_METADATA_UPDATED ||
+           type == EVENT_RESIZE || type == EVENT_QUIT;
+}
+
+/**
+ * Wakes the consumer if it sleeps. Called after publishing with a
+ * sequentially consistent store like event_wait(), so either it sees the
+ * event or this sees it waiting.
+ */
+static void event_wake(event_queue_t *queue)
+{
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&queue->waiting, 0, __ATOMIC_SEQ_CST) &&
+        write(queue->wakeup, &one, sizeof(one)) != sizeof(one))
+        debug("event wakeup failed\n");
+}
+
+/**
+ * Posts an event, a coalescing one while one is still queued is folded
+ * into it.
+ *
+ * @param set_aside keep the event beside a full queue instead of failing
+ *
+ * @return false if the queue was full and the event not posted
+ */
+static bool event_put(event_queue_t *queue, event_type_t type, int value,
+                      bool set_aside)
+{
+    event_slot_t *slot;
+    unsigned long pos, seq;
+
+    __atomic_add_fetch(&queue->stats.posted[type], 1, __ATOMIC_RELAXED);
+
+    if (event_coalesces(type) &&
+        __atomic_exchange_n(&queue->pending[type], 1, __ATOMIC_ACQ_REL)) {
+        __atomic_add_fetch(&queue->stats.coalesced, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (true) {
+        slot = &queue->slots[pos & (EVENT_QUEUE_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((long) (seq - pos) < 0) {
+            // the consumer hasn't taken the event a lap ago
+            break;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (seq != pos) {
+        if (!set_aside) {
+            if (event_coalesces(type))
+                __atomic_store_n(&queue->pending[type], 0, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        // a coalescing event stays pending until the consumer takes this one
+        __atomic_store_n(&queue->aside_value[type], value, __ATOMIC_RELAXED);
+        __atomic_store_n(&queue->aside_time[type], event_now(),
+                         __ATOMIC_RELAXED);
+        __atomic_add_fetch(&queue->aside[type], 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&queue->stats.set_aside, 1, __ATOMIC_RELAXED);
+        event_wake(queue);
+        return true;
+    }
+
+    slot->event.type = type;
+    slot->event.value = value;
+    slot->event.time = event_now();
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    event_wake(queue);
+
+    return true;
+}
+
+/**
+ * Posts an event, from any thread or a signal handler, without locking. A
+ * notify, metadata update, resize or quit while one is still queued is folded
+ * into it. The event is never lost: while the queue is full it is set
+ * aside and taken once the queued events are, so a flood of one type
+ * can't push out a login or the end of a track.
+ *
+ * @param queue event_queue_t
+ * @param type event_type_t
+ * @param value event specific, e.g. the sp_error of EVENT_LOGGED_IN
+ */
+void event_post(event_queue_t *queue, event_type_t type, int value)
+{
+    event_put(queue, type, value, true);
+}
+
+/**
+ * Posts an event like event_post() but fails on a full queue, for a
+ * producer that waits for room and needs every value in order.
+ *
+ * @param queue event_queue_t
+ * @param type event_type_t
+ * @param value event specific
+ *
+ * @return false if the queue was full and the event not posted
+ */
+bool event_try_post(event_queue_t *queue, event_type_t type, int value)
+{
+    return event_put(queue, type, value, false);
+}
+
+/**
+ * Returns whether events were set aside. Consumer only.
+ *
+ * @param order memory order of the loads
+ */
+static bool event_aside(event_queue_t *queue, int order)
+{
+    int type;
+
+    for (type = 0; type < EVENT_TYPES; type++) {
+        if (__atomic_load_n(&queue->aside[type], order) > 0)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Returns whether the next event is published. Consumer only.
+ *
+ * @param order memory order of the load
+ */
+static bool event_ready(event_queue_t *queue, int order)
+{
+    event_slot_t *slot = &queue->slots[queue->head & (EVENT_QUEUE_SIZE - 1)];
+
+    return __atomic_load_n(&slot->seq, order) == queue->head + 1;
+}
+
+/**
+ * Takes up to max events in the order they were posted, those set aside
+ * while the queue was full after the queued ones. Only ever called from one
+ * thread.
+ *
+ * @param queue event_queue_t
+ * @param events filled with the events taken
+ * @param max size of events
+ *
+ * @return number of events taken, 0 if none are queued
+ */
+int event_take(event_queue_t *queue, event_t *events, int max)
+{
+    event_slot_t *slot;
+    uint64_t now = 0, latency;
+    unsigned long count;
+    int n, type;
+
+    for (n = 0; n < max && event_ready(queue, __ATOMIC_ACQUIRE); n++) {
+        slot = &queue->slots[queue->head & (EVENT_QUEUE_SIZE - 1)];
+        events[n] = slot->event;
+
+        // free the slot for the next lap
+        __atomic_store_n(&slot->seq, queue->head + EVENT_QUEUE_SIZE,
+                         __ATOMIC_RELEASE);
+        queue->head++;
+
+        // a notify or resize posted from here on is queued again
+        if (event_coalesces(events[n].type))
+            __atomic_store_n(&queue->pending[events[n].type], 0,
+                             __ATOMIC_RELEASE);
+
+        if (n == 0)
+            now = event_now();
+        latency = now > events[n].time ? now - events[n].time : 0;
+        if (latency > queue->stats.worst_latency)
+            queue->stats.worst_latency = latency;
+    }
+
+    // what was set aside follows once the queue is drained, producers only
+    // ever add to the counts
+    for (type = 0; type < EVENT_TYPES && n < max &&
+                   !event_ready(queue, __ATOMIC_ACQUIRE); type++) {
+        count = __atomic_load_n(&queue->aside[type], __ATOMIC_ACQUIRE);
+        for (; count > 0 && n < max; count--, n++) {
+            __atomic_sub_fetch(&queue->aside[type], 1, __ATOMIC_ACQ_REL);
+            events[n].type = type;
+            events[n].value = __atomic_load_n(&queue->aside_value[type],
+                                              __ATOMIC_RELAXED);
+            events[n].time = __atomic_load_n(&queue->aside_time[type],
+                                             __ATOMIC_RELAXED);
+
+            if (event_coalesces(type))
+                __atomic_store_n(&queue->pending[type], 0, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (n > 0) {
+        queue->stats.batches++;
+        if ((unsigned long) n > queue->stats.largest_batch)
+            queue->stats.largest_batch = n;
+    }
+
+    return n;
+}
+
+/**
+ * Sleeps until an event is posted or timeout expires, returns right away
+ * if one is queued already. Consumer only.
+ *
+ * @param queue event_queue_t
+ * @param timeout ms, negative waits forever
+ */
+void event_wait(event_queue_t *queue, int timeout)
+{
+    struct pollfd pfd = { .fd = queue->wakeup, .events = POLLIN };
+    uint64_t count;
+
+    __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (!event_ready(queue, __ATOMIC_SEQ_CST) &&
+        !event_aside(queue, __ATOMIC_SEQ_CST))
+        poll(&pfd, 1, timeout);
+
+    __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+
+    // a late wakeup only costs one extra turn of the main loop
+    if (read(queue->wakeup, &count, sizeof(count)) < 0)
+        count = 0;
+}
+
+/**
+ * Copies the counters of a queue. Consumer only.
+ *
+ * @param queue event_queue_t
+ * @param stats filled in
+ */
+void event_stats(event_queue_t *queue, event_stats_t *stats)
+{
+    int i;
+
+    for (i = 0; i < EVENT_TYPES; i++)
+        stats->posted[i] = __atomic_load_n(&queue->stats.posted[i],
+                                           __ATOMIC_RELAXED);
+    stats->coalesced = __atomic_load_n(&queue->stats.coalesced, __ATOMIC_RELAXED);
+    stats->set_aside = __atomic_load_n(&queue->stats.set_aside,
+                                       __ATOMIC_RELAXED);
+    stats->batches = queue->stats.batches;
+    stats->largest_batch = queue->stats.largest_batch;
+    stats->worst_latency = queue->stats.worst_latency;
+}
@@ -0,0 +1,73 @@
+#ifndef SPOTICLI_EVENT_H
+#define SPOTICLI_EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EVENT_QUEUE_SIZE    256     // power of two
+#define EVENT_BATCH         32      // events taken at once by the main loop
+
+typedef enum event_type_e {
+    EVENT_NOTIFY = 0,           // libspotify has events to process
+    EVENT_END_OF_TRACK,
+    EVENT_TOKEN_LOST,           // playback moved to another device
+    EVENT_LOGGED_IN,            // value is the sp_error of the login
+    EVENT_LOGGED_OUT,
+    EVENT_METADATA_UPDATED,     // coalesced, carries nothing
+    EVENT_RESIZE,               // the terminal was resized, posted by SIGWINCH
+    EVENT_QUIT,                 // posted by SIGINT and SIGTERM
+    EVENT_TYPES
+} event_type_t;
+
+typedef struct event_s {
+    event_type_t type;
+    int value;
+    uint64_t time;              // ns, when the event was posted
+} event_t;
+
+typedef struct event_slot_s {
+    unsigned long seq;          // position the slot is ready for
+    event_t event;
+} event_slot_t;
+
+typedef struct event_stats_s {
+    unsigned long posted[EVENT_TYPES];
+    unsigned long coalesced;    // folded into one of the type already queued
+    unsigned long set_aside;    // posted while the queue was full
+    unsigned long batches;
+    unsigned long largest_batch;
+    uint64_t worst_latency;     // ns, from posting to being taken
+} event_stats_t;
+
+/**
+ * Bounded queue of events from any number of threads to a single consumer.
+ * Posting never locks, producers claim a slot with a compare and swap and
+ * publish it with its sequence number. The consumer sleeps on an eventfd,
+ * which producers only write when it really sleeps. Posting is async
+ * signal safe. An event posted while the queue is full isn't lost, it waits
+ * beside the queue and is taken after the queued ones.
+ */
+typedef struct event_queue_s {
+    event_slot_t slots[EVENT_QUEUE_SIZE];
+    unsigned long tail;         // next position to post to
+    unsigned long head;         // next position to take, consumer only
+    int pending[EVENT_TYPES];   // a coalescing event of the type is queued
+    // events of each type posted while the queue was full, only the latest
+    // value and time of each type are kept
+    unsigned long aside[EVENT_TYPES];
+    int aside_value[EVENT_TYPES];
+    uint64_t aside_time[EVENT_TYPES];
+    int waiting;                // consumer sleeps in event_wait()
+    int wakeup;                 // eventfd
+    event_stats_t stats;        // posted, coalesced and set_aside are atomic
+} event_queue_t;
+
+void event_queue_init(event_queue_t *queue);
+void event_queue_release(event_queue_t *queue);
+void event_post(event_queue_t *queue, event_type_t type, int value);
+bool event_try_post(event_queue_t *queue, event_type_t type, int value);
+int event_take(event_queue_t *queue, event_t *events, int max);
+void event_wait(event_queue_t *queue, int timeout);
+void event_stats(event_queue_t *queue, event_stats_t *stats);
+
+#endif // SPOTICLI_EVENT_H
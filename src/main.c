@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -8,6 +9,15 @@
 #include <unistd.h>
 
 #include "audio.h"
+#include "audio/alsa.h"
+#include "audio/file.h"
+#include "config.h"
+#include "event.h"
+#include "mem.h"
+#include "startup.h"
+#include "spotify/browse.h"
+#include "spotify/library.h"
+#include "spotify/player.h"
 #include "spotify/session.h"
 #include "ui/ui.h"
 
@@ -19,63 +29,110 @@
 extern const char *g_username;
 extern const char *g_password;
 extern sp_session *g_session;
-extern audio_fifo_t audio_fifo;
-extern pthread_mutex_t g_notify_mutex;
-extern pthread_cond_t g_notify_cond;
-extern bool g_notify_do;
-extern bool g_playback_done;
+extern audio_fifo_t g_audio_fifo;
+extern config_t g_config;
+extern event_queue_t g_events;
 
 
 // function prototypes /////////////////////////////////////////////////////////
+static void outputs_list();
+static void outputs_init();
+static void *ui_start(void *arg);
+static void handle_event(const event_t *event);
 static void cleanup();
 static void sigint_handler(int sig);
+static void sigwinch_handler(int sig);
+
+
+// set by EVENT_QUIT, the main loop ends and cleans up
+static bool g_quit = false;
 
 
 // main ////////////////////////////////////////////////////////////////////////
 int main(int argc, char **argv)
 {
+    startup_begin();
+
     // enable utf-8
     setlocale(LC_ALL, "");
 
     int next_timeout = 0;
+    int tick_timeout;
+    int i, nevents;
+    mem_pool_t pool;
+    event_t events[EVENT_BATCH];
+    pthread_t ui_thread;
 
-    // register signal handlers
-    signal(SIGINT, sigint_handler);
+    // parse command line options
+    config_parse(argc, argv);
+
+    if (g_config.list_devices) {
+        outputs_list();
+        return EXIT_SUCCESS;
+    }
 
-    // initialize session
+    // budgets hold from the first allocation on, caches can evict to them
+    for (pool = 0; pool < MEM_POOLS; pool++)
+        mem_set_budget(pool, g_config.mem_budgets[pool]);
+    browse_init();
+
+    // start audio outputs, each sink opens its device in its own thread
+    outputs_init();
+
+    // load the loudness of tracks played before
+    player_init();
+
+    // the table stays empty for now, nothing loads playlists into it yet
+    library_init();
+
+    // initialize ui alongside session creation and login
+    pthread_create(&ui_thread, NULL, ui_start, NULL);
+    rt_thread_name(ui_thread, "ui-init");
+
+    // initialize session, libspotify loads its cached settings here
     session_init();
+    startup_mark(STARTUP_SESSION);
 
-    // initialize ui
-    ui_init();
+    // resizes are laid out and quitting is done from the main loop, the
+    // queue exists from here on
+    signal(SIGWINCH, sigwinch_handler);
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
 
-    // login to spotify
+    // login to spotify, completes in the logged_in callback
     session_login(g_username, g_password);
 
-    pthread_mutex_lock(&g_notify_mutex);
+    // resolve the tracks of the last run while logging in
+    player_resume();
 
-    while (true) {
-        if (next_timeout == 0) {
-            while (!g_notify_do)
-                pthread_cond_wait(&g_notify_cond, &g_notify_mutex);
-        } else {
-            // current time
-            struct timespec ts;
+    // ncurses is only touched from the main thread from here on
+    pthread_join(ui_thread, NULL);
 
-            // convert the next_timeout to a real time, realative to current time
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += next_timeout / 1000;
-            ts.tv_nsec += (next_timeout % 1000) * 1E6;
+    while (!g_quit) {
+        // libspotify asks for events to be processed by posting a notify,
+        // until then sleep as long as it told us to
+        event_wait(&g_events, next_timeout == 0 ? -1 : next_timeout);
 
-            pthread_cond_timedwait(&g_notify_cond, &g_notify_mutex, &ts);
+        // events are handled in the order callbacks posted them
+        while ((nevents = event_take(&g_events, events, EVENT_BATCH)) > 0) {
+            for (i = 0; i < nevents; i++)
+                handle_event(&events[i]);
         }
 
-        pthread_mutex_unlock(&g_notify_mutex);
+        if (g_quit)
+            break;
 
         do {
             sp_session_process_events(g_session, &next_timeout);
         } while (next_timeout == 0);
 
-        pthread_mutex_lock(&g_notify_mutex);
+        tick_timeout = player_tick();
+        if (tick_timeout > 0 && tick_timeout < next_timeout)
+            next_timeout = tick_timeout;
+
+        tick_timeout = ui_tick();
+        if (tick_timeout > 0 && tick_timeout < next_timeout)
+            next_timeout = tick_timeout;
     }
 
     // exit ui
@@ -86,9 +143,120 @@ int main(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+/**
+ * Prints the alsa devices an output can be given, see --list-devices.
+ */
+static void outputs_list()
+{
+    alsa_device_t devices[ALSA_MAX_DEVICES];
+    int i, count = alsa_devices(devices, ALSA_MAX_DEVICES);
+
+    for (i = 0; i < count; i++)
+        printf("alsa:%-30s %s\n", devices[i].name, devices[i].description);
+}
+
+/**
+ * Creates a sink for every configured output and attaches it to the global
+ * audio fifo. Without any configured output audio goes to the default alsa
+ * device.
+ */
+static void outputs_init()
+{
+    int i;
+    const char *output;
+    audio_sink_t *sink;
+
+    // lock before the sink threads exist so their stacks are locked too
+    if (g_config.mlock)
+        rt_memory_lock(g_config.buffer_max * 2);
+
+    audio_fifo_init(&g_audio_fifo);
+    audio_fifo_set_limits(&g_audio_fifo, g_config.buffer_min, g_config.buffer_max);
+    audio_fifo_set_rt(&g_audio_fifo, &g_config.rt);
+    audio_fifo_set_eq(&g_audio_fifo, &g_config.eq);
+    audio_fifo_set_crossfade(&g_audio_fifo, g_config.crossfade_ms,
+                             g_config.crossfade_curve);
+
+    if (g_config.noutputs == 0)
+        g_config.outputs[g_config.noutputs++] = "alsa:" ALSA_DEFAULT_DEVICE;
+
+    for (i = 0; i < g_config.noutputs; i++) {
+        output = g_config.outputs[i];
+
+        if (strncmp(output, "file:", 5) == 0)
+            sink = file_sink_create(output + 5);
+        else if (strncmp(output, "alsa:", 5) == 0)
+            sink = alsa_sink_create(output + 5);
+        else
+            sink = alsa_sink_create(output);
+
+        if (!audio_fifo_add_sink(&g_audio_fifo, sink))
+            audio_sink_destroy(sink);
+    }
+}
+
+/**
+ * Initializes the ui off the main thread during startup.
+ *
+ * @param arg unused
+ */
+static void *ui_start(void *arg)
+{
+    ui_init();
+    startup_mark(STARTUP_UI);
+
+    return NULL;
+}
+
+/**
+ * Handles an event posted by a libspotify callback, on the main thread.
+ *
+ * @param event event_t
+ */
+static void handle_event(const event_t *event)
+{
+    switch (event->type) {
+    case EVENT_LOGGED_IN:
+        if (event->value != SP_ERROR_OK) {
+            fprintf(stderr, "Unable to login: %s\n",
+                    sp_error_message(event->value));
+            exit(EXIT_FAILURE);
+        }
+        startup_mark(STARTUP_LOGGED_IN);
+        // playback of the last run picks up where it was
+        player_logged_in();
+        break;
+    case EVENT_METADATA_UPDATED:
+        // a resume waits for the metadata of its tracks
+        player_metadata_updated();
+        break;
+    case EVENT_END_OF_TRACK:
+        // the next track follows right away, or crossfades in
+        player_end_of_track();
+        break;
+    case EVENT_TOKEN_LOST:
+        // playback moved to another device, stop hearing it here
+        audio_fifo_flush(&g_audio_fifo);
+        player_pause();
+        break;
+    case EVENT_RESIZE:
+        // laid out by ui_tick(), at most every UI_RESIZE_MS
+        ui_resize();
+        break;
+    case EVENT_QUIT:
+        // the state is saved and everything released after the loop
+        g_quit = true;
+        break;
+    default:
+        // notifies are served by processing events right after
+        break;
+    }
+}
+
 static void cleanup()
 {
     sp_connectionstate state;
+    event_stats_t stats;
 
     if (!g_session)
         return;
@@ -97,12 +265,49 @@ static void cleanup()
     if (state == SP_CONNECTION_STATE_LOGGED_IN)
         session_logout();
 
+    // queued tracks, browses and the library are released while the session
+    // still exists
+    player_release();
+    browse_release();
+    library_release();
+
+    event_stats(&g_events, &stats);
+    log_info("events: %lu notifies, %lu coalesced, %lu set aside, "
+             "largest batch %lu, worst latency %.3f ms\n",
+             stats.posted[EVENT_NOTIFY], stats.coalesced, stats.set_aside,
+             stats.largest_batch, stats.worst_latency / 1E6);
+    mem_report();
+
     session_release();
+
+    audio_fifo_release(&g_audio_fifo);
 }
 
+/**
+ * Posts a quit, the main loop saves and releases everything. Nothing else
+ * is done here, none of it is async signal safe. A second signal while
+ * shutting down kills the process.
+ *
+ * @param sig SIGINT or SIGTERM
+ */
 static void sigint_handler(int sig)
 {
-    debug("SIGINT caught\n");
-    cleanup();
-    exit(sig);
+    int saved = errno;
+
+    signal(sig, SIG_DFL);
+    event_post(&g_events, EVENT_QUIT, 0);
+    errno = saved;
+}
+
+/**
+ * Posts a resize, a burst of them is folded into one queued event.
+ *
+ * @param sig SIGWINCH
+ */
+static void sigwinch_handler(int sig)
+{
+    int saved = errno;
+
+    event_post(&g_events, EVENT_RESIZE, 0);
+    errno = saved;
 }
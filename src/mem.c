@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "debug.h"
+
+
+typedef struct mem_evictor_s {
+    mem_evict_t evict;          // NULL while unused
+    void *userdata;
+} mem_evictor_t;
+
+typedef struct mem_counter_s {
+    size_t used;
+    size_t peak;
+    size_t budget;
+    unsigned long refused;
+    unsigned long evictions;
+    mem_evictor_t evictors[MEM_MAX_EVICTORS];
+} mem_counter_t;
+
+static const char *mem_pool_names[MEM_POOLS] = {
+    [MEM_AUDIO]     = "audio",
+    [MEM_METADATA]  = "metadata",
+    [MEM_IMAGES]    = "images",
+    [MEM_SEARCH]    = "search",
+    [MEM_LOGS]      = "logs"
+};
+
+// counters are updated from any thread, evictors are set up front
+static mem_counter_t g_mem[MEM_POOLS];
+
+
+/**
+ * Parses budgets such as "audio=16,metadata=64" in megabytes into an array
+ * indexed by mem_pool_t. Pools not named keep their budget.
+ *
+ * @param arg comma separated pool=MB pairs
+ * @param budgets MEM_POOLS budgets in bytes
+ *
+ * @return false if arg is malformed
+ */
+bool mem_parse_budgets(const char *arg, size_t *budgets)
+{
+    char name[16];
+    const char *end;
+    char *number_end;
+    size_t len;
+    long mb;
+    int i;
+
+    while (*arg) {
+        end = strchr(arg, '=');
+        if (end == NULL || (len = end - arg) == 0 || len >= sizeof(name))
+            return false;
+
+        memcpy(name, arg, len);
+        name[len] = '\0';
+
+        for (i = 0; i < MEM_POOLS && strcmp(name, mem_pool_names[i]) != 0; i++)
+            ;
+        if (i == MEM_POOLS)
+            return false;
+
+        mb = strtol(end + 1, &number_end, 10);
+        if (number_end == end + 1 || mb < 0 ||
+            (*number_end != ',' && *number_end != '\0'))
+            return false;
+
+        budgets[i] = (size_t) mb * 1024 * 1024;
+        arg = *number_end == ',' ? number_end + 1 : number_end;
+    }
+
+    return true;
+}
+
+/**
+ * Sets the hard budget of a pool. What is already charged stays, further
+ * try charges are refused until the pool is back under it.
+ *
+ * @param pool mem_pool_t
+ * @param bytes budget, 0 is unlimited
+ */
+void mem_set_budget(mem_pool_t pool, size_t bytes)
+{
+    __atomic_store_n(&g_mem[pool].budget, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Registers a cache that gives memory back when a pool runs over its
+ * budget. Call before the pool is charged from other threads.
+ *
+ * @param pool mem_pool_t
+ * @param evict mem_evict_t
+ * @param userdata handed to evict
+ */
+void mem_add_evictor(mem_pool_t pool, mem_evict_t evict, void *userdata)
+{
+    int i;
+
+    for (i = 0; i < MEM_MAX_EVICTORS; i++) {
+        if (g_mem[pool].evictors[i].evict == NULL) {
+            g_mem[pool].evictors[i].evict = evict;
+            g_mem[pool].evictors[i].userdata = userdata;
+            return;
+        }
+    }
+
+    log_warning("too many evictors for %s\n", mem_pool_names[pool]);
+}
+
+/**
+ * Unregisters an evictor added with mem_add_evictor().
+ */
+void mem_remove_evictor(mem_pool_t pool, mem_evict_t evict, void *userdata)
+{
+    int i;
+
+    for (i = 0; i < MEM_MAX_EVICTORS; i++) {
+        if (g_mem[pool].evictors[i].evict == evict &&
+            g_mem[pool].evictors[i].userdata == userdata)
+            memset(&g_mem[pool].evictors[i], 0, sizeof(mem_evictor_t));
+    }
+}
+
+/**
+ * Raises the peak of a pool to used, racy writers only ever raise it.
+ */
+static void mem_update_peak(mem_counter_t *counter, size_t used)
+{
+    size_t peak = __atomic_load_n(&counter->peak, __ATOMIC_RELAXED);
+
+    while (used > peak &&
+           !__atomic_compare_exchange_n(&counter->peak, &peak, used, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Accounts bytes to a pool whatever its budget, for memory that can't be
+ * refused, e.g. buffers sized once at startup. Thread safe.
+ *
+ * @param pool mem_pool_t
+ * @param bytes bytes allocated
+ */
+void mem_charge(mem_pool_t pool, size_t bytes)
+{
+    mem_update_peak(&g_mem[pool],
+                    __atomic_add_fetch(&g_mem[pool].used, bytes, __ATOMIC_RELAXED));
+}
+
+/**
+ * Accounts bytes to a pool if they fit its budget. Otherwise the pool's
+ * evictors are asked to make room first, and the charge is refused if
+ * they can't. Thread safe.
+ *
+ * @param pool mem_pool_t
+ * @param bytes bytes about to be allocated
+ *
+ * @return false if nothing was charged and the allocation must not happen
+ */
+bool mem_try_charge(mem_pool_t pool, size_t bytes)
+{
+    mem_counter_t *counter = &g_mem[pool];
+    size_t used, budget, freed = 0;
+    bool evicted = false;
+    int i;
+
+    used = __atomic_load_n(&counter->used, __ATOMIC_RELAXED);
+
+    while (true) {
+        budget = __atomic_load_n(&counter->budget, __ATOMIC_RELAXED);
+
+        if (budget == 0 || used + bytes <= budget) {
+            if (__atomic_compare_exchange_n(&counter->used, &used, used + bytes,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                mem_update_peak(counter, used + bytes);
+                return true;
+            }
+            continue;
+        }
+
+        // over budget, the evictors get one chance to make room
+        if (evicted)
+            break;
+        evicted = true;
+
+        __atomic_add_fetch(&counter->evictions, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < MEM_MAX_EVICTORS && freed < used + bytes - budget; i++) {
+            if (counter->evictors[i].evict)
+                freed += counter->evictors[i].evict(used + bytes - budget - freed,
+                                                    counter->evictors[i].userdata);
+        }
+
+        used = __atomic_load_n(&counter->used, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&counter->refused, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * Accounts bytes to a pool whatever its budget, and to the part of it the
+ * budget applies to, see mem_try_charge_part(). Thread safe.
+ *
+ * @param pool mem_pool_t
+ * @param part bytes of the part, updated
+ * @param bytes bytes allocated
+ */
+void mem_charge_part(mem_pool_t pool, size_t *part, size_t bytes)
+{
+    __atomic_add_fetch(part, bytes, __ATOMIC_RELAXED);
+    mem_charge(pool, bytes);
+}
+
+/**
+ * Accounts bytes to a pool if they fit its budget, measuring only a part
+ * of the pool against it. The rest of the pool is memory that can't be
+ * refused, e.g. buffers sized once at startup, and would otherwise leave
+ * the part no room at all under a small budget. Evictors aren't asked.
+ * Thread safe.
+ *
+ * @param pool mem_pool_t
+ * @param part bytes of the part, updated
+ * @param bytes bytes about to be allocated
+ *
+ * @return false if nothing was charged and the allocation must not happen
+ */
+bool mem_try_charge_part(mem_pool_t pool, size_t *part, size_t bytes)
+{
+    mem_counter_t *counter = &g_mem[pool];
+    size_t used = __atomic_load_n(part, __ATOMIC_RELAXED);
+    size_t budget;
+
+    do {
+        budget = __atomic_load_n(&counter->budget, __ATOMIC_RELAXED);
+        if (budget != 0 && used + bytes > budget) {
+            __atomic_add_fetch(&counter->refused, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(part, &used, used + bytes, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    mem_charge(pool, bytes);
+    return true;
+}
+
+/**
+ * Gives bytes of a part back to a pool. Thread safe.
+ *
+ * @param pool mem_pool_t
+ * @param part bytes of the part, updated
+ * @param bytes bytes freed
+ */
+void mem_uncharge_part(mem_pool_t pool, size_t *part, size_t bytes)
+{
+    __atomic_sub_fetch(part, bytes, __ATOMIC_RELAXED);
+    mem_uncharge(pool, bytes);
+}
+
+/**
+ * Gives bytes back to a pool. Thread safe.
+ *
+ * @param pool mem_pool_t
+ * @param bytes bytes freed
+ */
+void mem_uncharge(mem_pool_t pool, size_t bytes)
+{
+    __atomic_sub_fetch(&g_mem[pool].used, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * malloc() that is accounted to a pool, see mem_charge().
+ */
+void *mem_alloc(mem_pool_t pool, size_t bytes)
+{
+    mem_charge(pool, bytes);
+    return malloc(bytes);
+}
+
+/**
+ * calloc() that is accounted to a pool, see mem_charge().
+ */
+void *mem_calloc(mem_pool_t pool, size_t n, size_t size)
+{
+    mem_charge(pool, n * size);
+    return calloc(n, size);
+}
+
+/**
+ * realloc() that is accounted to a pool, see mem_charge().
+ *
+ * @param old_bytes size ptr was allocated with, 0 for NULL
+ */
+void *mem_realloc(mem_pool_t pool, void *ptr, size_t old_bytes, size_t bytes)
+{
+    if (bytes > old_bytes)
+        mem_charge(pool, bytes - old_bytes);
+    else
+        mem_uncharge(pool, old_bytes - bytes);
+
+    return realloc(ptr, bytes);
+}
+
+/**
+ * free() for memory from mem_alloc(), mem_calloc() and mem_realloc().
+ *
+ * @param bytes size ptr was allocated with
+ */
+void mem_free(mem_pool_t pool, void *ptr, size_t bytes)
+{
+    if (ptr)
+        mem_uncharge(pool, bytes);
+    free(ptr);
+}
+
+/**
+ * Returns the bytes accounted to a pool right now.
+ */
+size_t mem_used(mem_pool_t pool)
+{
+    return __atomic_load_n(&g_mem[pool].used, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies the counters of a pool. Thread safe, the counters are read one by
+ * one and may be slightly apart.
+ *
+ * @param pool mem_pool_t
+ * @param stats filled in
+ */
+void mem_stats(mem_pool_t pool, mem_stats_t *stats)
+{
+    stats->used = __atomic_load_n(&g_mem[pool].used, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&g_mem[pool].peak, __ATOMIC_RELAXED);
+    stats->budget = __atomic_load_n(&g_mem[pool].budget, __ATOMIC_RELAXED);
+    stats->refused = __atomic_load_n(&g_mem[pool].refused, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&g_mem[pool].evictions, __ATOMIC_RELAXED);
+}
+
+/**
+ * Logs use, peak and budget of every pool.
+ */
+void mem_report()
+{
+    mem_stats_t stats;
+    int i;
+
+    log_info("memory by pool, used / peak / budget in KB:\n");
+
+    for (i = 0; i < MEM_POOLS; i++) {
+        mem_stats(i, &stats);
+
+        if (stats.budget)
+            log_info("  %-10s %8zu %8zu %8zu, %lu refused, %lu evictions\n",
+                     mem_pool_names[i], stats.used / 1024, stats.peak / 1024,
+                     stats.budget / 1024, stats.refused, stats.evictions);
+        else
+            log_info("  %-10s %8zu %8zu %8s\n", mem_pool_names[i],
+                     stats.used / 1024, stats.peak / 1024, "-");
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef SPOTICLI_MEM_H
+#define SPOTICLI_MEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MEM_MAX_EVICTORS    4       // caches that can give memory back, per pool
+
+typedef enum mem_pool_e {
+    MEM_AUDIO = 0,              // fifo chunks, crossfade, eq and device
+                                // buffers, the budget caps the chunks
+    MEM_METADATA,               // library table, browse cache, loudness store
+    MEM_IMAGES,
+    MEM_SEARCH,
+    MEM_LOGS,
+    MEM_POOLS
+} mem_pool_t;
+
+/**
+ * Frees at least bytes of a pool if it can, called when a charge would go
+ * over the budget. Runs on the thread that charges.
+ *
+ * @return bytes freed, 0 if nothing is left to give
+ */
+typedef size_t (*mem_evict_t)(size_t bytes, void *userdata);
+
+typedef struct mem_stats_s {
+    size_t used;
+    size_t peak;
+    size_t budget;              // 0 is unlimited
+    unsigned long refused;      // charges that stayed over budget
+    unsigned long evictions;    // times the evictors were asked for memory
+} mem_stats_t;
+
+bool mem_parse_budgets(const char *arg, size_t *budgets);
+void mem_set_budget(mem_pool_t pool, size_t bytes);
+void mem_add_evictor(mem_pool_t pool, mem_evict_t evict, void *userdata);
+void mem_remove_evictor(mem_pool_t pool, mem_evict_t evict, void *userdata);
+void mem_charge(mem_pool_t pool, size_t bytes);
+bool mem_try_charge(mem_pool_t pool, size_t bytes);
+void mem_uncharge(mem_pool_t pool, size_t bytes);
+void mem_charge_part(mem_pool_t pool, size_t *part, size_t bytes);
+bool mem_try_charge_part(mem_pool_t pool, size_t *part, size_t bytes);
+void mem_uncharge_part(mem_pool_t pool, size_t *part, size_t bytes);
+void *mem_alloc(mem_pool_t pool, size_t bytes);
+void *mem_calloc(mem_pool_t pool, size_t n, size_t size);
+void *mem_realloc(mem_pool_t pool, void *ptr, size_t old_bytes, size_t bytes);
+void mem_free(mem_pool_t pool, void *ptr, size_t bytes);
+size_t mem_used(mem_pool_t pool);
+void mem_stats(mem_pool_t pool, mem_stats_t *stats);
+void mem_report();
+
+#endif // SPOTICLI_MEM_H
@@ -49,10 +49,11 @@ queue_t *queue_create()
  * Destroys a queue.
  *
  * @param queue pointer to queue_t
+ * @param destroy called on the data of every element left, may be NULL
  */
-void queue_destroy(queue_t *queue)
+void queue_destroy(queue_t *queue, queue_data_destroy_t destroy)
 {
-    queue_flush(queue);
+    queue_flush(queue, destroy);
 
 #ifdef SPOTICLI_QUEUE_THREAD_SAFE
     pthread_mutex_destroy(&(queue->mutex));
@@ -63,11 +64,13 @@ void queue_destroy(queue_t *queue)
 
 /**
  * Cleans a given queue, meaning it clears and destroys all queue elements and
- * resets the size to zero.
+ * resets the size to zero. The data held by the elements is only freed when
+ * a destroy function is given.
  *
  * @param queue pointer to queue_t
+ * @param destroy called on the data of every element, may be NULL
  */
-void queue_flush(queue_t *queue)
+void queue_flush(queue_t *queue, queue_data_destroy_t destroy)
 {
 #ifdef SPOTICLI_QUEUE_THREAD_SAFE
     pthread_mutex_lock(&(queue->mutex));
@@ -79,9 +82,12 @@ void queue_flush(queue_t *queue)
         temp = curr;
         curr = temp->next;
 
+        if (destroy)
+            destroy(temp->data);
         queue_elem_destroy(temp);
     }
 
+    queue->head = NULL;
     queue->size = 0;
 
 #ifdef SPOTICLI_QUEUE_THREAD_SAFE
@@ -132,8 +138,12 @@ queue_elem_t *queue_dequeue(queue_t *queue)
 #endif
 
     // sanity check
-    if (!queue || queue_is_empty(queue))
+    if (!queue || queue_is_empty(queue)) {
+#ifdef SPOTICLI_QUEUE_THREAD_SAFE
+        pthread_mutex_unlock(&(queue->mutex));
+#endif
         return NULL;
+    }
 
     queue_elem_t *temp = queue->head;
     queue->head = temp->next;
@@ -155,15 +165,19 @@ queue_elem_t *queue_dequeue(queue_t *queue)
  */
 queue_elem_t *queue_peek(queue_t *queue)
 {
+    queue_elem_t *head;
+
 #ifdef SPOTICLI_QUEUE_THREAD_SAFE
     pthread_mutex_lock(&(queue->mutex));
 #endif
 
-    return queue->head;
+    head = queue->head;
 
 #ifdef SPOTICLI_QUEUE_THREAD_SAFE
     pthread_mutex_unlock(&(queue->mutex));
 #endif
+
+    return head;
 }
 
 /**
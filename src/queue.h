@@ -13,6 +13,9 @@ typedef struct queue_elem_s {
     struct queue_elem_s *next;
 } queue_elem_t;
 
+// frees the data held by an element
+typedef void (*queue_data_destroy_t)(void *data);
+
 typedef struct queue_s {
     queue_elem_t *head;
     int size;
@@ -22,8 +25,8 @@ typedef struct queue_s {
 } queue_t;
 
 queue_t *queue_create();
-void queue_destroy(queue_t *queue);
-void queue_flush(queue_t *queue);
+void queue_destroy(queue_t *queue, queue_data_destroy_t destroy);
+void queue_flush(queue_t *queue, queue_data_destroy_t destroy);
 void queue_enqueue(queue_t *queue, void *data);
 queue_elem_t *queue_dequeue(queue_t *queue);
 queue_elem_t *queue_peek(queue_t *queue);
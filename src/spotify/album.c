@@ -0,0 +1,49 @@
+#include "album.h"
+
+extern sp_session *g_session;
+
+
+static void album_browse_complete(sp_albumbrowse *browse, void *request) {
+    browse_complete(request);
+}
+
+static void *album_browse_create(void *album, void *request) {
+    return sp_albumbrowse_create(g_session, album, &album_browse_complete,
+                                 request);
+}
+
+static sp_error album_browse_error(void *browse) {
+    return sp_albumbrowse_error(browse);
+}
+
+static void album_browse_release(void *browse) {
+    sp_albumbrowse_release(browse);
+}
+
+static void album_add_ref(void *album) {
+    sp_album_add_ref(album);
+}
+
+static void album_release(void *album) {
+    sp_album_release(album);
+}
+
+static const browse_ops_t album_browse_ops = {
+    .create      = &album_browse_create,
+    .error       = &album_browse_error,
+    .release     = &album_browse_release,
+    .key_add_ref = &album_add_ref,
+    .key_release = &album_release
+};
+
+/**
+ *  Browses the tracks of an album through the browse scheduler, cb gets the
+ *  sp_albumbrowse. Main thread only.
+ *
+ *  @return false if too many browses are pending
+ */
+bool album_browse(sp_album *album, browse_priority_t priority, int view,
+                  browse_cb_t cb, void *userdata) {
+    return browse_request(&album_browse_ops, album, priority, view,
+                          cb, userdata);
+}
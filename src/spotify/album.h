@@ -1,4 +1,11 @@
 #ifndef SPOTICLI_SPOTIFY_ALBUM_H
 #define SPOTICLI_SPOTIFY_ALBUM_H
 
+#include <libspotify/api.h>
+
+#include "browse.h"
+
+bool album_browse(sp_album *album, browse_priority_t priority, int view,
+                  browse_cb_t cb, void *userdata);
+
 #endif // SPOTICLI_SPOTIFY_ALBUM_H
@@ -0,0 +1,74 @@
+#include "artist.h"
+#include "album.h"
+
+extern sp_session *g_session;
+
+
+static void artist_browse_complete(sp_artistbrowse *browse, void *request) {
+    browse_complete(request);
+}
+
+/**
+ *  Albums only, the tracks of each album are browsed when needed.
+ */
+static void *artist_browse_create(void *artist, void *request) {
+    return sp_artistbrowse_create(g_session, artist, SP_ARTISTBROWSE_NO_TRACKS,
+                                  &artist_browse_complete, request);
+}
+
+static sp_error artist_browse_error(void *browse) {
+    return sp_artistbrowse_error(browse);
+}
+
+static void artist_browse_release(void *browse) {
+    sp_artistbrowse_release(browse);
+}
+
+static void artist_add_ref(void *artist) {
+    sp_artist_add_ref(artist);
+}
+
+static void artist_release(void *artist) {
+    sp_artist_release(artist);
+}
+
+static const browse_ops_t artist_browse_ops = {
+    .create      = &artist_browse_create,
+    .error       = &artist_browse_error,
+    .release     = &artist_browse_release,
+    .key_add_ref = &artist_add_ref,
+    .key_release = &artist_release
+};
+
+/**
+ *  Browses the discography of an artist through the browse scheduler, cb
+ *  gets the sp_artistbrowse. Main thread only.
+ *
+ *  @return false if too many browses are pending
+ */
+bool artist_browse(sp_artist *artist, browse_priority_t priority, int view,
+                   browse_cb_t cb, void *userdata) {
+    return browse_request(&artist_browse_ops, artist, priority, view,
+                          cb, userdata);
+}
+
+/**
+ *  Queues a prefetch browse of every album in a discography, in the order
+ *  listed. They go through the scheduler like any other browse, so only a
+ *  few are in flight at once and a view on screen still comes first.
+ *
+ *  @return number of albums queued
+ */
+int artist_prefetch_albums(sp_artistbrowse *browse, int view,
+                           browse_cb_t cb, void *userdata) {
+    int i;
+    int count = sp_artistbrowse_num_albums(browse);
+
+    for (i = 0; i < count; i++) {
+        if (!album_browse(sp_artistbrowse_album(browse, i), BROWSE_PREFETCH,
+                          view, cb, userdata))
+            break;
+    }
+
+    return i;
+}
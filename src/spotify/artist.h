@@ -1,4 +1,13 @@
 #ifndef SPOTICLI_SPOTIFY_ARTIST_H
 #define SPOTICLI_SPOTIFY_ARTIST_H
 
+#include <libspotify/api.h>
+
+#include "browse.h"
+
+bool artist_browse(sp_artist *artist, browse_priority_t priority, int view,
+                   browse_cb_t cb, void *userdata);
+int artist_prefetch_albums(sp_artistbrowse *browse, int view,
+                           browse_cb_t cb, void *userdata);
+
 #endif // SPOTICLI_SPOTIFY_ARTIST_H
@@ -0,0 +1,347 @@
+#include <string.h>
+
+#include "browse.h"
+#include "mem.h"
+
+#define DEBUG
+#include "debug.h"
+
+
+typedef struct browse_waiter_s {
+    int view;                   // view the browse was requested for
+    browse_cb_t cb;
+    void *userdata;
+} browse_waiter_t;
+
+typedef struct browse_pending_s {
+    const browse_ops_t *ops;    // NULL while the slot is free
+    void *key;                  // holds a reference
+    browse_priority_t priority;
+    unsigned long seq;          // first come first served within a priority
+    bool in_flight;
+    void *browse;               // set once started
+    int nwaiters;
+    browse_waiter_t waiters[BROWSE_MAX_WAITERS];
+} browse_pending_t;
+
+typedef struct browse_entry_s {
+    const browse_ops_t *ops;    // NULL while the entry is free
+    void *key;                  // holds a reference
+    void *browse;               // holds a reference
+    unsigned long used;         // last lookup, the lowest is evicted first
+} browse_entry_t;
+
+// browses queued or in flight, touched from the main thread only
+static browse_pending_t g_pending[BROWSE_MAX_REQUESTS];
+static int g_in_flight;
+static unsigned long g_seq;
+
+// finished browses, least recently used evicted first
+static browse_entry_t g_cache[BROWSE_CACHE_SIZE];
+static unsigned long g_clock;
+// handed to waiters right now, never evicted under them
+static void *g_completing;
+
+
+/**
+ *  Looks up a finished browse and marks it as used.
+ *
+ *  @return entry, NULL if not cached
+ */
+static browse_entry_t *browse_cache_get(const browse_ops_t *ops, void *key) {
+    int i;
+
+    for (i = 0; i < BROWSE_CACHE_SIZE; i++) {
+        if (g_cache[i].ops == ops && g_cache[i].key == key) {
+            g_cache[i].used = ++g_clock;
+            return &g_cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ *  Drops the least recently used browse from the cache.
+ *
+ *  @return bytes given back to MEM_METADATA, 0 if the cache is empty
+ */
+static size_t browse_cache_evict() {
+    browse_entry_t *entry = NULL;
+    int i;
+
+    for (i = 0; i < BROWSE_CACHE_SIZE; i++) {
+        if (g_cache[i].ops && g_cache[i].browse != g_completing &&
+            (entry == NULL || g_cache[i].used < entry->used))
+            entry = &g_cache[i];
+    }
+
+    if (entry == NULL)
+        return 0;
+
+    entry->ops->release(entry->browse);
+    entry->ops->key_release(entry->key);
+    memset(entry, 0, sizeof(browse_entry_t));
+    mem_uncharge(MEM_METADATA, BROWSE_ENTRY_BYTES);
+
+    return BROWSE_ENTRY_BYTES;
+}
+
+/**
+ *  Evictor of MEM_METADATA, gives up cached browses, oldest first.
+ */
+static size_t browse_cache_shrink(size_t bytes, void *userdata) {
+    size_t freed = 0, n;
+
+    while (freed < bytes && (n = browse_cache_evict()) > 0)
+        freed += n;
+
+    return freed;
+}
+
+/**
+ *  Caches a finished browse, taking over the references to key and browse.
+ *  The least recently used entry makes room when the cache is full, and
+ *  when metadata is at its budget.
+ *
+ *  @return false if it wasn't cached, the references are still the caller's
+ */
+static bool browse_cache_put(const browse_ops_t *ops, void *key, void *browse) {
+    browse_entry_t *entry = NULL;
+    int i;
+
+    for (i = 0; i < BROWSE_CACHE_SIZE && g_cache[i].ops; i++)
+        ;
+    if (i == BROWSE_CACHE_SIZE)
+        browse_cache_evict();
+
+    if (!mem_try_charge(MEM_METADATA, BROWSE_ENTRY_BYTES))
+        return false;
+
+    for (i = 0; i < BROWSE_CACHE_SIZE && entry == NULL; i++) {
+        if (g_cache[i].ops == NULL)
+            entry = &g_cache[i];
+    }
+
+    if (entry == NULL) {
+        mem_uncharge(MEM_METADATA, BROWSE_ENTRY_BYTES);
+        return false;
+    }
+
+    entry->ops = ops;
+    entry->key = key;
+    entry->browse = browse;
+    entry->used = ++g_clock;
+
+    return true;
+}
+
+/**
+ *  Frees a pending slot and its reference to the key.
+ */
+static void browse_pending_free(browse_pending_t *pending) {
+    pending->ops->key_release(pending->key);
+    memset(pending, 0, sizeof(browse_pending_t));
+}
+
+/**
+ *  Starts queued browses, visible ones first and otherwise in the order
+ *  they were requested, until BROWSE_MAX_INFLIGHT are in flight.
+ */
+static void browse_dispatch() {
+    browse_pending_t *next;
+    int i;
+
+    while (g_in_flight < BROWSE_MAX_INFLIGHT) {
+        next = NULL;
+
+        for (i = 0; i < BROWSE_MAX_REQUESTS; i++) {
+            if (g_pending[i].ops == NULL || g_pending[i].in_flight)
+                continue;
+
+            if (next == NULL || g_pending[i].priority > next->priority ||
+                (g_pending[i].priority == next->priority &&
+                 g_pending[i].seq < next->seq))
+                next = &g_pending[i];
+        }
+
+        if (next == NULL)
+            return;
+
+        next->in_flight = true;
+        g_in_flight++;
+        next->browse = next->ops->create(next->key, next);
+    }
+}
+
+/**
+ *  Requests a browse of key for a view. A cached browse is handed to cb
+ *  right away. A browse already queued or in flight for the same key is
+ *  shared, and raised to the higher priority of the two. Otherwise it is
+ *  queued, and started once fewer than BROWSE_MAX_INFLIGHT are in flight,
+ *  so a view asking for hundreds at once never floods libspotify. Main
+ *  thread only.
+ *
+ *  @return false if too many browses are pending
+ */
+bool browse_request(const browse_ops_t *ops, void *key,
+                    browse_priority_t priority, int view,
+                    browse_cb_t cb, void *userdata) {
+    browse_pending_t *pending = NULL;
+    browse_entry_t *entry;
+    browse_waiter_t *waiter;
+    int i;
+
+    if ((entry = browse_cache_get(ops, key))) {
+        cb(entry->browse, userdata);
+        return true;
+    }
+
+    for (i = 0; i < BROWSE_MAX_REQUESTS; i++) {
+        if (g_pending[i].ops == ops && g_pending[i].key == key) {
+            pending = &g_pending[i];
+            break;
+        }
+    }
+
+    if (pending == NULL) {
+        for (i = 0; i < BROWSE_MAX_REQUESTS && g_pending[i].ops; i++)
+            ;
+
+        if (i == BROWSE_MAX_REQUESTS) {
+            debug("browse queue full\n");
+            return false;
+        }
+
+        pending = &g_pending[i];
+        pending->ops = ops;
+        pending->key = key;
+        pending->priority = priority;
+        pending->seq = ++g_seq;
+        ops->key_add_ref(key);
+    }
+
+    if (pending->nwaiters == BROWSE_MAX_WAITERS)
+        return false;
+
+    waiter = &pending->waiters[pending->nwaiters++];
+    waiter->view = view;
+    waiter->cb = cb;
+    waiter->userdata = userdata;
+
+    if (priority > pending->priority)
+        pending->priority = priority;
+
+    browse_dispatch();
+    return true;
+}
+
+/**
+ *  Lets the browse cache give memory back when metadata is over budget.
+ */
+void browse_init() {
+    mem_add_evictor(MEM_METADATA, &browse_cache_shrink, NULL);
+}
+
+/**
+ *  Finishes a browse, called from the completion callback of the ops that
+ *  started it. A successful browse is cached, including when every view
+ *  waiting for it went away, a failed one is only handed to the waiters.
+ */
+void browse_complete(void *request) {
+    browse_pending_t *pending = (browse_pending_t *) request;
+    browse_waiter_t waiters[BROWSE_MAX_WAITERS];
+    const browse_ops_t *ops = pending->ops;
+    void *key = pending->key;
+    void *browse = pending->browse;
+    int nwaiters = pending->nwaiters;
+    bool cached = false;
+    int i;
+
+    // free the slot first, waiters may request more browses
+    memcpy(waiters, pending->waiters, sizeof(waiters));
+    memset(pending, 0, sizeof(browse_pending_t));
+    g_in_flight--;
+
+    if (ops->error(browse) == SP_ERROR_OK)
+        cached = browse_cache_put(ops, key, browse);
+
+    g_completing = browse;
+    for (i = 0; i < nwaiters; i++)
+        waiters[i].cb(browse, waiters[i].userdata);
+    g_completing = NULL;
+
+    if (!cached) {
+        ops->release(browse);
+        ops->key_release(key);
+    }
+
+    browse_dispatch();
+}
+
+/**
+ *  Marks what a view waits for as visible and everything else as prefetch,
+ *  call it whenever the view on screen changes.
+ */
+void browse_focus(int view) {
+    int i, w;
+
+    for (i = 0; i < BROWSE_MAX_REQUESTS; i++) {
+        if (g_pending[i].ops == NULL)
+            continue;
+
+        g_pending[i].priority = BROWSE_PREFETCH;
+        for (w = 0; w < g_pending[i].nwaiters; w++) {
+            if (g_pending[i].waiters[w].view == view)
+                g_pending[i].priority = BROWSE_VISIBLE;
+        }
+    }
+}
+
+/**
+ *  Forgets every browse a view waits for, its callbacks are never called.
+ *  Queued browses nobody else waits for are dropped, those in flight are
+ *  still cached when they finish.
+ */
+void browse_cancel(int view) {
+    browse_pending_t *pending;
+    int i, w, kept;
+
+    for (i = 0; i < BROWSE_MAX_REQUESTS; i++) {
+        pending = &g_pending[i];
+        if (pending->ops == NULL)
+            continue;
+
+        for (w = 0, kept = 0; w < pending->nwaiters; w++) {
+            if (pending->waiters[w].view != view)
+                pending->waiters[kept++] = pending->waiters[w];
+        }
+        pending->nwaiters = kept;
+
+        if (kept == 0 && !pending->in_flight)
+            browse_pending_free(pending);
+    }
+}
+
+/**
+ *  Drops every pending and cached browse, call before the session is
+ *  released.
+ */
+void browse_release() {
+    int i;
+
+    mem_remove_evictor(MEM_METADATA, &browse_cache_shrink, NULL);
+
+    for (i = 0; i < BROWSE_MAX_REQUESTS; i++) {
+        if (g_pending[i].ops == NULL)
+            continue;
+
+        if (g_pending[i].in_flight)
+            g_pending[i].ops->release(g_pending[i].browse);
+        browse_pending_free(&g_pending[i]);
+    }
+    g_in_flight = 0;
+
+    while (browse_cache_evict() > 0)
+        ;
+}
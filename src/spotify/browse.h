@@ -0,0 +1,43 @@
+#ifndef SPOTICLI_SPOTIFY_BROWSE_H
+#define SPOTICLI_SPOTIFY_BROWSE_H
+
+#include <stdbool.h>
+#include <libspotify/api.h>
+
+#define BROWSE_MAX_INFLIGHT 4       // browses libspotify works on at once
+#define BROWSE_MAX_REQUESTS 512     // queued and in flight
+#define BROWSE_MAX_WAITERS  4       // views waiting on the same browse
+#define BROWSE_CACHE_SIZE   64      // completed browses kept
+#define BROWSE_ENTRY_BYTES  (32 * 1024) // guess at what libspotify keeps per browse
+
+typedef enum browse_priority_e {
+    BROWSE_PREFETCH = 0,        // might be looked at soon
+    BROWSE_VISIBLE              // on screen right now
+} browse_priority_t;
+
+// gets the finished browse, valid until the callback returns
+typedef void (*browse_cb_t)(void *browse, void *userdata);
+
+/**
+ *  One kind of browse, e.g. albums. create() starts a browse of key whose
+ *  completion callback must call browse_complete() with request. Keys are
+ *  the libspotify objects browsed and are reference counted.
+ */
+typedef struct browse_ops_s {
+    void *(*create)(void *key, void *request);
+    sp_error (*error)(void *browse);
+    void (*release)(void *browse);
+    void (*key_add_ref)(void *key);
+    void (*key_release)(void *key);
+} browse_ops_t;
+
+bool browse_request(const browse_ops_t *ops, void *key,
+                    browse_priority_t priority, int view,
+                    browse_cb_t cb, void *userdata);
+void browse_init();
+void browse_complete(void *request);
+void browse_focus(int view);
+void browse_cancel(int view);
+void browse_release();
+
+#endif // SPOTICLI_SPOTIFY_BROWSE_H
@@ -0,0 +1,582 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "mem.h"
+#include "audio/rt.h"
+#include "debug.h"
+
+
+#define HISTORY_MAGIC       "SCH1"  // format tag and version
+#define HISTORY_HEADER      4
+#define HISTORY_MIN_ROWS    1024
+#define HISTORY_MIN_IDS     256
+
+
+/**
+ * Folded FNV-1a over every byte of a record before its check.
+ *
+ * @param record history_record_t
+ *
+ * @return check
+ */
+static uint16_t history_check(const history_record_t *record)
+{
+    const uint8_t *bytes = (const uint8_t *) record;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < offsetof(history_record_t, check); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return (uint16_t) (hash ^ (hash >> 16));
+}
+
+/**
+ * FNV-1a hash of a nul terminated id.
+ */
+static uint32_t history_hash(const char *id)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *id; id++) {
+        hash ^= (uint8_t) *id;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Doubles the hash of an id map and inserts every id again.
+ */
+static void history_ids_rehash(history_ids_t *ids)
+{
+    uint32_t nslots = ids->nslots ? ids->nslots * 2 : HISTORY_MIN_IDS * 2;
+    uint32_t i, slot;
+
+    mem_free(MEM_METADATA, ids->slots, ids->nslots * sizeof(uint32_t));
+    ids->slots = mem_calloc(MEM_METADATA, nslots, sizeof(uint32_t));
+    ids->nslots = nslots;
+
+    for (i = 0; i < ids->count; i++) {
+        slot = history_hash(ids->ids[i]) & (nslots - 1);
+        while (ids->slots[slot])
+            slot = (slot + 1) & (nslots - 1);
+        ids->slots[slot] = i + 1;
+    }
+}
+
+/**
+ * Returns the dense number of an id, adding it if it is new. An id of
+ * zeros is the empty id.
+ *
+ * @param ids history_ids_t
+ * @param id HISTORY_ID_SIZE characters, not nul terminated
+ *
+ * @return dense id
+ */
+static uint32_t history_ids_intern(history_ids_t *ids, const char *id)
+{
+    char key[HISTORY_ID_SIZE + 1];
+    uint32_t slot, capacity;
+
+    memcpy(key, id, HISTORY_ID_SIZE);
+    key[HISTORY_ID_SIZE] = '\0';
+
+    if ((ids->count + 1) * 2 > ids->nslots)
+        history_ids_rehash(ids);
+
+    slot = history_hash(key) & (ids->nslots - 1);
+    while (ids->slots[slot]) {
+        if (strcmp(ids->ids[ids->slots[slot] - 1], key) == 0)
+            return ids->slots[slot] - 1;
+        slot = (slot + 1) & (ids->nslots - 1);
+    }
+
+    if (ids->count == ids->capacity) {
+        capacity = ids->capacity ? ids->capacity * 2 : HISTORY_MIN_IDS;
+        ids->ids = mem_realloc(MEM_METADATA, ids->ids,
+                               ids->capacity * sizeof(*ids->ids),
+                               capacity * sizeof(*ids->ids));
+        ids->capacity = capacity;
+    }
+
+    memcpy(ids->ids[ids->count], key, sizeof(key));
+    ids->slots[slot] = ids->count + 1;
+
+    return ids->count++;
+}
+
+/**
+ * Frees an id map.
+ */
+static void history_ids_release(history_ids_t *ids)
+{
+    mem_free(MEM_METADATA, ids->ids, ids->capacity * sizeof(*ids->ids));
+    mem_free(MEM_METADATA, ids->slots, ids->nslots * sizeof(uint32_t));
+    memset(ids, 0, sizeof(history_ids_t));
+}
+
+/**
+ * Grows a column of the index from one row count to another.
+ */
+static void *history_grow(void *column, size_t size, uint32_t from, uint32_t to)
+{
+    return mem_realloc(MEM_METADATA, column, from * size, to * size);
+}
+
+/**
+ * Adds a play to the end of the index.
+ *
+ * @param history history_t
+ * @param record history_record_t
+ */
+static void history_index(history_t *history, const history_record_t *record)
+{
+    uint32_t row = history->count;
+    uint32_t capacity;
+
+    if (row == history->capacity) {
+        capacity = history->capacity ? history->capacity * 2 : HISTORY_MIN_ROWS;
+        history->started = history_grow(history->started, sizeof(uint32_t),
+                                         history->capacity, capacity);
+        history->track = history_grow(history->track, sizeof(uint32_t),
+                                      history->capacity, capacity);
+        history->artist = history_grow(history->artist, sizeof(uint32_t),
+                                       history->capacity, capacity);
+        history->played_ms = history_grow(history->played_ms, sizeof(uint32_t),
+                                          history->capacity, capacity);
+        history->skipped = history_grow(history->skipped, sizeof(uint8_t),
+                                        history->capacity, capacity);
+        history->capacity = capacity;
+    }
+
+    // a clock set back would break bisecting, such a play counts as
+    // starting with the one before
+    history->started[row] = record->started;
+    if (row > 0 && record->started < history->started[row - 1])
+        history->started[row] = history->started[row - 1];
+
+    history->track[row] = history_ids_intern(&history->tracks, record->track);
+    history->artist[row] = history_ids_intern(&history->artists, record->artist);
+    history->played_ms[row] = record->played_ms;
+    history->skipped[row] = (record->flags & HISTORY_SKIPPED) != 0;
+    history->count++;
+}
+
+/**
+ * Cuts the file back to whole records after a torn write.
+ */
+static void history_truncate(history_t *history)
+{
+    struct stat st;
+    off_t whole;
+
+    if (fstat(history->fd, &st) < 0 || st.st_size < HISTORY_HEADER)
+        return;
+
+    whole = HISTORY_HEADER + (st.st_size - HISTORY_HEADER) /
+            sizeof(history_record_t) * sizeof(history_record_t);
+    if (whole != st.st_size && ftruncate(history->fd, whole) < 0)
+        log_warning("%s: %s\n", history->path, strerror(errno));
+}
+
+/**
+ * Appends pending plays to the file in one write each time it wakes up and
+ * syncs them, off the main loop.
+ *
+ * @param arg history_t
+ */
+static void *history_writer(void *arg)
+{
+    history_t *history = (history_t *) arg;
+    history_record_t records[HISTORY_PENDING];
+    size_t size;
+    int n;
+
+    pthread_mutex_lock(&history->mutex);
+
+    while (true) {
+        while (history->npending == 0 && history->running)
+            pthread_cond_wait(&history->cond, &history->mutex);
+
+        if (history->npending == 0)
+            break;
+
+        n = history->npending;
+        memcpy(records, history->pending, n * sizeof(history_record_t));
+        history->npending = 0;
+
+        pthread_mutex_unlock(&history->mutex);
+
+        // O_APPEND, the batch lands at the end in one piece or is torn
+        size = n * sizeof(history_record_t);
+        if (write(history->fd, records, size) != (ssize_t) size) {
+            log_warning("%s: unable to record %d plays\n", history->path, n);
+            history_truncate(history);
+        }
+        fdatasync(history->fd);
+
+        pthread_mutex_lock(&history->mutex);
+    }
+
+    pthread_mutex_unlock(&history->mutex);
+
+    return NULL;
+}
+
+/**
+ * Indexes every play of the file through a read only mapping. Damaged
+ * records are skipped and a torn one at the end is cut off, so appends
+ * stay aligned.
+ *
+ * @param history history_t
+ * @param size file size
+ *
+ * @return false if the file isn't a play history
+ */
+static bool history_load(history_t *history, size_t size)
+{
+    const history_record_t *records;
+    size_t nrecords, i, damaged = 0;
+    char *map;
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, history->fd, 0);
+    if (map == MAP_FAILED) {
+        log_warning("%s: %s\n", history->path, strerror(errno));
+        return true;
+    }
+
+    if (memcmp(map, HISTORY_MAGIC, HISTORY_HEADER) != 0) {
+        munmap(map, size);
+        return false;
+    }
+
+    // only read sequentially, once
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    records = (const history_record_t *) (map + HISTORY_HEADER);
+    nrecords = (size - HISTORY_HEADER) / sizeof(history_record_t);
+
+    for (i = 0; i < nrecords; i++) {
+        if (records[i].check == history_check(&records[i]))
+            history_index(history, &records[i]);
+        else
+            damaged++;
+    }
+
+    munmap(map, size);
+
+    if (damaged > 0)
+        log_warning("%s: %zu damaged plays skipped\n", history->path, damaged);
+
+    history_truncate(history);
+
+    return true;
+}
+
+/**
+ * Moves a file that isn't a history this version reads out of the way,
+ * e.g. one written by a newer version or with a damaged header, so it is
+ * kept for recovery instead of overwritten.
+ *
+ * @return false if it couldn't be moved
+ */
+static bool history_set_aside(history_t *history)
+{
+    char aside[PATH_MAX];
+
+    snprintf(aside, sizeof(aside), "%s.bad-%ld", history->path,
+             (long) time(NULL));
+    if (rename(history->path, aside) < 0) {
+        log_warning("%s: not a play history and can't be moved aside: %s\n",
+                    history->path, strerror(errno));
+        return false;
+    }
+
+    log_warning("%s: not a play history, moved to %s, starting over\n",
+                history->path, aside);
+    return true;
+}
+
+/**
+ * Loads the history and starts recording to it, a missing file starts an
+ * empty history. A file that isn't a history is moved aside and a new one
+ * started.
+ *
+ * @param history history_t
+ * @param path history file
+ *
+ * @return false if plays can't be saved, the index still works
+ */
+bool history_open(history_t *history, const char *path)
+{
+    struct stat st;
+
+    memset(history, 0, sizeof(history_t));
+    history->path = strdup(path);
+    pthread_mutex_init(&history->mutex, NULL);
+    pthread_cond_init(&history->cond, NULL);
+
+    history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history->fd < 0) {
+        log_warning("%s: plays won't be recorded: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (fstat(history->fd, &st) == 0 && st.st_size >= HISTORY_HEADER &&
+        !history_load(history, st.st_size)) {
+        close(history->fd);
+        history->fd = -1;
+
+        if (!history_set_aside(history))
+            return false;
+
+        history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                           0600);
+        if (history->fd < 0) {
+            log_warning("%s: plays won't be recorded: %s\n", path,
+                        strerror(errno));
+            return false;
+        }
+        st.st_size = 0;
+    }
+
+    if (st.st_size < HISTORY_HEADER &&
+        (ftruncate(history->fd, 0) < 0 ||
+         write(history->fd, HISTORY_MAGIC, HISTORY_HEADER) != HISTORY_HEADER)) {
+        log_warning("%s: plays won't be recorded: %s\n", path, strerror(errno));
+        close(history->fd);
+        history->fd = -1;
+        return false;
+    }
+
+    history->running = true;
+    pthread_create(&history->writer, NULL, history_writer, history);
+    rt_thread_name(history->writer, "history");
+
+    return true;
+}
+
+/**
+ * Writes out the plays still pending and frees the index.
+ *
+ * @param history history_t
+ */
+void history_close(history_t *history)
+{
+    if (history->fd >= 0) {
+        pthread_mutex_lock(&history->mutex);
+        history->running = false;
+        pthread_cond_signal(&history->cond);
+        pthread_mutex_unlock(&history->mutex);
+
+        pthread_join(history->writer, NULL);
+        close(history->fd);
+    }
+
+    pthread_mutex_destroy(&history->mutex);
+    pthread_cond_destroy(&history->cond);
+
+    mem_free(MEM_METADATA, history->started, history->capacity * sizeof(uint32_t));
+    mem_free(MEM_METADATA, history->track, history->capacity * sizeof(uint32_t));
+    mem_free(MEM_METADATA, history->artist, history->capacity * sizeof(uint32_t));
+    mem_free(MEM_METADATA, history->played_ms, history->capacity * sizeof(uint32_t));
+    mem_free(MEM_METADATA, history->skipped, history->capacity);
+    mem_free(MEM_METADATA, history->scratch, history->scratch_size * sizeof(uint32_t));
+    mem_free(MEM_METADATA, history->scratch_ms, history->scratch_size * sizeof(uint64_t));
+    history_ids_release(&history->tracks);
+    history_ids_release(&history->artists);
+
+    free(history->path);
+    memset(history, 0, sizeof(history_t));
+    history->fd = -1;
+}
+
+/**
+ * Records a play. It is indexed right away and written to the file by the
+ * writer thread, the check is filled in here.
+ *
+ * @param history history_t
+ * @param record history_record_t
+ */
+void history_append(history_t *history, const history_record_t *record)
+{
+    history_record_t stored = *record;
+
+    stored.check = history_check(&stored);
+    history_index(history, &stored);
+
+    if (history->fd < 0)
+        return;
+
+    pthread_mutex_lock(&history->mutex);
+
+    if (history->npending < HISTORY_PENDING) {
+        history->pending[history->npending++] = stored;
+        pthread_cond_signal(&history->cond);
+    } else {
+        log_warning("%s: disk too slow, play not recorded\n", history->path);
+    }
+
+    pthread_mutex_unlock(&history->mutex);
+}
+
+/**
+ * Returns the first row that started at or after time.
+ */
+static uint32_t history_bisect(const history_t *history, uint32_t time)
+{
+    uint32_t lo = 0, hi = history->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (history->started[mid] < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Returns whether a count ranks above another, by plays and then by time
+ * played.
+ */
+static bool history_ranks_above(uint32_t plays, uint64_t played_ms,
+                                const history_count_t *other)
+{
+    return plays > other->plays ||
+           (plays == other->plays && played_ms > other->played_ms);
+}
+
+/**
+ * Counts the plays of every id of a column over a period into the scratch
+ * arrays and keeps the n that were played most.
+ *
+ * @return number of counts in top
+ */
+static int history_top(history_t *history, const uint32_t *column,
+                       const history_ids_t *ids, uint32_t from, uint32_t to,
+                       history_count_t *top, int n)
+{
+    uint32_t lo = history_bisect(history, from);
+    uint32_t hi = history_bisect(history, to);
+    uint32_t row, id;
+    int count = 0, pos;
+
+    if (n <= 0)
+        return 0;
+
+    if (history->scratch_size < ids->capacity) {
+        history->scratch = history_grow(history->scratch, sizeof(uint32_t),
+                                        history->scratch_size, ids->capacity);
+        history->scratch_ms = history_grow(history->scratch_ms, sizeof(uint64_t),
+                                           history->scratch_size, ids->capacity);
+        history->scratch_size = ids->capacity;
+    }
+
+    memset(history->scratch, 0, ids->count * sizeof(uint32_t));
+    memset(history->scratch_ms, 0, ids->count * sizeof(uint64_t));
+
+    for (row = lo; row < hi; row++) {
+        id = column[row];
+        history->scratch[id] += !history->skipped[row];
+        history->scratch_ms[id] += history->played_ms[row];
+    }
+
+    // insertion into the n best so far, n is a screenful
+    for (id = 0; id < ids->count; id++) {
+        if (history->scratch[id] == 0 || ids->ids[id][0] == '\0')
+            continue;
+
+        if (count == n && !history_ranks_above(history->scratch[id],
+                                               history->scratch_ms[id],
+                                               &top[n - 1]))
+            continue;
+
+        pos = count < n ? count++ : n - 1;
+        while (pos > 0 && history_ranks_above(history->scratch[id],
+                                              history->scratch_ms[id],
+                                              &top[pos - 1])) {
+            top[pos] = top[pos - 1];
+            pos--;
+        }
+
+        memcpy(top[pos].id, ids->ids[id], sizeof(top[pos].id));
+        top[pos].plays = history->scratch[id];
+        top[pos].played_ms = history->scratch_ms[id];
+    }
+
+    return count;
+}
+
+/**
+ * Returns the tracks played most in a period, skipped plays don't count.
+ *
+ * @param history history_t
+ * @param from unix time the period starts at
+ * @param to unix time the period ends before
+ * @param top filled with the n tracks played most, most first
+ * @param n size of top
+ *
+ * @return number of tracks in top
+ */
+int history_top_tracks(history_t *history, uint32_t from, uint32_t to,
+                       history_count_t *top, int n)
+{
+    return history_top(history, history->track, &history->tracks,
+                       from, to, top, n);
+}
+
+/**
+ * Returns the artists played most in a period, see history_top_tracks().
+ */
+int history_top_artists(history_t *history, uint32_t from, uint32_t to,
+                        history_count_t *top, int n)
+{
+    return history_top(history, history->artist, &history->artists,
+                       from, to, top, n);
+}
+
+/**
+ * Returns the last plays, the latest first.
+ *
+ * @param history history_t
+ * @param plays filled in
+ * @param n size of plays
+ *
+ * @return number of plays filled in
+ */
+int history_recent(history_t *history, history_play_t *plays, int n)
+{
+    uint32_t row;
+    int i;
+
+    for (i = 0; i < n && (uint32_t) i < history->count; i++) {
+        row = history->count - 1 - i;
+
+        memcpy(plays[i].track, history->tracks.ids[history->track[row]],
+               sizeof(plays[i].track));
+        memcpy(plays[i].artist, history->artists.ids[history->artist[row]],
+               sizeof(plays[i].artist));
+        plays[i].started = history->started[row];
+        plays[i].played_ms = history->played_ms[row];
+        plays[i].skipped = history->skipped[row];
+    }
+
+    return i;
+}
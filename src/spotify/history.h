@@ -0,0 +1,101 @@
+#ifndef SPOTICLI_SPOTIFY_HISTORY_H
+#define SPOTICLI_SPOTIFY_HISTORY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HISTORY_ID_SIZE     22      // base62 spotify id
+#define HISTORY_PENDING     256     // plays waiting for the writer thread
+
+#define HISTORY_SKIPPED     0x0001  // moved on before the track ended
+
+/**
+ * One play as stored on disk, 64 bytes. Records are only ever appended, a
+ * torn or corrupt record is detected by its check and dropped on open.
+ */
+typedef struct __attribute__((packed)) history_record_s {
+    char track[HISTORY_ID_SIZE];    // not nul terminated
+    char artist[HISTORY_ID_SIZE];   // first artist, zeros when unknown
+    uint32_t started;               // unix time
+    uint32_t ended;
+    uint32_t played_ms;             // heard, pauses excluded
+    uint32_t duration_ms;           // of the whole track
+    uint16_t flags;                 // HISTORY_SKIPPED
+    uint16_t check;                 // over every byte before it
+} history_record_t;
+
+/**
+ * Distinct ids mapped to dense numbers, so the index counts into plain
+ * arrays.
+ */
+typedef struct history_ids_s {
+    char (*ids)[HISTORY_ID_SIZE + 1];
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *slots;            // open addressing hash, id + 1, 0 when empty
+    uint32_t nslots;            // power of two, at least twice count
+} history_ids_t;
+
+/**
+ * Plays of a track or artist over a period. Ids are copied out of the
+ * index, whose ids move when a new one is appended.
+ */
+typedef struct history_count_s {
+    char id[HISTORY_ID_SIZE + 1];   // nul terminated
+    uint32_t plays;             // skipped plays don't count
+    uint64_t played_ms;         // skipped plays included
+} history_count_t;
+
+/**
+ * A play as history_recent() returns it, ids copied like history_count_t.
+ */
+typedef struct history_play_s {
+    char track[HISTORY_ID_SIZE + 1];
+    char artist[HISTORY_ID_SIZE + 1];   // empty when unknown
+    uint32_t started;
+    uint32_t played_ms;
+    bool skipped;
+} history_play_t;
+
+/**
+ * Play history. Plays are appended to the index right away and handed to
+ * a writer thread, which appends them to the file and syncs it, so the
+ * main loop never waits on the disk. The index keeps one row per play as
+ * columns, in the order played, and answers every query. Not thread safe
+ * apart from the writer.
+ */
+typedef struct history_s {
+    char *path;
+    int fd;                     // opened for appending, -1 when read only
+    pthread_t writer;
+    pthread_mutex_t mutex;      // guards pending and running
+    pthread_cond_t cond;
+    history_record_t pending[HISTORY_PENDING];
+    int npending;
+    bool running;
+
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *started;          // never decreasing, so periods bisect
+    uint32_t *track;            // dense ids
+    uint32_t *artist;
+    uint32_t *played_ms;
+    uint8_t *skipped;
+    history_ids_t tracks;
+    history_ids_t artists;
+    uint32_t *scratch;          // per id counts of a query
+    uint64_t *scratch_ms;
+    uint32_t scratch_size;
+} history_t;
+
+bool history_open(history_t *history, const char *path);
+void history_close(history_t *history);
+void history_append(history_t *history, const history_record_t *record);
+int history_top_tracks(history_t *history, uint32_t from, uint32_t to,
+                       history_count_t *top, int n);
+int history_top_artists(history_t *history, uint32_t from, uint32_t to,
+                        history_count_t *top, int n);
+int history_recent(history_t *history, history_play_t *plays, int n);
+
+#endif // SPOTICLI_SPOTIFY_HISTORY_H
@@ -0,0 +1,65 @@
+#include "library.h"
+
+// the user's tracks, touched from the main thread only
+static track_table_t g_library;
+
+
+/**
+ *  Sets up an empty library. Nothing calls library_add() yet, loading the
+ *  playlists into it is still to be written, until then only
+ *  spoticli-bench exercises the table.
+ */
+void library_init() {
+    track_table_init(&g_library);
+}
+
+/**
+ *  Adds a loaded track to the library, which keeps a reference to it until
+ *  library_release(). Only the first artist of a track is searched and
+ *  sorted by.
+ *
+ *  @param added unix time the track was added, e.g. to a playlist
+ *  @return row of the track, TRACK_NONE if metadata is at its budget
+ */
+uint32_t library_add(sp_track *track, uint32_t added) {
+    sp_artist *artist = sp_track_num_artists(track) > 0 ?
+        sp_track_artist(track, 0) : NULL;
+    sp_album *album = sp_track_album(track);
+    uint32_t row;
+
+    row = track_table_add(&g_library, sp_track_name(track),
+                          artist ? sp_artist_name(artist) : "",
+                          album ? sp_album_name(album) : "",
+                          sp_track_duration(track), added, track);
+    if (row != TRACK_NONE)
+        sp_track_add_ref(track);
+
+    return row;
+}
+
+/**
+ *  Returns the table views sort and filter.
+ */
+track_table_t *library_table() {
+    return &g_library;
+}
+
+/**
+ *  Returns the track of a row, e.g. library_table()->view[i].
+ */
+sp_track *library_track(uint32_t row) {
+    return g_library.refs[row];
+}
+
+/**
+ *  Releases every track, call before the session is released.
+ */
+void library_release() {
+    uint32_t i;
+
+    for (i = 0; i < g_library.count; i++)
+        sp_track_release(g_library.refs[i]);
+
+    track_table_release(&g_library);
+    track_table_init(&g_library);
+}
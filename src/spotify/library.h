@@ -1,4 +1,14 @@
 #ifndef SPOTICLI_SPOTIFY_LIBRARY_H
 #define SPOTICLI_SPOTIFY_LIBRARY_H
 
+#include <libspotify/api.h>
+
+#include "track.h"
+
+void library_init();
+uint32_t library_add(sp_track *track, uint32_t added);
+track_table_t *library_table();
+sp_track *library_track(uint32_t row);
+void library_release();
+
 #endif // SPOTICLI_SPOTIFY_LIBRARY_H
@@ -1,32 +1,527 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include "player.h"
+#include "library.h"
+#include "state.h"
 #include "audio.h"
+#include "audio/loudness_store.h"
+#include "config.h"
+#include "debug.h"
+
+#define TRACK_URI_PREFIX "spotify:track:"
+#define ARTIST_URI_PREFIX "spotify:artist:"
+#define PLAYER_QUEUE_SIZE 256   // tracks queued to play next
+#define PLAYER_DRAIN_MS   50    // retry interval while the end is drained
+#define PLAYER_SAVE_MS    10000 // state is saved this often while it changes
 
 extern sp_session *g_session;
 extern audio_fifo_t g_audio_fifo;
+extern config_t g_config;
+
+// measured loudness of every track played
+static loudness_store_t g_loudness_store;
+// id of the track being measured, empty when none is
+static char g_track_id[LOUDNESS_ID_SIZE + 1];
+
+// every play, and the one in progress, track is zeros when none is
+static history_t g_history;
+static history_record_t g_play;
+// ms heard of the play before its last pause, and when it last resumed
+static uint64_t g_play_ms;
+static uint64_t g_play_resumed;     // 0 while paused
+
+// tracks played once the loaded one ends, each holds a reference
+static sp_track *g_queue[PLAYER_QUEUE_SIZE];
+static int g_queue_head;
+static int g_queue_count;
+// a track is loaded, the next one may be prefetched
+static bool g_loaded;
+// the end of the last track is still being handed to the fifo
+static bool g_draining;
+
+// tracks of the last run, played once logged in, each holds a reference
+static sp_track *g_resume[STATE_MAX_TRACKS];
+static int g_resume_count;
+static bool g_resume_current;       // g_resume[0] was loaded, the rest queued
+static bool g_resume_paused;
+static uint32_t g_resume_position;
+static bool g_logged_in;
+// state saved last and when, an unchanged state isn't saved again
+static state_t g_saved;
+static uint64_t g_saved_time;
+
+/**
+ *  Writes the base62 id of a track to id, local tracks have none.
+ *
+ *  @return true if the track has an id
+ */
+static bool player_track_id(sp_track *track, char *id, size_t size) {
+    char uri[64];
+    sp_link *link = sp_link_create_from_track(track, 0);
+
+    if (link == NULL)
+        return false;
+
+    sp_link_as_string(link, uri, sizeof(uri));
+    sp_link_release(link);
+
+    if (strncmp(uri, TRACK_URI_PREFIX, strlen(TRACK_URI_PREFIX)) != 0)
+        return false;
+
+    snprintf(id, size, "%s", uri + strlen(TRACK_URI_PREFIX));
+    return strlen(id) == LOUDNESS_ID_SIZE;
+}
+
+/**
+ *  Saves what was measured of the current track. A track's first play is
+ *  only measured, the normalization applies from its next play on.
+ */
+static void player_track_done() {
+    loudness_result_t result;
+
+    if (g_track_id[0] == '\0')
+        return;
+
+    audio_fifo_loudness(&g_audio_fifo, &result);
+    loudness_store_put(&g_loudness_store, g_track_id, &result);
+
+    g_track_id[0] = '\0';
+}
+
+/**
+ *  Returns the normalization gain for a track, unity when normalization is
+ *  off or the track was never measured. Remembers the track for measuring.
+ */
+static float player_track_gain(sp_track *track) {
+    loudness_result_t result;
+
+    if (!player_track_id(track, g_track_id, sizeof(g_track_id))) {
+        g_track_id[0] = '\0';
+        return 1.0f;
+    }
+
+    if (!g_config.normalize ||
+        !loudness_store_get(&g_loudness_store, g_track_id, &result))
+        return 1.0f;
+
+    return loudness_gain(&result, g_config.loudness_target);
+}
+
+/**
+ *  Returns a monotonic clock in milliseconds.
+ */
+static uint64_t player_now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ *  Starts timing a play of a track for the history, local tracks have no
+ *  id and aren't recorded.
+ */
+static void player_play_begin(sp_track *track) {
+    char id[64];
+    sp_artist *artist = sp_track_num_artists(track) > 0 ?
+                        sp_track_artist(track, 0) : NULL;
+    sp_link *link;
+
+    memset(&g_play, 0, sizeof(history_record_t));
+
+    if (!player_track_id(track, id, sizeof(id)))
+        return;
+    memcpy(g_play.track, id, HISTORY_ID_SIZE);
+
+    link = artist ? sp_link_create_from_artist(artist) : NULL;
+    if (link) {
+        sp_link_as_string(link, id, sizeof(id));
+        sp_link_release(link);
+
+        if (strncmp(id, ARTIST_URI_PREFIX, strlen(ARTIST_URI_PREFIX)) == 0 &&
+            strlen(id + strlen(ARTIST_URI_PREFIX)) == HISTORY_ID_SIZE)
+            memcpy(g_play.artist, id + strlen(ARTIST_URI_PREFIX),
+                   HISTORY_ID_SIZE);
+    }
+
+    g_play.started = time(NULL);
+    g_play.duration_ms = sp_track_duration(track);
+    g_play_ms = 0;
+    g_play_resumed = player_now_ms();
+}
+
+/**
+ *  Records the play in progress in the history. Time is counted from when
+ *  libspotify starts and stops delivering the track, pauses excluded.
+ *
+ *  @param skipped the listener moved on before the track ended
+ */
+static void player_play_end(bool skipped) {
+    if (g_play.track[0] == '\0')
+        return;
+
+    if (g_play_resumed)
+        g_play_ms += player_now_ms() - g_play_resumed;
+
+    g_play.ended = time(NULL);
+    g_play.played_ms = g_play_ms < g_play.duration_ms ?
+                       g_play_ms : g_play.duration_ms;
+    g_play.flags = skipped ? HISTORY_SKIPPED : 0;
+    history_append(&g_history, &g_play);
+
+    memset(&g_play, 0, sizeof(history_record_t));
+    g_play_resumed = 0;
+}
+
+/**
+ *  Prefetches the first queued track and lets the fifo hold back the end of
+ *  the loaded one for the transition.
+ */
+static void player_arm_next() {
+    bool queued = g_loaded && g_queue_count > 0;
+
+    if (queued)
+        sp_session_player_prefetch(g_session, g_queue[g_queue_head]);
+
+    audio_fifo_set_next(&g_audio_fifo, queued);
+}
 
 /**
+ *  Returns the path of the state file.
+ */
+static void player_state_path(char *path, size_t size) {
+    snprintf(path, size, "%s/state", g_config.cache_dir);
+}
+
+/**
+ *  Saves the loaded track, its position, the play queue and the library
+ *  view. A resume still waiting for login keeps the state it was loaded
+ *  from.
  *
+ *  @param sync wait for the disk, at shutdown
+ */
+static void player_save(bool sync) {
+    char path[sizeof(g_config.cache_dir) + 16];
+    track_table_t *table = library_table();
+    state_t state;
+    int i;
+
+    if (g_resume_count > 0)
+        return;
+
+    memset(&state, 0, sizeof(state_t));
+
+    if (g_play.track[0] != '\0') {
+        memcpy(state.tracks[0], g_play.track, STATE_ID_SIZE);
+        state.ntracks = 1;
+        state.current = true;
+        state.paused = g_play_resumed == 0;
+        state.position_ms = audio_fifo_position(&g_audio_fifo);
+    }
+
+    for (i = 0; i < g_queue_count && state.ntracks < STATE_MAX_TRACKS; i++) {
+        if (player_track_id(g_queue[(g_queue_head + i) % PLAYER_QUEUE_SIZE],
+                            state.tracks[state.ntracks], STATE_ID_SIZE + 1))
+            state.ntracks++;
+        else
+            memset(state.tracks[state.ntracks], 0, STATE_ID_SIZE + 1);
+    }
+
+    memcpy(state.keys, table->keys, sizeof(state.keys));
+    state.nkeys = table->nkeys;
+    memcpy(state.query, table->query, sizeof(state.query));
+
+    if (!sync && memcmp(&state, &g_saved, sizeof(state_t)) == 0)
+        return;
+
+    g_saved = state;
+    player_state_path(path, sizeof(path));
+    state_save(&state, path, sync);
+}
+
+/**
+ *  Drops the tracks of a resume that didn't happen.
+ */
+static void player_resume_clear() {
+    while (g_resume_count > 0)
+        sp_track_release(g_resume[--g_resume_count]);
+}
+
+/**
+ *  Plays the tracks of the last run once logged in and their metadata is
+ *  there: the loaded track is loaded, seeked to where it was and paused if
+ *  it was, the rest is queued. Tracks that failed to load are left out.
+ */
+static void player_resume_tracks() {
+    sp_track *track;
+    int i;
+
+    if (!g_logged_in || g_resume_count == 0)
+        return;
+
+    for (i = 0; i < g_resume_count; i++) {
+        if (sp_track_error(g_resume[i]) == SP_ERROR_IS_LOADING)
+            return;
+    }
+
+    i = 0;
+    if (g_resume_current) {
+        track = g_resume[i++];
+        if (sp_track_error(track) == SP_ERROR_OK) {
+            player_play(track);
+            if (g_resume_position > 0)
+                player_seek(g_resume_position);
+            if (g_resume_paused)
+                player_pause();
+        }
+    }
+
+    for (; i < g_resume_count; i++) {
+        if (sp_track_error(g_resume[i]) == SP_ERROR_OK)
+            player_queue(g_resume[i]);
+    }
+
+    log_info("resumed %d tracks at %u ms\n", g_resume_count, g_resume_position);
+    player_resume_clear();
+}
+
+/**
+ *  Loads the measured loudness and the history of previously played
+ *  tracks.
+ */
+void player_init() {
+    char path[sizeof(g_config.cache_dir) + 16];
+
+    snprintf(path, sizeof(path), "%s/loudness", g_config.cache_dir);
+    loudness_store_open(&g_loudness_store, path);
+
+    snprintf(path, sizeof(path), "%s/history", g_config.cache_dir);
+    history_open(&g_history, path);
+}
+
+/**
+ *  Saves the state for the next run, the loudness and the play of the
+ *  current track and closes the stores.
+ */
+void player_release() {
+    player_save(true);
+    player_resume_clear();
+    player_track_done();
+    player_play_end(false);
+    player_queue_clear();
+    loudness_store_close(&g_loudness_store);
+    history_close(&g_history);
+}
+
+/**
+ *  Restores the state of the last run. The library view applies right
+ *  away. The tracks are resolved now so libspotify loads their metadata
+ *  from its cache while logging in, playback picks up where it was the
+ *  moment login completes. Call after session_login().
+ */
+void player_resume() {
+    char path[sizeof(g_config.cache_dir) + 16];
+    char uri[64];
+    state_t state;
+    sp_link *link;
+    sp_track *track;
+    int i;
+
+    player_state_path(path, sizeof(path));
+    if (!state_load(&state, path))
+        return;
+
+    track_table_sort(library_table(), state.keys, state.nkeys);
+    track_table_filter(library_table(), state.query);
+
+    g_resume_current = false;
+    for (i = 0; i < state.ntracks; i++) {
+        snprintf(uri, sizeof(uri), TRACK_URI_PREFIX "%s", state.tracks[i]);
+        link = sp_link_create_from_string(uri);
+        track = link ? sp_link_as_track(link) : NULL;
+
+        if (track) {
+            sp_track_add_ref(track);
+            g_resume[g_resume_count++] = track;
+            g_resume_current = g_resume_current || (i == 0 && state.current);
+        }
+
+        if (link)
+            sp_link_release(link);
+    }
+
+    g_resume_paused = state.paused;
+    g_resume_position = state.position_ms;
+
+    log_info("resuming %d tracks saved %ld s ago\n", g_resume_count,
+             (long) time(NULL) - (long) state.saved);
+    player_resume_tracks();
+}
+
+/**
+ *  Starts a pending resume once logged in.
+ */
+void player_logged_in() {
+    g_logged_in = true;
+    player_resume_tracks();
+}
+
+/**
+ *  Starts a pending resume when the metadata of its tracks arrived.
+ */
+void player_metadata_updated() {
+    player_resume_tracks();
+}
+
+/**
+ *  Returns the play history, valid between player_init() and
+ *  player_release().
+ */
+history_t *player_history() {
+    return &g_history;
+}
+
+/**
+ *  Loads and plays the given track, or resumes the loaded track when track
+ *  is NULL. Audio of the previous track still buffered is dropped, a resumed
+ *  track continues from the audio kept while paused. A new track is played
+ *  at its normalization gain and measured along the way.
  */
 void player_play(sp_track *track) {
-    if (!track)
+    if (track) {
+        player_track_done();
+        player_play_end(true);
+        player_play_begin(track);
+        g_draining = false;
         sp_session_player_load(g_session, track);
+        audio_fifo_track(&g_audio_fifo, player_track_gain(track),
+                         sp_track_duration(track));
+        g_loaded = true;
+        player_arm_next();
+    }
+
+    if (g_play.track[0] != '\0' && g_play_resumed == 0)
+        g_play_resumed = player_now_ms();
+
+    audio_fifo_pause(&g_audio_fifo, false);
+    sp_session_player_play(g_session, true);
+}
+
+/**
+ *  Queues a track to play after the loaded one and any queued before it.
+ *
+ *  @return false if the queue is full
+ */
+bool player_queue(sp_track *track) {
+    if (g_queue_count == PLAYER_QUEUE_SIZE)
+        return false;
+
+    sp_track_add_ref(track);
+    g_queue[(g_queue_head + g_queue_count++) % PLAYER_QUEUE_SIZE] = track;
+
+    if (g_queue_count == 1)
+        player_arm_next();
+
+    return true;
+}
+
+/**
+ *  Empties the play queue, the loaded track plays to its end.
+ */
+void player_queue_clear() {
+    while (g_queue_count > 0) {
+        sp_track_release(g_queue[g_queue_head]);
+        g_queue_head = (g_queue_head + 1) % PLAYER_QUEUE_SIZE;
+        g_queue_count--;
+    }
 
+    player_arm_next();
+}
+
+/**
+ *  Continues with the next queued track once libspotify delivered the last
+ *  frame of the loaded one. Audio still buffered keeps playing, the next
+ *  track follows it without a gap or crossfades over its held back end.
+ *  Without a queued track the held back end is played out by player_tick().
+ *  Call from the main thread.
+ */
+void player_end_of_track() {
+    sp_track *track;
+
+    player_track_done();
+    player_play_end(false);
+
+    if (g_queue_count == 0) {
+        sp_session_player_unload(g_session);
+        g_loaded = false;
+        g_draining = audio_fifo_drain(&g_audio_fifo);
+        return;
+    }
+
+    track = g_queue[g_queue_head];
+    g_queue_head = (g_queue_head + 1) % PLAYER_QUEUE_SIZE;
+    g_queue_count--;
+
+    player_play_begin(track);
+    sp_session_player_load(g_session, track);
+    audio_fifo_next(&g_audio_fifo, player_track_gain(track),
+                    sp_track_duration(track));
     sp_session_player_play(g_session, true);
+    sp_track_release(track);
+
+    player_arm_next();
 }
 
 /**
+ *  Does the periodic work of the player: plays out the end of the last
+ *  track and saves the state every PLAYER_SAVE_MS, without waiting for the
+ *  disk. A crash loses at most that much of the position. Call from the
+ *  main thread.
  *
+ *  @return milliseconds until it wants to be called again
+ */
+int player_tick() {
+    uint64_t now = player_now_ms();
+    int wait;
+
+    if (g_draining)
+        g_draining = audio_fifo_drain(&g_audio_fifo);
+
+    if (now - g_saved_time >= PLAYER_SAVE_MS) {
+        player_save(false);
+        g_saved_time = now;
+    }
+
+    wait = PLAYER_SAVE_MS - (now - g_saved_time);
+    return g_draining && PLAYER_DRAIN_MS < wait ? PLAYER_DRAIN_MS : wait;
+}
+
+/**
+ *  Pauses the loaded track. The outputs stop within a period and keep the
+ *  buffered audio for player_play().
  */
 void player_pause() {
+    if (g_play_resumed) {
+        g_play_ms += player_now_ms() - g_play_resumed;
+        g_play_resumed = 0;
+    }
+
+    audio_fifo_pause(&g_audio_fifo, true);
+
     // false translates to pause currently loaded track
     sp_session_player_play(g_session, false);
 }
 
 /**
- *
+ *  Seeks to offset milliseconds into the loaded track. Buffered audio from
+ *  the old position is dropped from the fifo and the outputs, so the new
+ *  position is heard as soon as it is prebuffered.
  */
 void player_seek(int offset) {
     sp_session_player_seek(g_session, offset);
+    audio_fifo_seek(&g_audio_fifo, offset);
 }
 
 /**
@@ -34,6 +529,11 @@ void player_seek(int offset) {
  *  structure.
  */
 void player_stop() {
+    player_track_done();
+    player_play_end(true);
     sp_session_player_unload(g_session);
+    g_loaded = false;
+    g_draining = false;
     audio_fifo_flush(&g_audio_fifo);
+    player_arm_next();
 }
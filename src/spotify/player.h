@@ -1,11 +1,24 @@
 #ifndef SPOTICLI_SPOTIFY_PLAYER_H
 #define SPOTICLI_SPOTIFY_PLAYER_H
 
+#include <stdbool.h>
 #include <libspotify/api.h>
 
+#include "history.h"
+
+void player_init();
+void player_release();
 void player_play(sp_track *track);
 void player_pause();
 void player_seek(int offset);
 void player_stop();
+bool player_queue(sp_track *track);
+void player_queue_clear();
+void player_end_of_track();
+int player_tick();
+void player_resume();
+void player_logged_in();
+void player_metadata_updated();
+history_t *player_history();
 
 #endif // SPOTICLI_SPOTIFY_PLAYER_H
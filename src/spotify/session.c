@@ -2,6 +2,8 @@
 #include <string.h>
 
 #include "session.h"
+#include "config.h"
+#include "event.h"
 #include "ui/ui.h"
 
 #define DEBUG
@@ -12,19 +14,14 @@
 
 extern const uint8_t g_appkey[];
 extern const size_t g_appkey_size;
+extern config_t g_config;
 
 // global session handle
 sp_session *g_session;
-// global session notify mutex
-pthread_mutex_t g_notify_mutex;
-// global session notify cond
-pthread_cond_t g_notify_cond;
 // global audio fifo
 audio_fifo_t g_audio_fifo;
-// global bool updating the main thread
-bool g_notify_do;
-// global bool denoting if current playback is complete
-bool g_playback_done;
+// global events from libspotify callbacks to the main thread
+event_queue_t g_events;
 
 
 static void logged_in(sp_session *session, sp_error);
@@ -68,6 +65,13 @@ void session_init()
     // set appkey size
     config.application_key_size = g_appkey_size;
 
+    // persistent locations let libspotify reuse cached settings and metadata
+    config.cache_location = g_config.cache_dir;
+    config.settings_location = g_config.settings_dir;
+
+    // callbacks may post events while the session is created
+    event_queue_init(&g_events);
+
     // create spotify session
     error = sp_session_create(&config, &session);
     if (error != SP_ERROR_OK) {
@@ -76,13 +80,8 @@ void session_init()
         exit(EXIT_FAILURE);
     }
 
-    // init and lock mutex
-    pthread_mutex_init(&g_notify_mutex, NULL);
-    pthread_cond_init(&g_notify_cond, NULL);
-
     // set global session handle
     g_session = session;
-    g_playback_done = false;
 }
 
 void session_release()
@@ -90,10 +89,9 @@ void session_release()
     if (!g_session)
         exit(EXIT_FAILURE);
 
-    pthread_mutex_destroy(&g_notify_mutex);
-    pthread_cond_destroy(&g_notify_cond);
-
     sp_session_release(g_session);
+
+    event_queue_release(&g_events);
 }
 
 void session_login(const char *username, const char *password)
@@ -129,45 +127,41 @@ sp_search *session_search(const char *query)
     // TODO
 }
 
+// callbacks only post an event, the main loop handles them in order
+
 static void logged_in(sp_session *session, sp_error error)
 {
     debug("logged_in called\n");
 
-    if (error != SP_ERROR_OK) {
-        fprintf(stderr, "Unable to login: %s\n", sp_error_message(error));
-        exit(EXIT_FAILURE);
-    }
+    event_post(&g_events, EVENT_LOGGED_IN, error);
 }
 
 static void logged_out(sp_session *session)
 {
     debug("logged_out called\n");
+
+    event_post(&g_events, EVENT_LOGGED_OUT, 0);
 }
 
 static void metadata_updated(sp_session *session)
 {
     debug("metadata_updated called\n");
+
+    event_post(&g_events, EVENT_METADATA_UPDATED, 0);
 }
 
 static void notify_main_thread(sp_session *session)
 {
     debug("notify_main_thread called\n");
 
-    pthread_mutex_lock(&g_notify_mutex);
-
-    g_notify_do = true;
-    pthread_cond_signal(&g_notify_cond);
-
-    pthread_mutex_unlock(&g_notify_mutex);
+    event_post(&g_events, EVENT_NOTIFY, 0);
 }
 
 static void play_token_lost(sp_session *session)
 {
     debug("play_token_lost called\n");
 
-    audio_fifo_flush(&g_audio_fifo);
-
-    // if currently playing a track, stop it.
+    event_post(&g_events, EVENT_TOKEN_LOST, 0);
 }
 
 static void log_message(sp_session *session, const char *message)
@@ -179,13 +173,7 @@ static void end_of_track(sp_session *session)
 {
     debug("end_of_track called\n");
 
-    pthread_mutex_lock(&g_notify_mutex);
-
-    g_playback_done = true;
-    g_notify_do = true;
-    pthread_cond_signal(&g_notify_cond);
-
-    pthread_mutex_unlock(&g_notify_mutex);
+    event_post(&g_events, EVENT_END_OF_TRACK, 0);
 }
 
 /**
@@ -205,36 +193,10 @@ static int music_delivery(sp_session *session,
 {
     debug("music_delivery called\n");
 
-    audio_fifo_t *af = &g_audio_fifo;    // audio fifo
-    audio_data_t *ad;                               // audio data
-
     // audio discontinuity, flush audio_fifo
     if (num_frames == 0)
         return 0;
 
-    pthread_mutex_lock(&(af->mutex));
-
-    // buffer one second of audio
-    if (af->total_samples > format->sample_rate) {
-        pthread_mutex_unlock(&(af->mutex));
-
-        return 0;
-    }
-
-    // allocate audio_data_t
-    ad = audio_data_create(format->channels, num_frames, format->sample_rate);
-
-    // copy frames into samples array
-    memcpy(ad->samples, frames, ad->sample_size);
-
-    // enqueue ad
-    queue_enqueue(af->queue, ad);
-
-    // update total samples in queue
-    af->total_samples += num_frames;    // += nsamples
-
-    pthread_cond_signal(&(af->cond));
-    pthread_mutex_unlock(&(af->mutex));
-
-    return num_frames;
+    return audio_fifo_write(&g_audio_fifo, format->channels,
+                            format->sample_rate, frames, num_frames);
 }
@@ -1,7 +1,6 @@
 #ifndef SPOTICLI_SPOTIFY_SESSION_H
 #define SPOTICLI_SPOTIFY_SESSION_H
 
-#include <pthread.h>
 #include <libspotify/api.h>
 
 #include "audio.h"
@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "state.h"
+#include "debug.h"
+
+
+#define STATE_MAGIC     "SCS1"  // format tag and version
+#define STATE_HEADER    4
+#define STATE_CURRENT   0x01
+#define STATE_PAUSED    0x02
+
+// header, fixed fields, sort keys, query, tracks and the check
+#define STATE_MAX_SIZE  (STATE_HEADER + 12 + TRACK_MAX_SORT_KEYS * 2 + 1 + \
+                         TRACK_QUERY_SIZE + STATE_MAX_TRACKS * STATE_ID_SIZE + 4)
+
+/**
+ * A state file being written or read.
+ */
+typedef struct state_buffer_s {
+    uint8_t data[STATE_MAX_SIZE];
+    size_t size;                // written, or read so far
+    size_t end;                 // bytes there are to read
+} state_buffer_t;
+
+
+/**
+ * FNV-1a hash of the file up to its check.
+ */
+static uint32_t state_check(const uint8_t *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void state_put(state_buffer_t *buffer, const void *data, size_t size)
+{
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+/**
+ * Reads the next size bytes.
+ *
+ * @return false past the end
+ */
+static bool state_get(state_buffer_t *buffer, void *data, size_t size)
+{
+    if (buffer->size + size > buffer->end)
+        return false;
+
+    memcpy(data, buffer->data + buffer->size, size);
+    buffer->size += size;
+
+    return true;
+}
+
+/**
+ * Saves the state next to path and renames it over path. The check at the
+ * end catches a file that a crash left empty or short.
+ *
+ * @param state state_t, saved is filled in
+ * @param path state file
+ * @param sync wait for the disk, only worth it at shutdown
+ *
+ * @return true on success
+ */
+bool state_save(state_t *state, const char *path, bool sync)
+{
+    state_buffer_t buffer;
+    char tmp[512];
+    uint16_t ntracks = state->ntracks;
+    uint8_t flags = 0, nkeys = state->nkeys, len = strlen(state->query);
+    uint8_t key[2];
+    uint32_t check;
+    bool ok;
+    int fd, i;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+        return false;
+
+    state->saved = time(NULL);
+    if (state->current)
+        flags |= STATE_CURRENT;
+    if (state->paused)
+        flags |= STATE_PAUSED;
+
+    buffer.size = 0;
+    state_put(&buffer, STATE_MAGIC, STATE_HEADER);
+    state_put(&buffer, &state->saved, sizeof(uint32_t));
+    state_put(&buffer, &state->position_ms, sizeof(uint32_t));
+    state_put(&buffer, &ntracks, sizeof(uint16_t));
+    state_put(&buffer, &flags, sizeof(uint8_t));
+    state_put(&buffer, &nkeys, sizeof(uint8_t));
+
+    for (i = 0; i < state->nkeys; i++) {
+        key[0] = state->keys[i].column;
+        key[1] = state->keys[i].descending;
+        state_put(&buffer, key, sizeof(key));
+    }
+
+    state_put(&buffer, &len, sizeof(uint8_t));
+    state_put(&buffer, state->query, len);
+
+    for (i = 0; i < state->ntracks; i++)
+        state_put(&buffer, state->tracks[i], STATE_ID_SIZE);
+
+    check = state_check(buffer.data, buffer.size);
+    state_put(&buffer, &check, sizeof(uint32_t));
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_warning("%s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+
+    ok = write(fd, buffer.data, buffer.size) == (ssize_t) buffer.size &&
+         (!sync || fdatasync(fd) == 0);
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok) {
+        log_warning("%s: unable to save state: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+
+    return ok;
+}
+
+/**
+ * Reads the fields of a state file whose check matched.
+ *
+ * @return false if the fields don't add up
+ */
+static bool state_parse(state_buffer_t *buffer, state_t *state)
+{
+    uint16_t ntracks;
+    uint8_t flags, nkeys, len;
+    uint8_t key[2];
+    int i;
+
+    if (!state_get(buffer, &state->saved, sizeof(uint32_t)) ||
+        !state_get(buffer, &state->position_ms, sizeof(uint32_t)) ||
+        !state_get(buffer, &ntracks, sizeof(uint16_t)) ||
+        !state_get(buffer, &flags, sizeof(uint8_t)) ||
+        !state_get(buffer, &nkeys, sizeof(uint8_t)) ||
+        ntracks > STATE_MAX_TRACKS || nkeys > TRACK_MAX_SORT_KEYS)
+        return false;
+
+    for (i = 0; i < nkeys; i++) {
+        if (!state_get(buffer, key, sizeof(key)) || key[0] > TRACK_ADDED)
+            return false;
+        state->keys[i].column = key[0];
+        state->keys[i].descending = key[1] != 0;
+    }
+
+    if (!state_get(buffer, &len, sizeof(uint8_t)) || len >= TRACK_QUERY_SIZE ||
+        !state_get(buffer, state->query, len))
+        return false;
+
+    for (i = 0; i < ntracks; i++) {
+        if (!state_get(buffer, state->tracks[i], STATE_ID_SIZE))
+            return false;
+    }
+
+    state->ntracks = ntracks;
+    state->nkeys = nkeys;
+    state->current = (flags & STATE_CURRENT) != 0;
+    state->paused = (flags & STATE_PAUSED) != 0;
+
+    return true;
+}
+
+/**
+ * Loads the state saved last. A missing, damaged or unknown file loads
+ * nothing.
+ *
+ * @param state state_t to fill in
+ * @param path state file
+ *
+ * @return true if a state was loaded
+ */
+bool state_load(state_t *state, const char *path)
+{
+    state_buffer_t buffer;
+    uint32_t check;
+    ssize_t size;
+    int fd;
+
+    memset(state, 0, sizeof(state_t));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            log_warning("%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    size = read(fd, buffer.data, sizeof(buffer.data));
+    close(fd);
+
+    if (size < STATE_HEADER + (ssize_t) sizeof(uint32_t) ||
+        memcmp(buffer.data, STATE_MAGIC, STATE_HEADER) != 0) {
+        log_warning("%s: not a saved state\n", path);
+        return false;
+    }
+
+    memcpy(&check, buffer.data + size - sizeof(uint32_t), sizeof(uint32_t));
+    if (check != state_check(buffer.data, size - sizeof(uint32_t))) {
+        log_warning("%s: damaged, not resuming\n", path);
+        return false;
+    }
+
+    buffer.size = STATE_HEADER;
+    buffer.end = size - sizeof(uint32_t);
+
+    if (!state_parse(&buffer, state)) {
+        log_warning("%s: not a saved state\n", path);
+        memset(state, 0, sizeof(state_t));
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef SPOTICLI_SPOTIFY_STATE_H
+#define SPOTICLI_SPOTIFY_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "track.h"
+
+#define STATE_ID_SIZE       22      // base62 spotify id
+#define STATE_MAX_TRACKS    257     // the loaded track and a full play queue
+
+/**
+ * What is needed to pick up where the last run left off. Saved as a small
+ * binary file that is replaced in one rename, so a crash leaves either the
+ * old or the new state, never a mix.
+ */
+typedef struct state_s {
+    char tracks[STATE_MAX_TRACKS][STATE_ID_SIZE + 1];
+    int ntracks;
+    bool current;               // tracks[0] was loaded, the rest queued
+    bool paused;
+    uint32_t position_ms;       // into tracks[0]
+    uint32_t saved;             // unix time, filled in by state_save()
+    track_sort_key_t keys[TRACK_MAX_SORT_KEYS];     // library view
+    int nkeys;
+    char query[TRACK_QUERY_SIZE];
+} state_t;
+
+bool state_save(state_t *state, const char *path, bool sync);
+bool state_load(state_t *state, const char *path);
+
+#endif // SPOTICLI_SPOTIFY_STATE_H
@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "track.h"
+#include "mem.h"
+
+
+#define TRACK_MIN_CAPACITY  1024
+#define TRACK_MIN_SLOTS     1024
+#define TRACK_MIN_DATA      65536
+#define TRACK_ROW_BYTES     (10 * sizeof(uint32_t) + sizeof(void *))
+#define TRACK_STRING_BYTES  (3 * sizeof(uint32_t) + 1)  // offset, rank, sorted,
+                                                        // matches
+#define TRACK_RANK_BATCH    4096    // new strings ranked while adding
+#define RADIX_BITS          11      // three passes cover a 32 bit key
+#define RADIX_BUCKETS       (1 << RADIX_BITS)
+#define RADIX_PASSES        3
+
+// string being ranked, for the qsort comparator
+static const track_strings_t *g_ranking;
+
+
+/**
+ * FNV-1a hash of a nul terminated string.
+ *
+ * @param s string
+ *
+ * @return 32 bit hash
+ */
+static uint32_t track_hash(const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*s)
+        hash = (hash ^ (unsigned char) *s++) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Returns the original form of an interned string.
+ */
+static const char *track_strings_get(const track_strings_t *strings, uint32_t id)
+{
+    return strings->data + strings->offsets[id];
+}
+
+/**
+ * Returns the case folded form of an interned string.
+ */
+static const char *track_strings_folded(const track_strings_t *strings,
+                                        uint32_t id)
+{
+    return strings->folded + strings->offsets[id];
+}
+
+/**
+ * Folds ASCII letters to lower case, other bytes are kept so UTF-8 stays
+ * intact.
+ *
+ * @param out buffer as large as in
+ * @param in string
+ */
+static void track_fold(char *out, const char *in)
+{
+    for (; *in; in++, out++)
+        *out = (*in >= 'A' && *in <= 'Z') ? *in + ('a' - 'A') : *in;
+    *out = '\0';
+}
+
+/**
+ * Doubles the hash table and reinserts every string.
+ */
+static void track_strings_rehash(track_strings_t *strings)
+{
+    uint32_t i, slot;
+
+    strings->nslots = strings->nslots ? strings->nslots * 2 : TRACK_MIN_SLOTS;
+    free(strings->slots);
+    strings->slots = calloc(strings->nslots, sizeof(uint32_t));
+
+    for (i = 0; i < strings->count; i++) {
+        slot = track_hash(track_strings_get(strings, i)) & (strings->nslots - 1);
+        while (strings->slots[slot])
+            slot = (slot + 1) & (strings->nslots - 1);
+        strings->slots[slot] = i + 1;
+    }
+}
+
+/**
+ * Returns the id of a string, adding it if it is new.
+ *
+ * @param strings track_strings_t
+ * @param s string, NULL is taken as empty
+ *
+ * @return string id
+ */
+static uint32_t track_strings_intern(track_strings_t *strings, const char *s)
+{
+    size_t len;
+    uint32_t slot, id;
+
+    if (s == NULL)
+        s = "";
+
+    if (strings->count * 2 >= strings->nslots)
+        track_strings_rehash(strings);
+
+    slot = track_hash(s) & (strings->nslots - 1);
+    while (strings->slots[slot]) {
+        id = strings->slots[slot] - 1;
+        if (strcmp(track_strings_get(strings, id), s) == 0)
+            return id;
+        slot = (slot + 1) & (strings->nslots - 1);
+    }
+
+    if (strings->count == strings->capacity_strings) {
+        strings->capacity_strings = strings->capacity_strings ?
+            strings->capacity_strings * 2 : TRACK_MIN_CAPACITY;
+        strings->offsets = realloc(strings->offsets,
+                                   strings->capacity_strings * sizeof(uint32_t));
+        strings->ranks = realloc(strings->ranks,
+                                 strings->capacity_strings * sizeof(uint32_t));
+        strings->sorted = realloc(strings->sorted,
+                                  strings->capacity_strings * sizeof(uint32_t));
+        strings->matches = realloc(strings->matches, strings->capacity_strings);
+    }
+
+    len = strlen(s) + 1;
+    while (strings->size + len > strings->capacity) {
+        strings->capacity = strings->capacity ? strings->capacity * 2 : TRACK_MIN_DATA;
+        strings->data = realloc(strings->data, strings->capacity);
+        strings->folded = realloc(strings->folded, strings->capacity);
+    }
+
+    id = strings->count++;
+    strings->offsets[id] = strings->size;
+    memcpy(strings->data + strings->size, s, len);
+    track_fold(strings->folded + strings->size, s);
+    strings->size += len;
+
+    strings->slots[slot] = id + 1;
+
+    return id;
+}
+
+/**
+ * Orders string ids by folded form, then by original form.
+ */
+static int track_strings_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    int diff = strcmp(track_strings_folded(g_ranking, x),
+                      track_strings_folded(g_ranking, y));
+
+    return diff ? diff : strcmp(track_strings_get(g_ranking, x),
+                                track_strings_get(g_ranking, y));
+}
+
+/**
+ * Returns the position in sorted[lo, hi) that string id goes to, after
+ * every string that collates before it.
+ */
+static uint32_t track_strings_search(const track_strings_t *strings,
+                                     const uint32_t *sorted, uint32_t lo,
+                                     uint32_t hi, uint32_t id)
+{
+    uint32_t mid;
+
+    g_ranking = strings;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (track_strings_compare(&sorted[mid], &id) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    g_ranking = NULL;
+
+    return lo;
+}
+
+/**
+ * Ranks the strings added since the last ranking. Only the new strings are
+ * sorted, each is placed among the ranked ones by binary search and the
+ * ranks are renumbered in one pass, comparing only the neighbours of new
+ * strings. Sorting again costs no string compares at all.
+ *
+ * @param strings track_strings_t
+ */
+static void track_strings_rank(track_strings_t *strings)
+{
+    uint32_t nold = strings->nranked, nnew = strings->count - nold;
+    uint32_t *added, *merged;
+    uint32_t i, j, k, pos, id, prev = 0, old, prev_old = 0, rank = 0;
+    bool same;
+
+    if (nnew == 0)
+        return;
+
+    added = malloc(nnew * sizeof(uint32_t));
+    for (i = 0; i < nnew; i++)
+        added[i] = nold + i;
+
+    g_ranking = strings;
+    qsort(added, nnew, sizeof(uint32_t), track_strings_compare);
+    g_ranking = NULL;
+
+    // the ranked strings between two new ones are copied in one block
+    merged = malloc(strings->capacity_strings * sizeof(uint32_t));
+    for (i = j = k = 0; i < nnew; i++) {
+        pos = track_strings_search(strings, strings->sorted, j, nold, added[i]);
+        memcpy(merged + k, strings->sorted + j, (pos - j) * sizeof(uint32_t));
+        k += pos - j;
+        j = pos;
+        merged[k++] = added[i];
+    }
+    memcpy(merged + k, strings->sorted + j, (nold - j) * sizeof(uint32_t));
+
+    // two ranked strings still next to each other were neighbours before
+    // and their old ranks tell whether they fold the same
+    for (i = 0; i < strings->count; i++) {
+        id = merged[i];
+        old = id < nold ? strings->ranks[id] : 0;
+
+        if (i > 0) {
+            if (prev < nold && id < nold)
+                same = prev_old == old;
+            else
+                same = strcmp(track_strings_folded(strings, prev),
+                              track_strings_folded(strings, id)) == 0;
+            if (!same)
+                rank++;
+        }
+
+        strings->ranks[id] = rank;
+        prev = id;
+        prev_old = old;
+    }
+
+    free(strings->sorted);
+    free(added);
+    strings->sorted = merged;
+    strings->nranked = strings->count;
+}
+
+/**
+ * Initializes an empty table.
+ *
+ * @param table track_table_t
+ */
+void track_table_init(track_table_t *table)
+{
+    memset(table, 0, sizeof(track_table_t));
+}
+
+/**
+ * Frees every column and string, the refs are the owner's to release.
+ *
+ * @param table track_table_t
+ */
+void track_table_release(track_table_t *table)
+{
+    mem_uncharge(MEM_METADATA, table->bytes);
+
+    free(table->title);
+    free(table->artist);
+    free(table->album);
+    free(table->duration);
+    free(table->added);
+    free(table->refs);
+    free(table->order);
+    free(table->view);
+    free(table->scratch);
+    free(table->sort_keys);
+    free(table->sort_keys_swap);
+
+    free(table->strings.data);
+    free(table->strings.folded);
+    free(table->strings.offsets);
+    free(table->strings.ranks);
+    free(table->strings.sorted);
+    free(table->strings.matches);
+    free(table->strings.slots);
+
+    memset(table, 0, sizeof(track_table_t));
+}
+
+/**
+ * Grows every column to hold at least one more row.
+ */
+static void track_table_grow(track_table_t *table)
+{
+    uint32_t n = table->capacity ? table->capacity * 2 : TRACK_MIN_CAPACITY;
+    size_t size = n * sizeof(uint32_t);
+
+    table->title = realloc(table->title, size);
+    table->artist = realloc(table->artist, size);
+    table->album = realloc(table->album, size);
+    table->duration = realloc(table->duration, size);
+    table->added = realloc(table->added, size);
+    table->refs = realloc(table->refs, n * sizeof(void *));
+    table->order = realloc(table->order, size);
+    table->view = realloc(table->view, size);
+    table->scratch = realloc(table->scratch, size);
+    table->sort_keys = realloc(table->sort_keys, size);
+    table->sort_keys_swap = realloc(table->sort_keys_swap, size);
+
+    table->capacity = n;
+}
+
+/**
+ * Returns the bytes the columns, strings and hash are allocated with.
+ */
+static size_t track_table_footprint(const track_table_t *table)
+{
+    const track_strings_t *strings = &table->strings;
+
+    return table->capacity * TRACK_ROW_BYTES +
+           strings->capacity_strings * TRACK_STRING_BYTES +
+           strings->nslots * sizeof(uint32_t) + strings->capacity * 2;
+}
+
+/**
+ * Returns at most how many bytes adding a row grows the table by, taking
+ * all three of its strings as new. Mirrors how the table grows.
+ *
+ * @param table track_table_t
+ * @param len length of the three strings, terminators included
+ */
+static size_t track_table_growth(const track_table_t *table, size_t len)
+{
+    const track_strings_t *strings = &table->strings;
+    size_t growth = 0, capacity = strings->capacity;
+
+    if (table->count == table->capacity)
+        growth += (table->capacity ? table->capacity : TRACK_MIN_CAPACITY) *
+                  TRACK_ROW_BYTES;
+
+    if (strings->count + 3 > strings->capacity_strings)
+        growth += (strings->capacity_strings ? strings->capacity_strings :
+                   TRACK_MIN_CAPACITY) * TRACK_STRING_BYTES;
+
+    // checked before each of the three strings is added
+    if ((strings->count + 2) * 2 >= strings->nslots)
+        growth += (strings->nslots ? strings->nslots : TRACK_MIN_SLOTS) *
+                  sizeof(uint32_t);
+
+    while (strings->size + len > capacity)
+        capacity = capacity ? capacity * 2 : TRACK_MIN_DATA;
+    growth += (capacity - strings->capacity) * 2;
+
+    return growth;
+}
+
+/**
+ * Appends a track. It goes to the end of the sorted order and the view
+ * regardless of the sort keys and filter, sort and filter again to place
+ * it. A row that would take the table over the MEM_METADATA budget is
+ * refused.
+ *
+ * @param table track_table_t
+ * @param title track name
+ * @param artist first artist
+ * @param album album name
+ * @param duration length in ms
+ * @param added unix time the track was added to the library
+ * @param ref owner's handle, handed back untouched
+ *
+ * @return row of the track, TRACK_NONE if it was refused
+ */
+uint32_t track_table_add(track_table_t *table, const char *title,
+                         const char *artist, const char *album,
+                         uint32_t duration, uint32_t added, void *ref)
+{
+    uint32_t row = table->count;
+    size_t len, charged;
+
+    len = (title ? strlen(title) : 0) + (artist ? strlen(artist) : 0) +
+          (album ? strlen(album) : 0) + 3;
+    charged = track_table_growth(table, len);
+    if (charged > 0 && !mem_try_charge(MEM_METADATA, charged))
+        return TRACK_NONE;
+
+    if (row == table->capacity)
+        track_table_grow(table);
+
+    table->title[row] = track_strings_intern(&table->strings, title);
+    table->artist[row] = track_strings_intern(&table->strings, artist);
+    table->album[row] = track_strings_intern(&table->strings, album);
+    table->duration[row] = duration;
+    table->added[row] = added;
+    table->refs[row] = ref;
+
+    table->order[row] = row;
+    table->view[table->nview++] = row;
+    table->count++;
+
+    // ranked a batch at a time while loading, a sort only ranks the rest
+    if (table->strings.count - table->strings.nranked >= TRACK_RANK_BATCH)
+        track_strings_rank(&table->strings);
+
+    // give back what strings that were already interned didn't take
+    charged += table->bytes;
+    table->bytes = track_table_footprint(table);
+    mem_uncharge(MEM_METADATA, charged - table->bytes);
+
+    return row;
+}
+
+/**
+ * Returns the original form of an interned string, e.g. table->title[row].
+ *
+ * @param table track_table_t
+ * @param id string id
+ *
+ * @return nul terminated string
+ */
+const char *track_table_string(const track_table_t *table, uint32_t id)
+{
+    return track_strings_get(&table->strings, id);
+}
+
+/**
+ * Fills sort_keys with the key of every row in order, inverted for a
+ * descending sort so the radix sort always sorts ascending.
+ */
+static void track_table_column_keys(track_table_t *table, track_sort_key_t key)
+{
+    const uint32_t *ranks = table->strings.ranks;
+    const uint32_t *column;
+    uint32_t i;
+
+    switch (key.column) {
+    case TRACK_ARTIST:
+        column = table->artist;
+        break;
+    case TRACK_ALBUM:
+        column = table->album;
+        break;
+    case TRACK_DURATION:
+        column = table->duration;
+        ranks = NULL;
+        break;
+    case TRACK_ADDED:
+        column = table->added;
+        ranks = NULL;
+        break;
+    default:
+        column = table->title;
+        break;
+    }
+
+    if (ranks) {
+        for (i = 0; i < table->count; i++)
+            table->sort_keys[i] = ranks[column[table->order[i]]];
+    } else {
+        for (i = 0; i < table->count; i++)
+            table->sort_keys[i] = column[table->order[i]];
+    }
+
+    if (key.descending) {
+        for (i = 0; i < table->count; i++)
+            table->sort_keys[i] = ~table->sort_keys[i];
+    }
+}
+
+/**
+ * Stable least significant digit radix sort of order by sort_keys, eleven
+ * bits at a time. A digit that is the same for every row is skipped.
+ */
+static void track_table_radix(track_table_t *table)
+{
+    uint32_t counts[RADIX_BUCKETS];
+    uint32_t *keys = table->sort_keys, *keys_out = table->sort_keys_swap;
+    uint32_t *rows = table->order, *rows_out = table->scratch;
+    uint32_t *swap;
+    uint32_t i, sum, digit, shift;
+    int pass;
+
+    for (pass = 0; pass < RADIX_PASSES; pass++) {
+        shift = pass * RADIX_BITS;
+        memset(counts, 0, sizeof(counts));
+
+        for (i = 0; i < table->count; i++)
+            counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+
+        if (counts[(keys[0] >> shift) & (RADIX_BUCKETS - 1)] == table->count)
+            continue;
+
+        for (digit = 0, sum = 0; digit < RADIX_BUCKETS; digit++) {
+            i = counts[digit];
+            counts[digit] = sum;
+            sum += i;
+        }
+
+        for (i = 0; i < table->count; i++) {
+            digit = (keys[i] >> shift) & (RADIX_BUCKETS - 1);
+            keys_out[counts[digit]] = keys[i];
+            rows_out[counts[digit]++] = rows[i];
+        }
+
+        swap = keys, keys = keys_out, keys_out = swap;
+        swap = rows, rows = rows_out, rows_out = swap;
+    }
+
+    if (rows != table->order)
+        memcpy(table->order, rows, table->count * sizeof(uint32_t));
+}
+
+/**
+ * Sorts the table by up to TRACK_MAX_SORT_KEYS columns, the first key
+ * deciding first. Strings sort by their precomputed rank, so this is one
+ * stable radix sort per key, least significant key first. The filter is
+ * applied again to the new order.
+ *
+ * @param table track_table_t
+ * @param keys sort keys, most significant first
+ * @param nkeys number of keys
+ */
+void track_table_sort(track_table_t *table, const track_sort_key_t *keys,
+                      int nkeys)
+{
+    char query[TRACK_QUERY_SIZE];
+    int k;
+
+    nkeys = nkeys < TRACK_MAX_SORT_KEYS ? nkeys : TRACK_MAX_SORT_KEYS;
+    memcpy(table->keys, keys, nkeys * sizeof(track_sort_key_t));
+    table->nkeys = nkeys;
+
+    if (table->count == 0)
+        return;
+
+    track_strings_rank(&table->strings);
+
+    for (k = nkeys - 1; k >= 0; k--) {
+        track_table_column_keys(table, keys[k]);
+        track_table_radix(table);
+    }
+
+    // the old view is in the old order, filter from scratch
+    memcpy(query, table->query, sizeof(query));
+    table->query[0] = '\0';
+    track_table_filter(table, query);
+}
+
+/**
+ * Splits a query into folded words.
+ *
+ * @param query filter query
+ * @param buffer storage for the words, TRACK_QUERY_SIZE bytes
+ * @param tokens gets up to TRACK_MAX_TOKENS words
+ *
+ * @return number of words
+ */
+static int track_tokenize(const char *query, char *buffer, char **tokens)
+{
+    int ntokens = 0;
+    char *word;
+
+    snprintf(buffer, TRACK_QUERY_SIZE, "%s", query);
+    track_fold(buffer, buffer);
+
+    for (word = strtok(buffer, " \t"); word && ntokens < TRACK_MAX_TOKENS;
+         word = strtok(NULL, " \t"))
+        tokens[ntokens++] = word;
+
+    return ntokens;
+}
+
+/**
+ * Marks in matches which words each string contains. Every word is one
+ * memmem() sweep over the folded strings, which are back to back, so the
+ * cost hardly depends on how many strings there are.
+ *
+ * @param strings track_strings_t
+ * @param tokens folded words
+ * @param ntokens number of words
+ */
+static void track_strings_match(track_strings_t *strings, char **tokens,
+                                int ntokens)
+{
+    const char *end = strings->folded + strings->size;
+    const char *hit;
+    size_t offset, len;
+    uint32_t id;
+    int t;
+
+    memset(strings->matches, 0, strings->count);
+
+    for (t = 0; t < ntokens; t++) {
+        len = strlen(tokens[t]);
+        hit = strings->folded;
+        id = 0;
+
+        while ((hit = memmem(hit, end - hit, tokens[t], len))) {
+            // offsets ascend, so finding the string hit is in is a walk
+            offset = hit - strings->folded;
+            while (id + 1 < strings->count && strings->offsets[id + 1] <= offset)
+                id++;
+
+            strings->matches[id] |= 1 << t;
+
+            // a word that is found once in a string is found
+            if (id + 1 == strings->count)
+                break;
+            hit = strings->folded + strings->offsets[id + 1];
+        }
+    }
+}
+
+/**
+ * Narrows the view to tracks whose title, artist or album together contain
+ * every word of the query, ignoring case. Strings are searched once however
+ * many tracks share them. A query that extends the previous one, as typing
+ * does, only goes through the tracks still in view.
+ *
+ * @param table track_table_t
+ * @param query filter query, empty shows every track
+ *
+ * @return number of tracks in view
+ */
+uint32_t track_table_filter(track_table_t *table, const char *query)
+{
+    char buffer[TRACK_QUERY_SIZE];
+    char *tokens[TRACK_MAX_TOKENS];
+    const uint32_t *rows;
+    const uint8_t *matches = table->strings.matches;
+    uint32_t nrows, i, row, all;
+    size_t previous = strlen(table->query);
+    int ntokens;
+
+    ntokens = track_tokenize(query, buffer, tokens);
+
+    if (previous > 0 && strncmp(query, table->query, previous) == 0) {
+        rows = table->view;
+        nrows = table->nview;
+    } else {
+        rows = table->order;
+        nrows = table->count;
+    }
+
+    snprintf(table->query, sizeof(table->query), "%s", query);
+
+    if (ntokens == 0) {
+        memcpy(table->view, table->order, table->count * sizeof(uint32_t));
+        table->nview = table->count;
+        return table->nview;
+    }
+
+    track_strings_match(&table->strings, tokens, ntokens);
+
+    all = (1u << ntokens) - 1;
+    table->nview = 0;
+
+    // rows may be the view itself, it is only ever written behind the reader
+    for (i = 0; i < nrows; i++) {
+        row = rows[i];
+        if ((matches[table->title[row]] | matches[table->artist[row]] |
+             matches[table->album[row]]) == all)
+            table->view[table->nview++] = row;
+    }
+
+    return table->nview;
+}
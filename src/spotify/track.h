@@ -1,4 +1,90 @@
 #ifndef SPOTICLI_SPOTIFY_TRACK_H
 #define SPOTICLI_SPOTIFY_TRACK_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACK_MAX_SORT_KEYS 4
+#define TRACK_MAX_TOKENS    8       // words of a filter query that count
+#define TRACK_QUERY_SIZE    128
+#define TRACK_NONE          UINT32_MAX  // no row, the table is at its budget
+
+typedef enum track_column_e {
+    TRACK_TITLE = 0,
+    TRACK_ARTIST,
+    TRACK_ALBUM,
+    TRACK_DURATION,
+    TRACK_ADDED
+} track_column_t;
+
+typedef struct track_sort_key_s {
+    track_column_t column;
+    bool descending;
+} track_sort_key_t;
+
+/**
+ * Interned strings. Every distinct string is stored once, and its case
+ * folded form at the same offset of a second buffer, so a filter searches
+ * all folded strings in one sweep. The rank of a string is its position in
+ * collation order, strings that fold the same share a rank, so sorting by
+ * a string column sorts plain integers.
+ */
+typedef struct track_strings_s {
+    char *data;                 // nul terminated originals, back to back
+    char *folded;               // the same, case folded
+    size_t size;
+    size_t capacity;
+    uint32_t *offsets;          // of each string in data and folded
+    uint32_t *ranks;            // collation order, of the first nranked
+    uint32_t *sorted;           // the first nranked ids in collation order
+    uint8_t *matches;           // words of the filter each string contains
+    uint32_t count;
+    uint32_t capacity_strings;
+    uint32_t *slots;            // open addressing hash, id + 1, 0 when empty
+    uint32_t nslots;            // power of two, at least twice count
+    uint32_t nranked;           // strings ranked, the rest added since
+} track_strings_t;
+
+/**
+ * Tracks stored as columns, one array per field, so sorting and filtering
+ * touch only the fields they need. Rows are only ever appended. order is
+ * the sorted permutation of all rows, view the rows of order that match
+ * the filter, in the same order. Not thread safe.
+ */
+typedef struct track_table_s {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *title;            // interned string ids
+    uint32_t *artist;
+    uint32_t *album;
+    uint32_t *duration;         // ms
+    uint32_t *added;            // unix time the track was added
+    void **refs;                // owner's handle, e.g. the sp_track
+    track_strings_t strings;
+
+    track_sort_key_t keys[TRACK_MAX_SORT_KEYS];
+    int nkeys;
+    uint32_t *order;
+    uint32_t *view;
+    uint32_t nview;
+    char query[TRACK_QUERY_SIZE];   // filter view was built with
+
+    uint32_t *scratch;          // radix sort buffers, capacity each
+    uint32_t *sort_keys;
+    uint32_t *sort_keys_swap;
+
+    size_t bytes;               // accounted to MEM_METADATA
+} track_table_t;
+
+void track_table_init(track_table_t *table);
+void track_table_release(track_table_t *table);
+uint32_t track_table_add(track_table_t *table, const char *title,
+                         const char *artist, const char *album,
+                         uint32_t duration, uint32_t added, void *ref);
+void track_table_sort(track_table_t *table, const track_sort_key_t *keys,
+                      int nkeys);
+uint32_t track_table_filter(track_table_t *table, const char *query);
+const char *track_table_string(const track_table_t *table, uint32_t id);
+
 #endif // SPOTICLI_SPOTIFY_TRACK_H
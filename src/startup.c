@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <time.h>
+
+#include "startup.h"
+#include "debug.h"
+
+
+static const char *startup_names[STARTUP_END] = {
+    [STARTUP_SESSION]       = "session created",
+    [STARTUP_AUDIO]         = "audio device open",
+    [STARTUP_UI]            = "ui ready",
+    [STARTUP_LOGGED_IN]     = "logged in",
+    [STARTUP_FIRST_SAMPLE]  = "first sample"
+};
+
+static struct timespec g_startup_begin;
+static double g_startup_marks[STARTUP_END];   // ms since begin, 0 if unset
+static int g_startup_marked[STARTUP_END];
+static int g_startup_reported;
+
+
+/**
+ * Starts the startup timeline, call this first thing in main().
+ */
+void startup_begin()
+{
+    clock_gettime(CLOCK_MONOTONIC, &g_startup_begin);
+}
+
+/**
+ * Records the first time an event happens and logs it. Later marks of the
+ * same event are ignored. Thread safe.
+ *
+ * @param event startup_event_t
+ */
+void startup_mark(startup_event_t event)
+{
+    struct timespec now;
+    double ms;
+    int i;
+    bool complete = true;
+
+    if (__sync_lock_test_and_set(&g_startup_marked[event], 1))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - g_startup_begin.tv_sec) * 1E3 +
+         (now.tv_nsec - g_startup_begin.tv_nsec) / 1E6;
+    g_startup_marks[event] = ms;
+    __sync_synchronize();
+
+    log_info("startup: %s after %.1f ms\n", startup_names[event], ms);
+
+    for (i = 0; i < STARTUP_END; i++)
+        complete = complete && g_startup_marks[i] > 0;
+
+    if (complete && !__sync_lock_test_and_set(&g_startup_reported, 1))
+        startup_report();
+}
+
+/**
+ * Returns when an event happened.
+ *
+ * @param event startup_event_t
+ *
+ * @return milliseconds since startup_begin(), 0 if it hasn't happened
+ */
+double startup_elapsed(startup_event_t event)
+{
+    return g_startup_marks[event];
+}
+
+/**
+ * Logs the whole startup timeline, events that didn't happen are marked.
+ */
+void startup_report()
+{
+    int i;
+
+    log_info("startup timeline:\n");
+    for (i = 0; i < STARTUP_END; i++) {
+        if (g_startup_marks[i] > 0)
+            log_info("  %-18s %8.1f ms\n", startup_names[i], g_startup_marks[i]);
+        else
+            log_info("  %-18s %8s\n", startup_names[i], "-");
+    }
+}
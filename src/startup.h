@@ -0,0 +1,18 @@
+#ifndef SPOTICLI_STARTUP_H
+#define SPOTICLI_STARTUP_H
+
+typedef enum startup_event_e {
+    STARTUP_SESSION = 0,        // libspotify session created
+    STARTUP_AUDIO,              // first output device open
+    STARTUP_UI,                 // ncurses initialized
+    STARTUP_LOGGED_IN,          // login completed
+    STARTUP_FIRST_SAMPLE,       // first sample written to an output
+    STARTUP_END
+} startup_event_t;
+
+void startup_begin();
+void startup_mark(startup_event_t event);
+double startup_elapsed(startup_event_t event);
+void startup_report();
+
+#endif // SPOTICLI_STARTUP_H
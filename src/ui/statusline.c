@@ -1,22 +1,122 @@
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "statusline.h"
+#include "../audio.h"
+#include "../mem.h"
 
+#define STATUSLINE_SIZE 512
+
+extern audio_fifo_t g_audio_fifo;
+
+/**
+ * Appends to the status line, silently cutting it off when full.
+ *
+ * @param line status line
+ * @param len length of line so far, updated
+ * @param format printf format
+ */
+static void ui_statusline_append(char *line, int *len, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if (*len >= STATUSLINE_SIZE - 1)
+        return;
+
+    va_start(args, format);
+    n = vsnprintf(line + *len, STATUSLINE_SIZE - *len, format, args);
+    va_end(args);
+
+    *len = MIN(*len + MAX(n, 0), STATUSLINE_SIZE - 1);
+}
+
+/**
+ * Creates the status line window and starts watching the audio pipeline,
+ * the audio threads only publish snapshots while the status line exists.
+ *
+ * @param ui ui_t of the status line
+ */
 void ui_statusline_init(ui_t *ui)
 {
     ui->window = newwin(0, 0, 0, 0);
     ui->flags = 0;
     ui-> min_width = 0;
     ui-> min_height = 1;
+    ui->ui_draw_cb = ui_statusline_draw;
+
+    audio_fifo_watch(&g_audio_fifo, true);
 }
 
-void ui_statusline_draw()
+/**
+ * Draws live pipeline health: how full the buffer is against its target,
+ * how fast audio comes in compared to real time, and for every output its
+ * format, period, underruns and the cpu its thread takes, then the memory
+ * accounted to all pools. Everything comes from snapshots the audio threads
+ * publish and from atomic counters, drawing never blocks them.
+ *
+ * @param ui ui_t of the status line
+ */
+void ui_statusline_draw(ui_t *ui)
 {
+    audio_snapshot_t snapshot;
+    audio_sink_stats_t *sink;
+    char line[STATUSLINE_SIZE];
+    size_t used = 0;
+    int len = 0;
+    int i;
+
+    if (ui->window == NULL)
+        return;
+
+    audio_fifo_snapshot(&g_audio_fifo, &snapshot);
+
+    ui_statusline_append(line, &len, "buf %zuK/%zuK  in %.1fx",
+                         snapshot.fill_bytes / 1024,
+                         snapshot.target_bytes / 1024, snapshot.intake);
+
+    for (i = 0; i < snapshot.nsinks; i++) {
+        sink = &snapshot.sinks[i];
+
+        // not published yet
+        if (sink->name[0] == '\0')
+            continue;
+
+        if (sink->lost) {
+            ui_statusline_append(line, &len, "  | %s lost", sink->name);
+            continue;
+        }
+
+        ui_statusline_append(line, &len, "  | %s %s %.1fkHz %dch", sink->name,
+                             sink->format ? sink->format : "-",
+                             sink->rate / 1000.0, sink->channels);
+        if (sink->period > 0)
+            ui_statusline_append(line, &len, " p%d", sink->period);
+        ui_statusline_append(line, &len, " xrun %lu cpu %.1f%%",
+                             sink->xruns, sink->cpu_percent);
+    }
+
+    for (i = 0; i < MEM_POOLS; i++)
+        used += mem_used(i);
+    ui_statusline_append(line, &len, "  | mem %.1fM", used / 1048576.0);
 
+    werase(ui->window);
+    mvwaddnstr(ui->window, 0, 0, line, getmaxx(ui->window));
+    wnoutrefresh(ui->window);
 }
 
-void ui_statusline_release()
+/**
+ * Stops watching the audio pipeline and frees the window.
+ *
+ * @param ui ui_t of the status line
+ */
+void ui_statusline_release(ui_t *ui)
 {
+    audio_fifo_watch(&g_audio_fifo, false);
 
+    if (ui->window)
+        delwin(ui->window);
+    ui->window = NULL;
 }
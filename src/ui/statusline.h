@@ -11,8 +11,8 @@ typedef enum input_type {
     INPUT_PASSWORD
 } input_type_t;
 
-void ui_statusline_init();
-void ui_statusline_draw();
-void ui_statusline_release();
+void ui_statusline_init(ui_t *ui);
+void ui_statusline_draw(ui_t *ui);
+void ui_statusline_release(ui_t *ui);
 
 #endif
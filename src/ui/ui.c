@@ -1,20 +1,49 @@
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../audio.h"
 #include "../spotify/session.h"
 #include "ui.h"
+#include "statusline.h"
 
 #define UI_COLORS 8
 
 static bool g_stdscr_initialized = false;
 static short g_colors[UI_COLORS][3];
 
+// elements, placed by ui_balance()
+static ui_t g_ui[UI_END];
+// terminal size of the last layout, the layout is redone when it changes
+// or an element asks for it
+static int g_layout_lines = -1;
+static int g_layout_cols = -1;
+static bool g_layout_dirty = true;
+static uint64_t g_layout_time;      // ms, monotonic
+// a resize is laid out by ui_tick()
+static bool g_resize_pending = false;
+// the status line was last redrawn, ms, monotonic
+static uint64_t g_status_time;
+
 extern sp_session *g_session;
 
+static uint64_t ui_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void stdscr_init()
 {
     if (g_stdscr_initialized)
         return;
 
     initscr();
-    raw();
+    // keeps ^C delivering SIGINT, there is no key to quit with yet
+    cbreak();
     noecho();
     keypad(stdscr, TRUE);
     curs_set(0);
@@ -27,7 +56,7 @@ void stdscr_release()
     if (!g_stdscr_initialized)
         return;
 
-    noraw();
+    nocbreak();
     endwin();
 
     g_stdscr_initialized = false;
@@ -35,21 +64,219 @@ void stdscr_release()
 
 void ui_init()
 {
-    //stdscr_init();
+    stdscr_init();
+
+    if (!g_stdscr_initialized)
+        return;
+
+    ui_statusline_init(&g_ui[UI_STATUSLINE]);
+    g_ui[UI_SIDEBAR].min_width = 16;
+    g_ui[UI_SIDEBAR].min_height = 1;
+    g_ui[UI_PLAYER].min_width = 20;
+    g_ui[UI_PLAYER].min_height = 1;
+
+    ui_balance();
+    ui_update(true);
 }
 
 void ui_release()
 {
-    //stdscr_release();
+    int i;
+
+    if (!g_stdscr_initialized)
+        return;
+
+    ui_statusline_release(&g_ui[UI_STATUSLINE]);
+    for (i = 0; i < UI_END; i++) {
+        if (g_ui[i].window)
+            delwin(g_ui[i].window);
+        g_ui[i].window = NULL;
+    }
+
+    stdscr_release();
+}
+
+/**
+ * Moves an element to its place in the layout. Its window is moved and
+ * resized in place, only created the first time the element has room, and
+ * kept while it has none. An element that didn't move is left alone and
+ * not redrawn.
+ *
+ * @param ui ui_t
+ * @param x column
+ * @param y row
+ * @param width 0 if the element has no room
+ * @param height 0 if the element has no room
+ */
+static void ui_place(ui_t *ui, int x, int y, int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        width = height = 0;
+
+    if (ui->x == (unsigned int) x && ui->y == (unsigned int) y &&
+        ui->width == (unsigned int) width && ui->height == (unsigned int) height)
+        return;
+
+    ui->x = x;
+    ui->y = y;
+    ui->width = width;
+    ui->height = height;
+    ui->flags |= UI_FLAG_DIRTY;
+
+    if (width == 0)
+        return;
+
+    // resized first, the new size always fits at the new place
+    if (ui->window == NULL) {
+        ui->window = newwin(height, width, y, x);
+    } else {
+        wresize(ui->window, height, width);
+        mvwin(ui->window, y, x);
+    }
 }
 
+/**
+ * Lays out the elements for the terminal: the status line along the bottom,
+ * the sidebar on the left at its preferred width, down to its minimum, and
+ * the player in the rest. The sidebar goes first when the player wouldn't
+ * keep its minimum width. The layout is cached, nothing is computed unless
+ * the terminal size changed or ui_invalidate() was called, and only the
+ * elements that moved are marked for redrawing.
+ */
 void ui_balance()
 {
+    int lines, cols;
+    int status, sidebar, rows;
+
+    if (!g_stdscr_initialized)
+        return;
+
+    getmaxyx(stdscr, lines, cols);
+    if (!g_layout_dirty && lines == g_layout_lines && cols == g_layout_cols)
+        return;
 
+    status = MIN(lines, (int) MAX(g_ui[UI_STATUSLINE].min_height, 1));
+    rows = lines - status;
+
+    sidebar = MAX(MIN(UI_SIDEBAR_WIDTH, cols / 3),
+                  (int) g_ui[UI_SIDEBAR].min_width);
+    if (rows < (int) g_ui[UI_SIDEBAR].min_height ||
+        sidebar + (int) g_ui[UI_PLAYER].min_width > cols)
+        sidebar = 0;
+
+    ui_place(&g_ui[UI_STATUSLINE], 0, rows, cols, status);
+    ui_place(&g_ui[UI_SIDEBAR], 0, 0, sidebar, rows);
+    ui_place(&g_ui[UI_PLAYER], sidebar, 0, cols - sidebar,
+             rows < (int) g_ui[UI_PLAYER].min_height ? 0 : rows);
+
+    g_layout_lines = lines;
+    g_layout_cols = cols;
+    g_layout_dirty = false;
+    g_layout_time = ui_now_ms();
+}
+
+/**
+ * Has the next ui_balance() lay out again, e.g. after an element changed its
+ * minimum size.
+ */
+void ui_invalidate()
+{
+    g_layout_dirty = true;
 }
 
+/**
+ * Notes that the terminal was resized, ui_tick() lays it out.
+ */
+void ui_resize()
+{
+    g_resize_pending = true;
+}
+
+/**
+ * Redraws the status line every AUDIO_SNAPSHOT_MS, as often as the audio
+ * threads publish what it shows, and lays out and redraws after a resize.
+ * A resize right after the last layout waits until UI_RESIZE_MS have
+ * passed, so dragging the window corner or a slow link delivering a burst
+ * of SIGWINCH redraws a few times a second with the latest size instead of
+ * once per signal. Call from the main thread.
+ *
+ * @return milliseconds until it wants to be called again, 0 for never
+ */
+int ui_tick()
+{
+    struct winsize ws;
+    uint64_t now, elapsed;
+    bool draw = false;
+    int wait;
+
+    if (!g_stdscr_initialized)
+        return 0;
+
+    now = ui_now_ms();
+    elapsed = now - g_status_time;
+    if (elapsed >= AUDIO_SNAPSHOT_MS) {
+        g_ui[UI_STATUSLINE].flags |= UI_FLAG_DIRTY;
+        g_status_time = now;
+        wait = AUDIO_SNAPSHOT_MS;
+        draw = true;
+    } else {
+        wait = AUDIO_SNAPSHOT_MS - elapsed;
+    }
+
+    if (g_resize_pending) {
+        elapsed = now - g_layout_time;
+        if (elapsed < UI_RESIZE_MS) {
+            wait = MIN(wait, (int) (UI_RESIZE_MS - elapsed));
+        } else {
+            g_resize_pending = false;
+
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+                resizeterm(ws.ws_row, ws.ws_col);
+
+            ui_balance();
+            draw = true;
+        }
+    }
+
+    if (draw)
+        ui_update(false);
+
+    return wait;
+}
+
+/**
+ * Draws the elements marked dirty, or all of them on redraw, and puts them
+ * on the terminal in one update. Elements without room aren't drawn.
+ *
+ * @param redraw repaint everything, e.g. after the terminal was garbled
+ */
 void ui_update(bool redraw)
 {
+    int i;
+    ui_t *ui;
+
+    if (!g_stdscr_initialized)
+        return;
+
     if (redraw)
         redrawwin(stdscr);
+
+    for (i = 0; i < UI_END; i++) {
+        ui = &g_ui[i];
+
+        if (ui->window == NULL || ui->width == 0 ||
+            (!redraw && !(ui->flags & UI_FLAG_DIRTY)))
+            continue;
+
+        if (ui->ui_draw_cb) {
+            ui->ui_draw_cb(ui);
+        } else {
+            werase(ui->window);
+            wnoutrefresh(ui->window);
+        }
+
+        ui->flags &= ~UI_FLAG_DIRTY;
+    }
+
+    doupdate();
 }
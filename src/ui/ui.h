@@ -8,6 +8,9 @@
 
 #define KEY_ESC 0x1b
 
+#define UI_SIDEBAR_WIDTH    28      // preferred, shrinks to min_width
+#define UI_RESIZE_MS        50      // resizes closer together are laid out once
+
 typedef enum ui_flags_e {
     UI_FLAG_FOCUS = 1 << 0,
     UI_FLAG_DIRTY = 1 << 1
@@ -24,10 +27,12 @@ struct ui_s;
 typedef void (*ui_draw_cb_t)(struct ui_s *);
 
 typedef struct ui_s {
-    WINDOW *window;
+    WINDOW *window;             // kept across layouts, moved and resized
     ui_flags_t flags;
 
-    unsigned int width;
+    unsigned int x;             // geometry of the last layout
+    unsigned int y;
+    unsigned int width;         // 0 when there's no room for the element
     unsigned int height;
     unsigned int min_width;     // min width for ui element
     unsigned int min_height;    // min height for ui element
@@ -42,6 +47,9 @@ void ui_init();
 void ui_release();
 
 void ui_balance();
+void ui_invalidate();
+void ui_resize();
+int ui_tick();
 void ui_update(bool redraw);
 
 #endif
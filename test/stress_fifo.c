@@ -0,0 +1,304 @@
+/**
+ * Concurrency stress harness for audio_fifo_t. Producers, sinks, flushes,
+ * seeks, pauses and device switches all run at once for a while, then the
+ * harness checks that no chunk leaked, that every sink's byte count matches
+ * what is really buffered for it and that all audio memory was given back,
+ * and reports the worst stalls seen by consumers and producers. Meant to be
+ * built with -fsanitize=thread, see rake test:stress.
+ */
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio.h"
+
+
+#define STRESS_SINKS        3
+#define STRESS_PRODUCERS    2
+#define STRESS_CHANNELS     2
+#define STRESS_RATE         44100
+#define STRESS_MAX_FRAMES   2048
+#define STRESS_TRACK_MS     200     // short tracks so the crossfade window is hit
+#define STRESS_CROSSFADE_MS 50
+#define STRESS_MEM_BUDGET   (512 * 1024)   // low enough for writes to be refused
+
+typedef struct stress_stats_s {
+    uint64_t last_write;        // ns, previous write on this sink
+    uint64_t worst_gap;         // ns, longest time between two writes
+    unsigned long writes;
+} stress_stats_t;
+
+static audio_fifo_t g_fifo;
+static int g_running = 1;
+static stress_stats_t g_sink_stats[STRESS_SINKS];
+static uint64_t g_producer_worst;       // ns, slowest audio_fifo_write()
+static unsigned long g_flushes, g_seeks, g_pauses, g_transitions, g_switches;
+static unsigned long g_handovers;      // by the sink threads
+
+
+static bool stress_running()
+{
+    return __sync_add_and_fetch(&g_running, 0);
+}
+
+static uint64_t stress_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stress_open(audio_sink_t *sink, int rate, int channels)
+{
+    sink->handle = &g_sink_stats[sink->name[0] - '0'];
+    return 0;
+}
+
+/**
+ * Records the gap since this sink's previous write. Gaps while paused are
+ * expected and not counted, the handle points at the sink's stats.
+ */
+static int stress_write(audio_sink_t *sink, const float *samples, int nframes)
+{
+    stress_stats_t *stats = &g_sink_stats[sink->name[0] - '0'];
+    uint64_t now = stress_now();
+
+    if (stats->last_write && now - stats->last_write > stats->worst_gap)
+        stats->worst_gap = now - stats->last_write;
+
+    stats->last_write = now;
+    stats->writes++;
+
+    // touch the samples so tsan sees the read
+    return samples[0] == samples[0] ? nframes : 0;
+}
+
+static void stress_close(audio_sink_t *sink)
+{
+    sink->handle = NULL;
+}
+
+/**
+ * Paused sinks don't write, forget the last write so the pause isn't
+ * reported as a stall.
+ */
+static void stress_pause(audio_sink_t *sink, bool paused)
+{
+    g_sink_stats[sink->name[0] - '0'].last_write = 0;
+}
+
+static void stress_drop(audio_sink_t *sink)
+{
+    g_sink_stats[sink->name[0] - '0'].last_write = 0;
+}
+
+/**
+ * Nothing is queued in a stress sink, only count the handover.
+ */
+static void stress_handover(audio_sink_t *sink, audio_sink_t *next)
+{
+    __sync_add_and_fetch(&g_handovers, 1);
+}
+
+static const audio_sink_ops_t stress_sink_ops = {
+    .open   = &stress_open,
+    .write  = &stress_write,
+    .close  = &stress_close,
+    .drop   = &stress_drop,
+    .pause  = &stress_pause,
+    .handover = &stress_handover
+};
+
+/**
+ * Writes chunks of random size as fast as the fifo takes them, tracking
+ * the slowest write.
+ */
+static void *stress_producer(void *arg)
+{
+    static int16_t frames[STRESS_MAX_FRAMES * STRESS_CHANNELS];
+    unsigned int seed = (unsigned int) (uintptr_t) arg;
+    uint64_t start, elapsed;
+    int nframes;
+
+    while (stress_running()) {
+        nframes = 1 + rand_r(&seed) % STRESS_MAX_FRAMES;
+
+        start = stress_now();
+        if (audio_fifo_write(&g_fifo, STRESS_CHANNELS, STRESS_RATE,
+                             frames, nframes) == 0)
+            sched_yield();
+        elapsed = stress_now() - start;
+
+        // racy max is fine, the worst value only ever grows
+        if (elapsed > __sync_add_and_fetch(&g_producer_worst, 0))
+            __sync_lock_test_and_set(&g_producer_worst, elapsed);
+    }
+
+    return NULL;
+}
+
+/**
+ * Flushes, seeks, pauses, changes tracks and switches a sink to another
+ * device at random short intervals. Track changes either crossfade into the
+ * next track or drain the held back end, like the player does at the end of
+ * a track. A switch reopens the same name, stats are kept by name.
+ */
+static void *stress_control(void *arg)
+{
+    unsigned int seed = 42;
+    char name[2] = { 0, 0 };
+    int i;
+
+    while (stress_running()) {
+        usleep(rand_r(&seed) % 2000);
+
+        switch (rand_r(&seed) % 7) {
+        case 0:
+            audio_fifo_flush(&g_fifo);
+            g_flushes++;
+            break;
+        case 1:
+            audio_fifo_seek(&g_fifo, 0);
+            g_seeks++;
+            break;
+        case 2:
+            audio_fifo_pause(&g_fifo, true);
+            usleep(rand_r(&seed) % 1000);
+            audio_fifo_pause(&g_fifo, false);
+            g_pauses++;
+            break;
+        case 3:
+            audio_fifo_track(&g_fifo, 1.0f, STRESS_TRACK_MS);
+            audio_fifo_set_next(&g_fifo, true);
+            break;
+        case 4:
+            if (rand_r(&seed) % 2) {
+                audio_fifo_next(&g_fifo, 0.5f, STRESS_TRACK_MS);
+                audio_fifo_set_next(&g_fifo, true);
+            } else {
+                while (audio_fifo_drain(&g_fifo) && stress_running())
+                    usleep(1000);
+            }
+            g_transitions++;
+            break;
+        case 5:
+            i = rand_r(&seed) % STRESS_SINKS;
+            name[0] = '0' + i;
+            if (audio_sink_switch(g_fifo.sinks[i], name))
+                g_switches++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Compares every sink's queued byte count with the chunks really between
+ * its cursor and the head.
+ *
+ * @return number of sinks whose counter drifted
+ */
+static int stress_check_drift()
+{
+    int i, drifted = 0;
+    uint64_t pos;
+    size_t bytes;
+    audio_sink_t *sink;
+
+    pthread_mutex_lock(&g_fifo.mutex);
+
+    for (i = 0; i < g_fifo.nsinks; i++) {
+        sink = g_fifo.sinks[i];
+        bytes = 0;
+
+        for (pos = sink->cursor; pos < g_fifo.head; pos++) {
+            if (g_fifo.slots[pos % AUDIO_FIFO_SLOTS] == NULL) {
+                fprintf(stderr, "sink %s: empty slot %llu below head\n",
+                        sink->name, (unsigned long long) pos);
+                drifted++;
+                break;
+            }
+            bytes += g_fifo.slots[pos % AUDIO_FIFO_SLOTS]->sample_size;
+        }
+
+        if (bytes != sink->queued) {
+            fprintf(stderr, "sink %s: queued %zu bytes, actually %zu\n",
+                    sink->name, sink->queued, bytes);
+            drifted++;
+        }
+    }
+
+    pthread_mutex_unlock(&g_fifo.mutex);
+
+    return drifted;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int seconds = argc > 1 ? atoi(argv[1]) : 10;
+    int failures = 0;
+    long leaked;
+    mem_stats_t mem;
+    char name[2];
+    pthread_t producers[STRESS_PRODUCERS];
+    pthread_t control;
+
+    mem_set_budget(MEM_AUDIO, STRESS_MEM_BUDGET);
+    audio_fifo_init(&g_fifo);
+    audio_fifo_set_crossfade(&g_fifo, STRESS_CROSSFADE_MS, CROSSFADE_EQUAL_POWER);
+
+    for (i = 0; i < STRESS_SINKS; i++) {
+        name[0] = '0' + i;
+        name[1] = '\0';
+        audio_fifo_add_sink(&g_fifo, audio_sink_create(&stress_sink_ops, name));
+    }
+
+    for (i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_create(&producers[i], NULL, stress_producer, (void *) (uintptr_t) (i + 1));
+    pthread_create(&control, NULL, stress_control, NULL);
+
+    sleep(seconds);
+    __sync_lock_test_and_set(&g_running, 0);
+
+    for (i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_join(producers[i], NULL);
+    pthread_join(control, NULL);
+
+    // nothing writes anymore, counters must match the ring exactly
+    failures += stress_check_drift();
+
+    audio_fifo_release(&g_fifo);
+
+    leaked = audio_data_live();
+    if (leaked != 0) {
+        fprintf(stderr, "%ld chunks leaked\n", leaked);
+        failures++;
+    }
+
+    mem_stats(MEM_AUDIO, &mem);
+    if (mem.used != 0) {
+        fprintf(stderr, "%zu bytes of audio memory still accounted\n", mem.used);
+        failures++;
+    }
+
+    printf("%d s, %lu flushes, %lu seeks, %lu pauses, %lu transitions\n",
+           seconds, g_flushes, g_seeks, g_pauses, g_transitions);
+    printf("%lu switches, %lu handed over\n", g_switches, g_handovers);
+    for (i = 0; i < STRESS_SINKS; i++)
+        printf("sink %d: %lu writes, worst stall %.3f ms\n", i,
+               g_sink_stats[i].writes, g_sink_stats[i].worst_gap / 1E6);
+    printf("producer: worst write %.3f ms\n", g_producer_worst / 1E6);
+    printf("audio memory: peak %zu KB, %lu writes refused\n",
+           mem.peak / 1024, mem.refused);
+    printf("%s\n", failures ? "FAILED" : "OK");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}